@@ -0,0 +1,79 @@
+//
+// Content-addressed asset cache
+//
+// Textures and meshes are keyed by a hash of their source bytes rather than by path, so
+// the same image or model loaded from two different directories (or twice from the same
+// one) is decoded and uploaded only once and every caller gets the same GL object back.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "ContentHash.h"
+
+// Seeds keep different kinds of assets built from identical bytes apart
+const uint64_t ASSET_SEED_TEXTURE = 0x7465787475726531ULL;
+const uint64_t ASSET_SEED_TEXTURE_ARRAY = 0x7465786172726131ULL;
+const uint64_t ASSET_SEED_MESH_VBO = 0x6d65736876626f31ULL;
+const uint64_t ASSET_SEED_MESH_EBO = 0x6d65736865626f31ULL;
+
+struct CachedMesh
+{
+    GLuint VAO;
+    int vertexCount;
+    std::vector<GLuint> buffers; // the vertex and element buffers the VAO reads
+};
+
+struct AssetCache
+{
+    std::unordered_map<uint64_t, GLuint> textures;
+    std::unordered_map<uint64_t, CachedMesh> meshes;
+    int hits = 0;
+    int misses = 0;
+};
+
+// Returns the texture already created for this content, or 0
+GLuint findCachedTexture(AssetCache &cache, uint64_t key)
+{
+    std::unordered_map<uint64_t, GLuint>::iterator it = cache.textures.find(key);
+    if (it == cache.textures.end())
+    {
+        cache.misses++;
+        return 0;
+    }
+    cache.hits++;
+    return it->second;
+}
+
+bool findCachedMesh(AssetCache &cache, uint64_t key, CachedMesh &mesh)
+{
+    std::unordered_map<uint64_t, CachedMesh>::iterator it = cache.meshes.find(key);
+    if (it == cache.meshes.end())
+    {
+        cache.misses++;
+        return false;
+    }
+    cache.hits++;
+    mesh = it->second;
+    return true;
+}
+
+// Deletes every texture, VAO and mesh buffer owned by the cache
+void releaseAssetCache(AssetCache &cache)
+{
+    for (std::unordered_map<uint64_t, GLuint>::iterator it = cache.textures.begin(); it != cache.textures.end(); ++it)
+        glDeleteTextures(1, &it->second);
+    for (std::unordered_map<uint64_t, CachedMesh>::iterator it = cache.meshes.begin(); it != cache.meshes.end(); ++it)
+    {
+        glDeleteVertexArrays(1, &it->second.VAO);
+        if (!it->second.buffers.empty())
+            glDeleteBuffers((GLsizei)it->second.buffers.size(), it->second.buffers.data());
+    }
+    cache.textures.clear();
+    cache.meshes.clear();
+}
@@ -0,0 +1,407 @@
+//
+// Asset pack - every file under Models/ and Textures/ in one memory-mapped archive
+//
+// Layout (all integers little endian):
+//   AssetPackHeader
+//   entry data, each entry starting on an ASSET_PACK_ALIGNMENT boundary
+//   AssetPackEntry[entryCount]  at header.indexOffset
+//   path strings                at header.namesOffset, not null terminated
+//
+// Entries are either stored as-is or compressed with the LZ4 block format. Stored entries
+// are handed out as a pointer into the mapping, so loading them does no file I/O at all.
+// The pack is built by packAssets.cpp.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ContentHash.h"
+
+const char ASSET_PACK_MAGIC[8] = {'C', '3', '7', '1', 'P', 'A', 'C', 'K'};
+const uint32_t ASSET_PACK_VERSION = 1;
+const uint64_t ASSET_PACK_ALIGNMENT = 64;
+const uint32_t ASSET_PACK_COMPRESSED = 1;
+
+struct AssetPackHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint64_t indexOffset;
+    uint64_t namesOffset;
+    uint64_t namesSize;
+};
+
+struct AssetPackEntry
+{
+    uint64_t pathHash;
+    uint64_t offset;
+    uint64_t storedSize;
+    uint64_t size;
+    uint32_t flags;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t reserved;
+};
+
+struct AssetPack
+{
+    const unsigned char *base = nullptr;
+    size_t size = 0;
+    const AssetPackEntry *entries = nullptr;
+    uint32_t entryCount = 0;
+    const char *names = nullptr;
+    std::unordered_map<uint64_t, uint32_t> lookup;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+// Bytes of one asset: either a view into the pack mapping or a copy held in storage
+struct AssetBytes
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    std::vector<unsigned char> storage;
+};
+
+// Paths are stored with forward slashes and without a leading "./"
+inline std::string normalizeAssetPath(const char *path)
+{
+    std::string normalized(path);
+    for (size_t i = 0; i < normalized.size(); i++)
+        if (normalized[i] == '\\')
+            normalized[i] = '/';
+    while (normalized.compare(0, 2, "./") == 0)
+        normalized.erase(0, 2);
+    return normalized;
+}
+
+inline uint64_t hashAssetPath(const std::string &path)
+{
+    return hashContents(path.data(), path.size());
+}
+
+// LZ4 block format, used for entries that shrink enough to be worth decompressing
+inline void lz4WriteLength(std::vector<unsigned char> &out, size_t length)
+{
+    while (length >= 255)
+    {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back((unsigned char)length);
+}
+
+void lz4Compress(const unsigned char *src, size_t size, std::vector<unsigned char> &out)
+{
+    const int HASH_BITS = 16;
+    std::vector<int64_t> table((size_t)1 << HASH_BITS, -1);
+    out.clear();
+
+    size_t anchor = 0;
+    size_t i = 0;
+    // The format requires the last match to start 12 bytes before the end and the last
+    // 5 bytes to be literals
+    while (size >= 13 && i + 12 <= size)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, src + i, 4);
+        uint32_t h = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        int64_t ref = table[h];
+        table[h] = (int64_t)i;
+
+        uint32_t refSequence = 0;
+        if (ref >= 0)
+            memcpy(&refSequence, src + ref, 4);
+        if (ref < 0 || i - ref > 65535 || refSequence != sequence)
+        {
+            i++;
+            continue;
+        }
+
+        size_t matchLength = 4;
+        while (i + matchLength < size - 5 && src[ref + matchLength] == src[i + matchLength])
+            matchLength++;
+
+        size_t literalLength = i - anchor;
+        unsigned char token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+        token |= (unsigned char)(matchLength - 4 < 15 ? matchLength - 4 : 15);
+        out.push_back(token);
+        if (literalLength >= 15)
+            lz4WriteLength(out, literalLength - 15);
+        out.insert(out.end(), src + anchor, src + i);
+        uint16_t offset = (uint16_t)(i - ref);
+        out.push_back((unsigned char)(offset & 0xFF));
+        out.push_back((unsigned char)(offset >> 8));
+        if (matchLength - 4 >= 15)
+            lz4WriteLength(out, matchLength - 4 - 15);
+
+        i += matchLength;
+        anchor = i;
+    }
+
+    size_t literalLength = size - anchor;
+    out.push_back((unsigned char)((literalLength < 15 ? literalLength : 15) << 4));
+    if (literalLength >= 15)
+        lz4WriteLength(out, literalLength - 15);
+    out.insert(out.end(), src + anchor, src + size);
+}
+
+bool lz4Decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize)
+{
+    const unsigned char *ip = src;
+    const unsigned char *ipEnd = src + srcSize;
+    unsigned char *op = dst;
+    unsigned char *opEnd = dst + dstSize;
+
+    while (ip < ipEnd)
+    {
+        unsigned char token = *ip++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            unsigned char extra;
+            do
+            {
+                if (ip >= ipEnd)
+                    return false;
+                extra = *ip++;
+                literalLength += extra;
+            } while (extra == 255);
+        }
+        if (literalLength > (size_t)(ipEnd - ip) || literalLength > (size_t)(opEnd - op))
+            return false;
+        memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == ipEnd)
+            break; // The last sequence has no match
+
+        if (ipEnd - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return false;
+
+        size_t matchLength = (token & 15) + 4;
+        if ((token & 15) == 15)
+        {
+            unsigned char extra;
+            do
+            {
+                if (ip >= ipEnd)
+                    return false;
+                extra = *ip++;
+                matchLength += extra;
+            } while (extra == 255);
+        }
+        if (matchLength > (size_t)(opEnd - op))
+            return false;
+
+        // Matches may overlap the bytes they produce, copy forwards one byte at a time
+        const unsigned char *match = op - offset;
+        for (size_t k = 0; k < matchLength; k++)
+            op[k] = match[k];
+        op += matchLength;
+    }
+
+    return op == opEnd;
+}
+
+void closeAssetPack(AssetPack &pack)
+{
+    if (pack.base != nullptr)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(pack.base);
+        CloseHandle(pack.mapping);
+        CloseHandle(pack.file);
+        pack.mapping = NULL;
+        pack.file = INVALID_HANDLE_VALUE;
+#else
+        munmap((void *)pack.base, pack.size);
+#endif
+    }
+    pack.base = nullptr;
+    pack.size = 0;
+    pack.entries = nullptr;
+    pack.entryCount = 0;
+    pack.names = nullptr;
+    pack.lookup.clear();
+}
+
+bool openAssetPack(AssetPack &pack, const char *path)
+{
+#ifdef _WIN32
+    pack.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (pack.file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(pack.file, &fileSize);
+    pack.mapping = CreateFileMappingA(pack.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    pack.base = pack.mapping ? (const unsigned char *)MapViewOfFile(pack.mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    pack.size = (size_t)fileSize.QuadPart;
+    if (pack.base == nullptr)
+    {
+        if (pack.mapping)
+            CloseHandle(pack.mapping);
+        CloseHandle(pack.file);
+        pack.mapping = NULL;
+        pack.file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(AssetPackHeader))
+    {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    // The whole pack is read front to back during startup
+    madvise(mapped, (size_t)info.st_size, MADV_WILLNEED);
+    pack.base = (const unsigned char *)mapped;
+    pack.size = (size_t)info.st_size;
+#endif
+
+    const AssetPackHeader *header = (const AssetPackHeader *)pack.base;
+    bool valid = pack.size >= sizeof(AssetPackHeader) &&
+                 memcmp(header->magic, ASSET_PACK_MAGIC, sizeof(ASSET_PACK_MAGIC)) == 0 &&
+                 header->version == ASSET_PACK_VERSION &&
+                 header->indexOffset % alignof(AssetPackEntry) == 0 &&
+                 header->indexOffset + (uint64_t)header->entryCount * sizeof(AssetPackEntry) <= pack.size &&
+                 header->namesOffset + header->namesSize <= pack.size;
+    if (!valid)
+    {
+        fprintf(stderr, "Invalid asset pack: %s\n", path);
+        closeAssetPack(pack);
+        return false;
+    }
+
+    pack.entries = (const AssetPackEntry *)(pack.base + header->indexOffset);
+    pack.entryCount = header->entryCount;
+    pack.names = (const char *)(pack.base + header->namesOffset);
+    for (uint32_t i = 0; i < pack.entryCount; i++)
+    {
+        const AssetPackEntry &entry = pack.entries[i];
+        if (entry.offset + entry.storedSize > pack.size || entry.nameOffset + (uint64_t)entry.nameLength > header->namesSize)
+        {
+            fprintf(stderr, "Corrupt asset pack entry %u in %s\n", i, path);
+            closeAssetPack(pack);
+            return false;
+        }
+        pack.lookup[entry.pathHash] = i;
+    }
+    return true;
+}
+
+// Looks for the pack in $COMP371_ASSET_PACK, next to the executable, then in the working directory
+bool openAssetPackNearExecutable(AssetPack &pack, const char *executablePath)
+{
+    const char *override = getenv("COMP371_ASSET_PACK");
+    if (override != nullptr)
+        return openAssetPack(pack, override);
+
+    if (executablePath != nullptr)
+    {
+        std::string directory(executablePath);
+        size_t slash = directory.find_last_of("/\\");
+        if (slash != std::string::npos)
+        {
+            std::string candidate = directory.substr(0, slash + 1) + "assets.pack";
+            if (openAssetPack(pack, candidate.c_str()))
+                return true;
+        }
+    }
+    return openAssetPack(pack, "assets.pack");
+}
+
+const AssetPackEntry *findAssetPackEntry(const AssetPack &pack, const char *path)
+{
+    if (pack.base == nullptr)
+        return nullptr;
+
+    std::string normalized = normalizeAssetPath(path);
+    std::unordered_map<uint64_t, uint32_t>::const_iterator it = pack.lookup.find(hashAssetPath(normalized));
+    if (it == pack.lookup.end())
+        return nullptr;
+
+    const AssetPackEntry &entry = pack.entries[it->second];
+    if (entry.nameLength != normalized.size() || memcmp(pack.names + entry.nameOffset, normalized.data(), entry.nameLength) != 0)
+        return nullptr;
+    return &entry;
+}
+
+// Get the bytes of an asset from the pack, or from the loose file when it is not packed
+bool loadAssetBytes(const AssetPack &pack, const char *path, AssetBytes &bytes)
+{
+    const AssetPackEntry *entry = findAssetPackEntry(pack, path);
+    if (entry != nullptr)
+    {
+        const unsigned char *stored = pack.base + entry->offset;
+        if ((entry->flags & ASSET_PACK_COMPRESSED) == 0)
+        {
+            bytes.data = stored;
+            bytes.size = (size_t)entry->size;
+            return true;
+        }
+
+        bytes.storage.resize((size_t)entry->size);
+        if (lz4Decompress(stored, (size_t)entry->storedSize, bytes.storage.data(), bytes.storage.size()))
+        {
+            bytes.data = bytes.storage.data();
+            bytes.size = bytes.storage.size();
+            return true;
+        }
+        fprintf(stderr, "Corrupt packed asset, trying the loose file: %s\n", path);
+    }
+
+    if (!readFileContents(path, bytes.storage))
+        return false;
+    bytes.data = bytes.storage.data();
+    bytes.size = bytes.storage.size();
+    return true;
+}
+
+// A read-only stream over the bytes, for parsers written against FILE*
+FILE *openAssetStream(const AssetBytes &bytes)
+{
+#ifdef _WIN32
+    FILE *stream = tmpfile();
+    if (stream != nullptr)
+    {
+        fwrite(bytes.data, 1, bytes.size, stream);
+        rewind(stream);
+    }
+    return stream;
+#else
+    return fmemopen((void *)bytes.data, bytes.size, "r");
+#endif
+}
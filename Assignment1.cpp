@@ -7,6 +7,9 @@
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <random>
+#include <cstring>
+#include <cstdlib>
 
 
 #define GLEW_STATIC 1   // This allows linking with Static Library on Windows, without DLL
@@ -25,132 +28,92 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
+#include "TextureUpload.h" //For streaming texture data through pixel buffer objects
+#include "AssetCache.h"    //For sharing textures and models with identical contents
+#include "AssetPack.h"     //For reading assets out of the memory-mapped assets.pack
+#include "ShaderCache.h"   //For reusing linked shader binaries between runs
+#include "ShaderPermutations.h" //For building shader variants from one source
+#include "UniformBuffers.h" //For the per-frame and per-object uniform blocks
+#include "InstancedRenderer.h" //For drawing every object that shares a mesh in one call
+#include "FrustumCulling.h"   //For the view frustum planes and sphere tests
+#include "BoundingVolumeHierarchy.h" //For culling the planets and asteroids as a tree
+#include "OcclusionCulling.h" //For skipping objects hidden behind the planets
+#include "RenderContext.h" //For the window, or an offscreen framebuffer with -headless
+#include "FrameBenchmark.h" //For timing frames over a replayed input path
+#include "Profiler.h"       //For CPU and GPU scope timings written as a Chrome trace
+#include "WorkerPool.h"     //For the worker threads culling and recording run on
+#include "DepthPrepass.h"   //For the depth pre-pass, draw ordering and fragment counts
+#include "FramePacing.h"    //For frames in flight, a target frame time and input latency
+#include "CommandList.h"    //For culling and recording the instances on worker threads
+#include "FixedTimestep.h"  //For the fixed-step simulation clock
+
 
 using namespace glm;
 using namespace std;
 
-GLuint loadTexture(const char *filename);
+GLuint loadTexture(const char *filename, int maxSize = 0);
+GLuint loadTextureArray(const char *const *filenames, int count);
 
-const char* getVertexShaderSource()
-{
-    // For now, you use a string for your shader code, in the assignment, shaders will be stored in .glsl files
-    return
-        "#version 330 core\n"
-        "layout (location = 0) in vec3 aPos;\n"
-        "layout (location = 1) in vec3 aNormal;\n"
-        "layout (location = 2) in vec2 aTexCoord;\n"
-        "\n"
-        "out vec2 TexCoord;\n"
-        "\n"
-        "uniform mat4 worldMatrix;\n"
-        "uniform mat4 viewMatrix;\n"
-        "uniform mat4 projectionMatrix;\n"
-        "\n"
-        "   void main()\n"
-        "   {\n"
-        "       gl_Position = projectionMatrix * viewMatrix * worldMatrix * vec4(aPos, 1.0);\n"
-        "       TexCoord = aTexCoord;\n"
-        "   }\n";
-}
+// Staging ring for texture uploads, large enough for a few 2048x1024 planet maps in flight
+TextureUploadRing textureUploadRing;
 
-const char* getFragmentShaderSource()
-{
-    return
-    "#version 330 core\n"
-    "in vec2 TexCoord;\n"
-    "out vec4 FragColor;\n"
-    "\n"
-    "uniform sampler2D planetTexture;\n"
-    "\n"
-    "   void main()\n"
-    "   {\n"
-    "       FragColor = texture(planetTexture, TexCoord);\n"
-    "   }\n";
-}
+// Textures and models keyed by content, so duplicates are only loaded once
+AssetCache assetCache;
 
+// Packed Models/ and Textures/, loose files are used when it is missing
+AssetPack assetPack;
 
+// Linked program binaries from previous runs
+ShaderCache shaderCache;
 
-int compileAndLinkShaders(const char* vertexShaderSource, const char* fragmentShaderSource)
-{
-    // compile and link shader program
-    // return shader program id
-    // ------------------------------------
-
-    // vertex shader
-    int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-    
-    // check for shader compile errors
-    int success;
-    char infoLog[512];
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-        std::cerr << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-    
-    // fragment shader
-    int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-    
-    // check for shader compile errors
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-        std::cerr << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-    
-    // link shaders
-    int shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    
-    // check for linking errors
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
-    
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    
-    return shaderProgram;
-}
+// Variants of the shared uber shader, compiled as they are first requested
+ShaderLibrary shaderLibrary;
 
-void setProjectionMatrix(int shaderProgram, mat4 projectionMatrix)
-{
-    glUseProgram(shaderProgram);
-    GLuint projectionMatrixLocation = glGetUniformLocation(shaderProgram, "projectionMatrix");
-    glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, &projectionMatrix[0][0]);
-}
+// Per-frame and per-object uniform blocks shared by every program
+UniformBuffers uniformBuffers;
 
-void setViewMatrix(int shaderProgram, mat4 viewMatrix)
-{
-    glUseProgram(shaderProgram);
-    GLuint viewMatrixLocation = glGetUniformLocation(shaderProgram, "viewMatrix");
-    glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &viewMatrix[0][0]);
-}
+// The window, or the offscreen framebuffer with -headless
+RenderContext renderContext;
 
-void setWorldMatrix(int shaderProgram, mat4 worldMatrix)
-{
-	glUseProgram(shaderProgram);
-	GLuint worldMatrixLocation = glGetUniformLocation(shaderProgram, "worldMatrix");
-	glUniformMatrix4fv(worldMatrixLocation, 1, GL_FALSE, &worldMatrix[0][0]);
-}
+// Frame times over a replayed input path, with -benchmark
+FrameBenchmark frameBenchmark;
+
+// Depth pre-pass and front-to-back ordering settings, with -prepass and -unsorted
+DepthPrepass depthPrepass;
+
+// Frames in flight and the target frame time, with -framesinflight and -fps
+FramePacer framePacer;
+
+// Threads that record the frame's instances, with -recordthreads
+CommandRecorder commandRecorder;
+
+// Steps the planets and the belt at a fixed rate, with -simrate
+FixedTimestep simulation;
 
 GLuint setupModelVBO(string path, int& vertexCount) {
+	//Reuse the VAO if a model with the same contents was already set up
+	AssetBytes contents;
+	bool hashed = loadAssetBytes(assetPack, path.c_str(), contents);
+	uint64_t contentKey = hashed ? hashContents(contents.data, contents.size, ASSET_SEED_MESH_VBO) : 0;
+	CachedMesh cachedMesh;
+	if (hashed && findCachedMesh(assetCache, contentKey, cachedMesh)) {
+		vertexCount = cachedMesh.vertexCount;
+		return cachedMesh.VAO;
+	}
+
 	std::vector<glm::vec3> vertices;
 	std::vector<glm::vec3> normals;
 	std::vector<glm::vec2> UVs;
 	
-	//read the vertex data from the model's OBJ file
-	loadOBJ(path.c_str(), vertices, normals, UVs);
+	//read the vertex data from the model's OBJ file, parsing the bytes already in memory
+	FILE* stream = hashed ? openAssetStream(contents) : NULL;
+	if (stream) {
+		loadOBJ(stream, vertices, normals, UVs);
+		fclose(stream);
+	}
+	else {
+		loadOBJ(path.c_str(), vertices, normals, UVs);
+	}
 
 	GLuint VAO;
 	glGenVertexArrays(1, &VAO);
@@ -183,12 +146,28 @@ GLuint setupModelVBO(string path, int& vertexCount) {
 
 	glBindVertexArray(0); // Unbind VAO (it's always a good thing to unbind any buffer/array to prevent strange bugs, as we are using multiple VAOs)
 	vertexCount = vertices.size();
+	if (hashed) {
+		cachedMesh.VAO = VAO;
+		cachedMesh.vertexCount = vertexCount;
+		cachedMesh.buffers = {vertices_VBO, normals_VBO, uvs_VBO};
+		assetCache.meshes[contentKey] = cachedMesh;
+	}
 	return VAO;
 }
 
 //Sets up a model using an Element Buffer Object to refer to vertex data
 GLuint setupModelEBO(string path, int& vertexCount)
 {
+	//Reuse the VAO if a model with the same contents was already set up
+	AssetBytes contents;
+	bool hashed = loadAssetBytes(assetPack, path.c_str(), contents);
+	uint64_t contentKey = hashed ? hashContents(contents.data, contents.size, ASSET_SEED_MESH_EBO) : 0;
+	CachedMesh cachedMesh;
+	if (hashed && findCachedMesh(assetCache, contentKey, cachedMesh)) {
+		vertexCount = cachedMesh.vertexCount;
+		return cachedMesh.VAO;
+	}
+
 	vector<int> vertexIndices; //The contiguous sets of three indices of vertices, normals and UVs, used to make a triangle
 	vector<glm::vec3> vertices;
 	vector<glm::vec3> normals;
@@ -196,7 +175,14 @@ GLuint setupModelEBO(string path, int& vertexCount)
 
 	//read the vertices from the cube.obj file
 	//We won't be needing the normals or UVs for this program
-	loadOBJ2(path.c_str(), vertexIndices, vertices, normals, UVs);
+	FILE* stream = hashed ? openAssetStream(contents) : NULL;
+	if (stream) {
+		loadOBJ2(stream, vertexIndices, vertices, normals, UVs);
+		fclose(stream);
+	}
+	else {
+		loadOBJ2(path.c_str(), vertexIndices, vertices, normals, UVs);
+	}
 
 	GLuint VAO;
 	glGenVertexArrays(1, &VAO);
@@ -235,93 +221,170 @@ GLuint setupModelEBO(string path, int& vertexCount)
 
 	glBindVertexArray(0); // Unbind VAO (it's always a good thing to unbind any buffer/array to prevent strange bugs), remember: do NOT unbind the EBO, keep it bound to this VAO
 	vertexCount = vertexIndices.size();
+	if (hashed) {
+		cachedMesh.VAO = VAO;
+		cachedMesh.vertexCount = vertexCount;
+		cachedMesh.buffers = {vertices_VBO, normals_VBO, uvs_VBO, EBO};
+		assetCache.meshes[contentKey] = cachedMesh;
+	}
 	return VAO;
 }
 
 int main(int argc, char*argv[])
 {
-    // Initialize GLFW and OpenGL version
-    glfwInit();
-    
+    // -asteroids N adds an instanced asteroid belt between Mars and Jupiter
+    int asteroidCount = 0;
+    for (int i = 1; i + 1 < argc; i++)
+        if (strcmp(argv[i], "-asteroids") == 0)
+            asteroidCount = std::max(0, atoi(argv[i + 1]));
+
+    // Create the window and rendering context, 800x600 unless -size says otherwise.
+    // -headless renders offscreen, -frames N and -duration S end the run on their own.
+    parseRenderContextArguments(renderContext, argc, argv);
+    parseBenchmarkArguments(frameBenchmark, renderContext, argc, argv);
+    parseProfilerArguments(argc, argv);
+    parseDepthPrepassArguments(depthPrepass, argc, argv);
+    parseFramePacingArguments(framePacer, argc, argv);
+    parseCommandListArguments(commandRecorder, argc, argv);
+    parseFixedTimestepArguments(simulation, argc, argv);
 #if defined(PLATFORM_OSX)
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    bool contextCreated = createRenderContext(renderContext, "Comp371 - Solar System", 3, 2, true);
 #else
     // On windows, we set OpenGL version to 2.1, to support more hardware
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    bool contextCreated = createRenderContext(renderContext, "Comp371 - Solar System", 2, 1, false);
 #endif
-
-    // Create Window and rendering context using GLFW, resolution is 800x600
-    GLFWwindow* window = glfwCreateWindow(800, 600, "Comp371 - Solar System", NULL, NULL);
-    if (window == NULL)
+    if (!contextCreated)
     {
-        std::cerr << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
+        destroyRenderContext(renderContext);
         return -1;
     }
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
-    glfwMakeContextCurrent(window);
+    startProfiler();
+    startWorkerPool(workerPool);
+    createFramePacer(framePacer, renderContext);
+    if (renderContext.window != nullptr)
+        glfwSetInputMode(renderContext.window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
 
+    createTextureUploadRing(textureUploadRing, 32 * 1024 * 1024);
+
+    // Map assets.pack once, found next to the executable so the working directory doesn't matter
+    if (openAssetPackNearExecutable(assetPack, argv[0]))
+        std::cout << "Loading assets from pack (" << assetPack.entryCount << " entries)" << std::endl;
+
+    initShaderCache(shaderCache);
+
+    // Compile and link shaders here ...
+    // The planets are unlit and drawn as instances, so they only need the textured instanced
+    // variant. It is only queued here, the driver compiles it while the textures are decoded.
+    initShaderLibrary(shaderLibrary, &shaderCache);
+    const uint32_t planetShaderFeatures = SHADER_TEXTURED | SHADER_INSTANCED;
+    requestShaderVariant(shaderLibrary, planetShaderFeatures);
+    const uint32_t depthShaderFeatures = SHADER_DEPTH_ONLY | SHADER_INSTANCED;
+    requestShaderVariant(shaderLibrary, depthShaderFeatures);
+    createDepthPrepass(depthPrepass);
     
-    // Initialize GLEW
-    glewExperimental = true; // Needed for core profile
-    if (glewInit() != GLEW_OK) {
-        std::cerr << "Failed to create GLEW" << std::endl;
-        glfwTerminate();
-        return -1;
-    }
-    
-    GLuint sunTextureID = loadTexture("Textures/sun.jpg");
-    GLuint mercuryTextureID = loadTexture("Textures/mercury.jpg");
-    GLuint venusTextureID = loadTexture("Textures/venus.jpg");
-    GLuint earthTextureID = loadTexture("Textures/earth.jpg");
-    GLuint marsTextureID = loadTexture("Textures/mars.jpg");
-    GLuint jupiterTextureID = loadTexture("Textures/jupiter.jpg");
-    GLuint saturnTextureID = loadTexture("Textures/saturn.jpg");
-    GLuint uranusTextureID = loadTexture("Textures/uranus.jpg");
-    GLuint neptuneTextureID = loadTexture("Textures/neptune.jpg");
+    // Room for the frame's uniforms and every asteroid being visible at once
+    createDynamicBufferRing(dynamicBufferRing, 64 * 1024 + asteroidCount * sizeof(InstanceData));
+    createUniformBuffers(uniformBuffers, 16);
+
+    // The planets in order from the sun, with their distance from it and their scale
+    const int planetCount = 9;
+    const char *planetTextures[planetCount] = {"Textures/sun.jpg", "Textures/mercury.jpg", "Textures/venus.jpg",
+                                               "Textures/earth.jpg", "Textures/mars.jpg", "Textures/jupiter.jpg",
+                                               "Textures/saturn.jpg", "Textures/uranus.jpg", "Textures/neptune.jpg"};
+    const float planetDistances[planetCount] = {0.0f, 4.0f, 7.0f, 10.0f, 12.0f, 15.0f, 19.0f, 23.0f, 26.0f};
+    const float planetScales[planetCount] = {0.2f, 0.03f, 0.05f, 0.05f, 0.04f, 0.15f, 0.14f, 0.07f, 0.07f};
+
+    // The maps are all 2048x1024, so they fit in one array with a layer per planet
+    GLuint planetTextureArray = loadTextureArray(planetTextures, planetCount);
     
     // Black background
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     
-    // Compile and link shaders here ...
-    int whiteShaderProgram = compileAndLinkShaders(getVertexShaderSource(), getFragmentShaderSource());
-    
-	//Setup models
+	//Setup models, every planet is the same sphere and is drawn as an instance of it
     string planetPath = "Models/sphere.obj";
+    int planetVertices;
+    GLuint planetVAO = setupModelEBO(planetPath, planetVertices);
+    InstanceBatch planetBatch;
+    createInstanceBatch(planetBatch, shaderLibrary.layout, planetVAO, planetVertices, planetCount);
+    const float planetModelRadius = 10.0f; // sphere.obj is centered with radius 10
+
+    // Every object in the scene has a leaf in one tree, planets first and then the asteroids,
+    // and only the objects in view are added to the batches each frame. The planets' instances
+    // are made each frame, in place for the command lists to point to.
+    BoundingVolumeHierarchy sceneBVH;
+    BVHLeafOrder sceneOrder;
+    std::vector<int> planetLeaves;
+    std::vector<InstanceData> planetInstances(planetCount);
+    for (int i = 0; i < planetCount; i++)
+    {
+        vec3 center(planetDistances[i], 0.0f, 0.0f);
+        vec3 extent(planetModelRadius * planetScales[i]);
+        planetLeaves.push_back(insertBVHLeaf(sceneBVH, center - extent, center + extent, i));
+    }
 
+    // The planets in view occlude everything behind them, the sun most of all
+    OcclusionBuffer occlusionBuffer;
+    initOcclusionBuffer(occlusionBuffer);
+    OccluderMesh planetOccluder;
+    makeOccluderSphere(planetOccluder, planetModelRadius, 12, 24);
+    initCommandRecorder(commandRecorder);
+
+    // The asteroids never change relative to each other, they are placed once and the whole
+    // belt is turned through its object block. Their leaves follow the turning belt.
+    InstanceBatch asteroidBatch;
+    std::vector<InstanceData> asteroidInstances;
+    std::vector<vec4> asteroidSpheres; // belt space center and radius
+    std::vector<int> asteroidLeaves;
+    if (asteroidCount > 0)
+    {
+        int asteroidVertices;
+        GLuint asteroidVAO = setupModelEBO("Models/cube.obj", asteroidVertices);
+        createInstanceBatch(asteroidBatch, shaderLibrary.layout, asteroidVAO, asteroidVertices, asteroidCount);
 
-    int sunVertices;
-    GLuint sunVAO = setupModelEBO(planetPath, sunVertices);
-
-    int mercuryVertices;
-    GLuint mercuryVAO = setupModelEBO(planetPath, mercuryVertices);
-
-    int venusVertices;
-    GLuint venusVAO = setupModelEBO(planetPath, venusVertices);
-
-    int earthVertices;
-    GLuint earthVAO = setupModelEBO(planetPath, earthVertices);
-
-    int marsVertices;
-    GLuint marsVAO = setupModelEBO(planetPath, marsVertices);
-    
-    int jupiterVertices;
-    GLuint jupiterVAO = setupModelEBO(planetPath, jupiterVertices);
-
-    int saturnVertices;
-    GLuint saturnVAO = setupModelEBO(planetPath, saturnVertices);
-
-    int uranusVertices;
-    GLuint uranusVAO = setupModelEBO(planetPath, uranusVertices);
-
-    int neptuneVertices;
-    GLuint neptuneVAO = setupModelEBO(planetPath, neptuneVertices);
-
+        std::mt19937 random(371); // fixed seed, the belt looks the same every run
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        for (int i = 0; i < asteroidCount; i++)
+        {
+            float angle = radians(360.0f * unit(random));
+            float radius = 13.0f + unit(random);
+            float height = (unit(random) - 0.5f) * 0.4f;
+            vec3 axis = normalize(vec3(unit(random), unit(random), unit(random)) + vec3(0.01f));
+            mat4 asteroidWorldMatrix =
+                glm::translate(mat4(1.0f), vec3(radius * cosf(angle), height, radius * sinf(angle))) *
+                glm::rotate(mat4(1.0f), radians(360.0f * unit(random)), axis) *
+                glm::scale(mat4(1.0f), vec3(0.01f + 0.03f * unit(random)));
+            float shade = 0.4f + 0.3f * unit(random);
+            asteroidInstances.push_back(makeInstanceData(asteroidWorldMatrix, 1, vec4(shade, shade, shade, 1.0f))); // mercury's rock
+
+            vec3 center(asteroidWorldMatrix[3]);
+            float extent = 8.7f * length(vec3(asteroidWorldMatrix[0])); // cube.obj reaches 8.66 from its center
+            asteroidSpheres.push_back(vec4(center, extent));
+            asteroidLeaves.push_back(insertBVHLeaf(sceneBVH, center - vec3(extent), center + vec3(extent), planetCount + i));
+        }
+    }
 
+    // The nodes and then the asteroids are renumbered in tree order, so the workers walk
+    // memory forwards through their ranges
+    std::vector<int> nodeRemap;
+    compactBVH(sceneBVH, nodeRemap);
+    for (int &leaf : planetLeaves)
+        leaf = nodeRemap[leaf];
+    orderBVHLeaves(sceneBVH, sceneOrder);
+    std::vector<InstanceData> orderedInstances;
+    std::vector<vec4> orderedSpheres;
+    asteroidLeaves.clear();
+    for (int leaf : sceneOrder.leaves)
+    {
+        uint32_t &object = sceneBVH.nodes[leaf].object;
+        if (object < (uint32_t)planetCount)
+            continue;
+        orderedInstances.push_back(asteroidInstances[object - planetCount]);
+        orderedSpheres.push_back(asteroidSpheres[object - planetCount]);
+        object = planetCount + (uint32_t)asteroidLeaves.size();
+        asteroidLeaves.push_back(leaf);
+    }
+    asteroidInstances.swap(orderedInstances);
+    asteroidSpheres.swap(orderedSpheres);
 
     // Camera parameters for view transform
     vec3 cameraPosition(15.0f, 1.0f, 30.0f);
@@ -334,254 +397,58 @@ int main(int argc, char*argv[])
     float cameraHorizontalAngle = 90.0f;
     float cameraVerticalAngle = 0.0f;
 
-    // Spinning cube at camera position
-    float spinningAngle = 0.0f;
-    
     // Set projection matrix for shader, this won't change
+    const float farPlane = 100.0f;
     mat4 projectionMatrix = glm::perspective(70.0f,            // field of view in degrees
-                                             800.0f / 600.0f,  // aspect ratio
-                                             0.01f, 100.0f);   // near and far (near > 0)
-    
-    // Set initial view matrix
-    mat4 viewMatrix = lookAt(cameraPosition,  // eye
-                             cameraPosition + cameraLookAt,  // center
-                             cameraUp ); // up
+                                             (float)renderContext.width / renderContext.height, // aspect ratio
+                                             0.01f, farPlane); // near and far (near > 0)
     
-    // Set View and Projection matrices on both shaders
-    setViewMatrix(whiteShaderProgram, viewMatrix);
-
-    setProjectionMatrix(whiteShaderProgram, projectionMatrix);
-
     // For frame time
-    float lastFrameTime = glfwGetTime();
+    double lastFrameTime = renderContextTime(renderContext);
     int lastMouseLeftState = GLFW_RELEASE;
     double lastMousePosX, lastMousePosY;
-    glfwGetCursorPos(window, &lastMousePosX, &lastMousePosY);
+    lastMousePosX = lastMousePosY = 0.0;
+    getRenderContextCursor(renderContext, lastMousePosX, lastMousePosY);
     
     // Other OpenGL states to set once
     // Enable Backface culling
-    glEnable(GL_DEPTH_TEST);
+    cachedEnable(glState, GL_DEPTH_TEST);
+
+    // Loading bound objects behind the state cache's back, from here on it is kept up to date
+    invalidateGLState(glState);
 
     // Entering Main Loop
-    while(!glfwWindowShouldClose(window))
+    while(renderContextRunning(renderContext))
     {
-        // Frame time calculation
-        float dt = glfwGetTime() - lastFrameTime;
-        lastFrameTime += dt;
-
-        // Each frame, reset color of each pixel to glClearColor
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  
-        // Draw colored geometry
-        glUseProgram(whiteShaderProgram);
-			           
-        // Spinning model rotation animation
-        spinningAngle += 45.0f * dt; //This is equivalent to 45 degrees per second
-
-        // Set the view matrix for first person camera
-		mat4 viewMatrix(1.0f);
-		viewMatrix = lookAt(cameraPosition, cameraPosition + cameraLookAt, cameraUp);
-		setViewMatrix(whiteShaderProgram, viewMatrix);
-        
-		// Set sun world matrix
-        mat4 sunWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(0.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.2f));
-        setWorldMatrix(whiteShaderProgram, sunWorldMatrix);
-
-        // Bind sun texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, sunTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(sunVAO);
-        glDrawElements(GL_TRIANGLES, sunVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-
-        // Set mercury world matrix
-        mat4 mercuryWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(4.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.03f));
-        setWorldMatrix(whiteShaderProgram, mercuryWorldMatrix);
-
-
-
-        // Bind mercury texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, mercuryTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(mercuryVAO);
-        glDrawElements(GL_TRIANGLES, mercuryVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-        // Set venus world matrix
-        mat4 venusWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(7.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.05f));
-        setWorldMatrix(whiteShaderProgram, venusWorldMatrix);
-
-
-
-        // Bind venus texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, venusTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(venusVAO);
-        glDrawElements(GL_TRIANGLES, venusVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-        // Set earth world matrix
-        mat4 earthWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(10.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.05f));
-        setWorldMatrix(whiteShaderProgram, earthWorldMatrix);
-
-
-
-        // Bind earth texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, earthTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(earthVAO);
-        glDrawElements(GL_TRIANGLES, earthVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-        // Set mars world matrix
-        mat4 marsWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(12.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.04f));
-        setWorldMatrix(whiteShaderProgram, marsWorldMatrix);
-
-
-
-        // Bind mars texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, marsTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(marsVAO);
-        glDrawElements(GL_TRIANGLES, marsVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-        // Set jupiter world matrix
-        mat4 jupiterWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(15.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.15f));
-        setWorldMatrix(whiteShaderProgram, jupiterWorldMatrix);
-
-
-
-        // Bind jupiter texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, jupiterTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(jupiterVAO);
-        glDrawElements(GL_TRIANGLES, jupiterVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-        // Set saturn world matrix
-        mat4 saturnWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(19.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.14f));
-        setWorldMatrix(whiteShaderProgram, saturnWorldMatrix);
-
-
-
-        // Bind saturn texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, saturnTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(saturnVAO);
-        glDrawElements(GL_TRIANGLES, saturnVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-        // Set uranus world matrix
-        mat4 uranusWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(23.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.07f));
-        setWorldMatrix(whiteShaderProgram, uranusWorldMatrix);
-
-
-
-        // Bind uranus texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, uranusTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(uranusVAO);
-        glDrawElements(GL_TRIANGLES, uranusVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-
-
-
-        // Set neptune world matrix
-        mat4 neptuneWorldMatrix = 
-			glm::translate(mat4(1.0f), vec3(26.0f, 0.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
-			glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
-			glm::scale(mat4(1.0f), vec3(0.07f));
-        setWorldMatrix(whiteShaderProgram, neptuneWorldMatrix);
-
-
-
-        // Bind neptune texture
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, neptuneTextureID);
-        glUniform1i(glGetUniformLocation(whiteShaderProgram, "planetTexture"), 0);
-        glBindVertexArray(neptuneVAO);
-        glDrawElements(GL_TRIANGLES, neptuneVertices, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        PROFILE_SCOPE("Frame");
+        PROFILE_GPU_SCOPE("Frame");
+        beginBenchmarkFrame(frameBenchmark, renderContext);
+        beginGLStateFrame(glState);
+        waitForFrameSlot(framePacer, renderContext);
+        beginDynamicBufferFrame(dynamicBufferRing);
+        beginRenderContextFrame(renderContext);
 
+        // Frame time calculation
+        double frameTime = renderContextTime(renderContext);
+        float dt = (float)(frameTime - lastFrameTime);
+        lastFrameTime = frameTime;
 
-        
-        
-        // End Frame
-        glfwSwapBuffers(window);
-        glfwPollEvents();
-        
-        // Handle inputs
-		if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-			glfwSetWindowShouldClose(window, true);
+        // Handle inputs, latched after the pacing waits so they're as fresh as possible
+		if (isRenderContextKeyDown(renderContext, GLFW_KEY_ESCAPE))
+			closeRenderContext(renderContext);
+        updateDepthPrepassKeys(depthPrepass, renderContext);
 
         
         // This was solution for Lab02 - Moving camera exercise
         // We'll change this to be a first or third person camera
-        bool fastCam = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_RIGHT_SHIFT) == GLFW_PRESS;
+        bool fastCam = isRenderContextKeyDown(renderContext, GLFW_KEY_LEFT_SHIFT) || isRenderContextKeyDown(renderContext, GLFW_KEY_RIGHT_SHIFT);
         float currentCameraSpeed = (fastCam) ? cameraFastSpeed : cameraSpeed;
         
         
         // - Calculate mouse motion dx and dy
         // - Update camera horizontal and vertical angle
-        double mousePosX, mousePosY;
-        glfwGetCursorPos(window, &mousePosX, &mousePosY);
+        double mousePosX = lastMousePosX, mousePosY = lastMousePosY;
+        getRenderContextCursor(renderContext, mousePosX, mousePosY);
         
         double dx = mousePosX - lastMousePosX;
         double dy = mousePosY - lastMousePosY;
@@ -606,49 +473,205 @@ int main(int argc, char*argv[])
 		glm::normalize(cameraSideVector);
         
         // Use camera lookat and side vectors to update positions with ASDW
-        if (glfwGetKey(window, GLFW_KEY_W ) == GLFW_PRESS)
+        if (isRenderContextKeyDown(renderContext, GLFW_KEY_W))
         {
             cameraPosition += cameraLookAt * dt * currentCameraSpeed;
         }
         
-        if (glfwGetKey(window, GLFW_KEY_S ) == GLFW_PRESS)
+        if (isRenderContextKeyDown(renderContext, GLFW_KEY_S))
         {
             cameraPosition -= cameraLookAt * dt * currentCameraSpeed;
         }
         
-        if (glfwGetKey(window, GLFW_KEY_D ) == GLFW_PRESS)
+        if (isRenderContextKeyDown(renderContext, GLFW_KEY_D))
         {
             cameraPosition += cameraSideVector * dt * currentCameraSpeed;
         }
         
-        if (glfwGetKey(window, GLFW_KEY_A ) == GLFW_PRESS)
+        if (isRenderContextKeyDown(renderContext, GLFW_KEY_A))
         {
             cameraPosition -= cameraSideVector * dt * currentCameraSpeed;
         }
 
+        // Each frame, reset color of each pixel to glClearColor
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  
+        // Switch from the placeholder once the planet shader is ready
+        pollShaderVariants(shaderLibrary);
+        ShaderProgram &planetShaderProgram = getShaderVariant(shaderLibrary, planetShaderFeatures);
+
+			           
+        // Spinning model rotation animation, from the simulation's time in fixed steps. The
+        // planets and the belt only depend on time, so drawing them at the blend time between
+        // the last two steps is the interpolation. The angles are wrapped while still doubles.
+        advanceFixedTimestep(simulation, frameTime);
+        double simulatedTime = fixedTimestepBlendTime(simulation);
+        float spinningAngle = (float)fmod(45.0 * simulatedTime, 360.0); // 45 degrees per second
+        float beltAngle = (float)fmod(4.5 * simulatedTime, 360.0);      // a tenth of that
+
+        // Set the view matrix for first person camera, the projection goes in the same block
+		mat4 viewMatrix(1.0f);
+		viewMatrix = lookAt(cameraPosition, cameraPosition + cameraLookAt, cameraUp);
+        FrameUniforms frame;
+        frame.viewMatrix = viewMatrix;
+        frame.projectionMatrix = projectionMatrix;
+        frame.lightPos = vec4(0.0f, 0.0f, 0.0f, 1.0f); // the sun, the planets are unlit for now
+        frame.lightColor = vec4(1.0f);
+        frame.viewPos = vec4(cameraPosition, 1.0f);
+        updateFrameUniforms(uniformBuffers, frame);
+
+        // The planets in view occlude everything behind them, the sun most of all. They are
+        // rasterized before anything is tested against them.
+        FrustumPlanes frustum = extractFrustumPlanes(projectionMatrix * viewMatrix);
+        beginOcclusionFrame(occlusionBuffer, projectionMatrix * viewMatrix);
+        for (int planet = 0; planet < planetCount; planet++)
+            if (sphereInFrustum(frustum, vec3(planetDistances[planet], 0.0f, 0.0f), planetModelRadius * planetScales[planet]))
+                addOccluder(occlusionBuffer, planetOccluder,
+                            glm::translate(mat4(1.0f), vec3(planetDistances[planet], 0.0f, 0.0f)) *
+                            glm::scale(mat4(1.0f), vec3(planetScales[planet])));
+        rasterizeOccluders(occlusionBuffer);
+
+        // The leaves are split into ranges in tree order, and a worker takes each range: the
+        // asteroids' leaves are moved to where the belt has turned and the subtrees covering
+        // the range refit around them rather than rebuilt, then culled against the frustum
+        // and the occluders. Objects left are recorded as instances, planets with their own
+        // world matrix and texture layer, with their view depth in the key so the nearest
+        // ones are replayed first and the ones behind fail the depth test before shading.
+        const uint32_t planetTarget = 0, asteroidTarget = 1;
+        mat4 beltWorldMatrix = glm::rotate(mat4(1.0f), radians(beltAngle), vec3(0.0f, 1.0f, 0.0f));
+        mat4 beltToView = viewMatrix * beltWorldMatrix;
+        bool frontToBack = depthPrepass.frontToBack;
+        recordCommandLists(commandRecorder, sceneOrder.leaves.size(), [&](CommandList &list, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                int leaf = sceneOrder.leaves[i];
+                uint32_t object = sceneBVH.nodes[leaf].object;
+                if (object < (uint32_t)planetCount)
+                    continue;
+                const vec4 &sphere = asteroidSpheres[object - planetCount];
+                vec3 center(beltWorldMatrix * vec4(vec3(sphere), 1.0f));
+                setBVHLeafBounds(sceneBVH, leaf, center - vec3(sphere.w), center + vec3(sphere.w));
+            }
+
+            size_t tested = 0, hidden = 0;
+            forEachBVHRangeSubtree(sceneBVH, sceneOrder, begin, end, [&](int subtree) {
+                refitBVHSubtree(sceneBVH, subtree);
+                cullBVHSubtree(sceneBVH, frustum, subtree, [&](uint32_t object) {
+                    int leaf = object < (uint32_t)planetCount ? planetLeaves[object] : asteroidLeaves[object - planetCount];
+                    OcclusionBox box;
+                    box.lower = sceneBVH.nodes[leaf].lower;
+                    box.upper = sceneBVH.nodes[leaf].upper;
+                    tested++;
+                    if (isBoxOccluded(occlusionBuffer, box))
+                    {
+                        hidden++;
+                        return;
+                    }
+
+                    if (object >= (uint32_t)planetCount)
+                    {
+                        const InstanceData &asteroid = asteroidInstances[object - planetCount];
+                        float depth = frontToBack ? -(beltToView * asteroid.worldMatrix[3]).z / farPlane : 0.0f;
+                        recordDraw(list, asteroidTarget, makeSortKey(RENDER_PASS_OPAQUE, 0, 0, asteroidTarget, depth), asteroid);
+                        return;
+                    }
+                    mat4 planetWorldMatrix =
+                        glm::translate(mat4(1.0f), vec3(planetDistances[object], 0.0f, 0.0f)) *
+                        glm::rotate(mat4(1.0f), radians(spinningAngle), vec3(0.0f, 1.0f, 0.0f)) *
+                        glm::rotate(mat4(1.0f), radians(-90.0f), vec3(1.0f, 0.0f, 0.0f)) *
+                        glm::scale(mat4(1.0f), vec3(planetScales[object]));
+                    planetInstances[object] = makeInstanceData(planetWorldMatrix, (int)object, vec4(1.0f));
+                    float depth = frontToBack ? -(viewMatrix * planetWorldMatrix[3]).z / farPlane : 0.0f;
+                    recordDraw(list, planetTarget, makeSortKey(RENDER_PASS_OPAQUE, 0, 0, planetTarget, depth), planetInstances[object]);
+                });
+            });
+            countOcclusionTests(occlusionBuffer, tested, hidden);
+        });
+        // The few nodes above the ranges' subtrees, so the whole tree is up to date
+        refitBVHAcrossRanges(sceneBVH, sceneOrder, commandRecorder.jobs);
+        InstanceBatch *const batches[] = {&planetBatch, &asteroidBatch};
+        replayCommandLists(commandRecorder, batches, 2);
+
+        // The object block only places each batch as a whole
+        beginObjectUniforms(uniformBuffers);
+        int planetObject = addObjectUniforms(uniformBuffers, makeObjectUniforms(mat4(1.0f), mat3(1.0f), vec3(1.0f)));
+        int beltObject = addObjectUniforms(uniformBuffers, makeObjectUniforms(beltWorldMatrix, mat3(1.0f), vec3(1.0f)));
+        uploadObjectUniforms(uniformBuffers);
+
+        // With the pre-pass both batches fill the depth buffer first
+        if (beginDepthPrepass(depthPrepass))
+        {
+            getShaderVariant(shaderLibrary, depthShaderFeatures).use();
+            bindObjectUniforms(uniformBuffers, planetObject);
+            drawInstances(planetBatch);
+            bindObjectUniforms(uniformBuffers, beltObject);
+            drawInstances(asteroidBatch);
+        }
 
+        // One draw for all the planets and one for the whole belt
+        beginShadingPass(depthPrepass);
+        planetShaderProgram.use();
+        cachedActiveTexture(glState, 0);
+        cachedBindTexture(glState, GL_TEXTURE_2D_ARRAY, planetTextureArray);
+        planetShaderProgram.setInt(UNIFORM_DIFFUSE_TEXTURE_ARRAY, 0);
+        bindObjectUniforms(uniformBuffers, planetObject);
+        drawInstances(planetBatch);
+        bindObjectUniforms(uniformBuffers, beltObject);
+        drawInstances(asteroidBatch);
+        endShadingPass(depthPrepass);
 
+        
+        
+        // End Frame
+        endBenchmarkFrame(frameBenchmark, glState);
+        endDynamicBufferFrame(dynamicBufferRing);
+        endRenderContextFrame(renderContext);
+        endPacedFrame(framePacer, renderContext);
+        endProfilerFrame(isRenderContextKeyDown(renderContext, GLFW_KEY_F12));
     }
 
-    glfwTerminate();
+    finishFrameBenchmark(frameBenchmark, renderContext, "Assignment1");
+    printGLStateStats(glState);
+    printDynamicBufferStats(dynamicBufferRing);
+    printDepthPrepassStats(depthPrepass);
+    printFramePacingStats(framePacer);
+    printOcclusionStats(occlusionBuffer);
+    printCommandListStats(commandRecorder);
+    printFixedTimestepStats(simulation);
+    releaseShaderLibrary(shaderLibrary);
+    destroyInstanceBatch(planetBatch);
+    destroyInstanceBatch(asteroidBatch);
+    destroyDepthPrepass(depthPrepass);
+    destroyFramePacer(framePacer);
+    destroyUniformBuffers(uniformBuffers);
+    destroyDynamicBufferRing(dynamicBufferRing);
+    releaseAssetCache(assetCache);
+    destroyTextureUploadRing(textureUploadRing);
+    closeAssetPack(assetPack);
+    stopWorkerPool(workerPool);
+    stopProfiler();
+    destroyRenderContext(renderContext);
     
 	return 0;
 }
 
 
 
-GLuint loadTexture(const char *filename)
+// maxSize limits the larger side of the texture, 0 keeps the size stored in the file
+GLuint loadTexture(const char *filename, int maxSize)
 {
-    stbi_set_flip_vertically_on_load(true); // optional, depending on your texture orientation
-
-    int width, height, nrChannels;
-    unsigned char* data = stbi_load(filename, &width, &height, &nrChannels, 0);
-
-    if (!data) {
+    // Identical images share one texture, whatever path they were loaded from
+    AssetBytes contents;
+    if (!loadAssetBytes(assetPack, filename, contents)) {
         std::cerr << "Failed to load texture: " << filename << std::endl;
         return 0;
     }
 
+    uint64_t contentKey = hashContents(contents.data, contents.size, ASSET_SEED_TEXTURE + maxSize);
+    GLuint cachedTextureID = findCachedTexture(assetCache, contentKey);
+    if (cachedTextureID != 0)
+        return cachedTextureID;
+
     GLuint textureID;
     glGenTextures(1, &textureID);
     glBindTexture(GL_TEXTURE_2D, textureID);
@@ -659,12 +682,70 @@ GLuint loadTexture(const char *filename)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    GLenum format = (nrChannels == 4) ? GL_RGBA : GL_RGB;
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+    // The decoder writes directly into upload ring memory, scaling down in the IDCT if needed
+    ImageDecodeRequest request;
+    request.flipVertically = true; // optional, depending on your texture orientation
+    request.maxWidth = maxSize;
+    request.maxHeight = maxSize;
+    ImageInfo info;
+    if (!decodeTexture2D(textureUploadRing, contents.data, contents.size, request, info)) {
+        std::cerr << "Failed to load texture: " << filename << std::endl;
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDeleteTextures(1, &textureID);
+        return 0;
+    }
     glGenerateMipmap(GL_TEXTURE_2D);
 
-    stbi_image_free(data);
     glBindTexture(GL_TEXTURE_2D, 0);
 
+    assetCache.textures[contentKey] = textureID;
+    return textureID;
+}
+
+// Loads same-sized images into the layers of one GL_TEXTURE_2D_ARRAY, in the order given
+GLuint loadTextureArray(const char *const *filenames, int count)
+{
+    // The whole set is keyed by content, like single textures
+    std::vector<AssetBytes> contents(count);
+    std::vector<const unsigned char *> layerData(count);
+    std::vector<size_t> layerSizes(count);
+    uint64_t contentKey = ASSET_SEED_TEXTURE_ARRAY;
+    for (int i = 0; i < count; i++) {
+        if (!loadAssetBytes(assetPack, filenames[i], contents[i])) {
+            std::cerr << "Failed to load texture: " << filenames[i] << std::endl;
+            return 0;
+        }
+        layerData[i] = contents[i].data;
+        layerSizes[i] = contents[i].size;
+        contentKey = hashContents(contents[i].data, contents[i].size, contentKey);
+    }
+
+    GLuint cachedTextureID = findCachedTexture(assetCache, contentKey);
+    if (cachedTextureID != 0)
+        return cachedTextureID;
+
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    ImageDecodeRequest request;
+    request.flipVertically = true;
+    ImageInfo info;
+    if (!decodeTextureArray(textureUploadRing, layerData.data(), layerSizes.data(), count, request, info)) {
+        std::cerr << "Failed to load texture: " << filenames[0] << std::endl;
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        glDeleteTextures(1, &textureID);
+        return 0;
+    }
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    assetCache.textures[contentKey] = textureID;
     return textureID;
-}
\ No newline at end of file
+}
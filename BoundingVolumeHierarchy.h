@@ -0,0 +1,615 @@
+//
+// Dynamic bounding volume hierarchy over scene objects
+//
+// A binary tree of axis-aligned boxes with one leaf per object, built incrementally: each
+// insert looks for the sibling that adds the least surface area to the tree (the surface area
+// heuristic, searched branch and bound), and the path back to the root is rebalanced with AVL
+// style rotations so the tree stays shallow whatever order objects arrive in.
+//
+// Objects that move a little every frame (the asteroid belt turning) don't need a rebuild:
+// set their leaf boxes and call refitBVH, which recomputes every parent box in one bottom-up
+// pass. Objects that move on their own go through moveBVHLeaf, which keeps a fattened box and
+// only reinserts the leaf once it has left it.
+//
+// Frustum culling walks the tree with the set of planes still to test, a node that is fully
+// inside a plane drops it for its whole subtree, so large parts of the scene are accepted or
+// rejected with a single box test. Ray and sphere queries walk it the same way.
+//
+// To refit and cull on several threads, orderBVHLeaves lists the leaves in the order culling
+// visits them. Any range of that list is covered by a few whole subtrees, which one thread can
+// refit and cull without touching the rest of the tree. refitBVHAcrossRanges then fixes the
+// few nodes above them. compactBVH puts the nodes in that order too, once the tree is built.
+//
+// Nodes live in one vector and refer to each other by index, -1 meaning none.
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "FrustumCulling.h"
+#include "Profiler.h"
+
+const int BVH_NULL_NODE = -1;
+const int BVH_STACK_SIZE = 256; // traversal depth, the balanced tree stays far below this
+
+struct BVHNode
+{
+    glm::vec3 lower, upper;
+    int parent;  // next free node while on the free list
+    int child1, child2; // BVH_NULL_NODE for leaves
+    int height;  // 0 for leaves, -1 while free
+    uint32_t object;
+};
+
+struct BoundingVolumeHierarchy
+{
+    std::vector<BVHNode> nodes;
+    int root = BVH_NULL_NODE;
+    int freeList = BVH_NULL_NODE;
+    int leafCount = 0;
+    float margin = 0.1f; // how far moveBVHLeaf's boxes are fattened
+
+    // Scratch space kept between calls
+    std::vector<std::pair<float, int>> candidates;
+    std::vector<int> order;
+};
+
+inline bool isBVHLeaf(const BVHNode &node)
+{
+    return node.child1 == BVH_NULL_NODE;
+}
+
+// Half the surface area, only ever compared
+inline float bvhArea(const glm::vec3 &lower, const glm::vec3 &upper)
+{
+    glm::vec3 size = upper - lower;
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+inline void bvhUnion(const BVHNode &a, const BVHNode &b, glm::vec3 &lower, glm::vec3 &upper)
+{
+    lower = glm::min(a.lower, b.lower);
+    upper = glm::max(a.upper, b.upper);
+}
+
+int allocateBVHNode(BoundingVolumeHierarchy &bvh)
+{
+    int index;
+    if (bvh.freeList != BVH_NULL_NODE)
+    {
+        index = bvh.freeList;
+        bvh.freeList = bvh.nodes[index].parent;
+    }
+    else
+    {
+        index = (int)bvh.nodes.size();
+        bvh.nodes.push_back(BVHNode());
+    }
+    BVHNode &node = bvh.nodes[index];
+    node.parent = node.child1 = node.child2 = BVH_NULL_NODE;
+    node.height = 0;
+    node.object = 0;
+    return index;
+}
+
+void freeBVHNode(BoundingVolumeHierarchy &bvh, int index)
+{
+    bvh.nodes[index].parent = bvh.freeList;
+    bvh.nodes[index].height = -1;
+    bvh.freeList = index;
+}
+
+// Recomputes a parent's box and height from its children
+inline void refitBVHNode(BoundingVolumeHierarchy &bvh, int index)
+{
+    BVHNode &node = bvh.nodes[index];
+    const BVHNode &child1 = bvh.nodes[node.child1];
+    const BVHNode &child2 = bvh.nodes[node.child2];
+    bvhUnion(child1, child2, node.lower, node.upper);
+    node.height = 1 + std::max(child1.height, child2.height);
+}
+
+inline void replaceBVHChild(BoundingVolumeHierarchy &bvh, int parent, int oldChild, int newChild)
+{
+    if (parent == BVH_NULL_NODE)
+        bvh.root = newChild;
+    else if (bvh.nodes[parent].child1 == oldChild)
+        bvh.nodes[parent].child1 = newChild;
+    else
+        bvh.nodes[parent].child2 = newChild;
+}
+
+// If one child of a is more than one level taller than the other, rotates it up to take a's
+// place. Returns the index of the node now at a's position.
+int balanceBVHNode(BoundingVolumeHierarchy &bvh, int a)
+{
+    if (isBVHLeaf(bvh.nodes[a]) || bvh.nodes[a].height < 2)
+        return a;
+
+    int b = bvh.nodes[a].child1;
+    int c = bvh.nodes[a].child2;
+    int balance = bvh.nodes[c].height - bvh.nodes[b].height;
+    if (balance >= -1 && balance <= 1)
+        return a;
+
+    // up is the taller child, its taller grandchild stays with it
+    int up = balance > 1 ? c : b;
+    int f = bvh.nodes[up].child1;
+    int g = bvh.nodes[up].child2;
+    int keep = bvh.nodes[f].height > bvh.nodes[g].height ? f : g;
+    int move = keep == f ? g : f;
+
+    bvh.nodes[up].parent = bvh.nodes[a].parent;
+    replaceBVHChild(bvh, bvh.nodes[a].parent, a, up);
+    bvh.nodes[a].parent = up;
+    bvh.nodes[up].child1 = a;
+    bvh.nodes[up].child2 = keep;
+
+    // a keeps its other child and takes the shorter grandchild in place of up
+    if (balance > 1)
+        bvh.nodes[a].child2 = move;
+    else
+        bvh.nodes[a].child1 = move;
+    bvh.nodes[move].parent = a;
+
+    refitBVHNode(bvh, a);
+    refitBVHNode(bvh, up);
+    return up;
+}
+
+// Rebalances and refits every node from index up to the root
+void fixBVHUpwards(BoundingVolumeHierarchy &bvh, int index)
+{
+    while (index != BVH_NULL_NODE)
+    {
+        index = balanceBVHNode(bvh, index);
+        refitBVHNode(bvh, index);
+        index = bvh.nodes[index].parent;
+    }
+}
+
+// The node whose pairing with the new box adds the least area to the tree. The cost of a
+// candidate is the area of its union with the box plus how much every ancestor grows, so a
+// subtree can be skipped once that growth alone exceeds the best cost found.
+int findBestBVHSibling(BoundingVolumeHierarchy &bvh, const BVHNode &leaf)
+{
+    float leafArea = bvhArea(leaf.lower, leaf.upper);
+    int best = bvh.root;
+    float bestCost = std::numeric_limits<float>::max();
+
+    // Min-heap on the growth inherited from the ancestors
+    std::vector<std::pair<float, int>> &heap = bvh.candidates;
+    std::greater<std::pair<float, int>> compare;
+    heap.clear();
+    heap.push_back(std::make_pair(0.0f, bvh.root));
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), compare);
+        float inherited = heap.back().first;
+        int index = heap.back().second;
+        heap.pop_back();
+        if (inherited + leafArea >= bestCost)
+            break; // everything left in the heap inherits at least as much
+
+        const BVHNode &node = bvh.nodes[index];
+        glm::vec3 lower, upper;
+        bvhUnion(node, leaf, lower, upper);
+        float unionArea = bvhArea(lower, upper);
+        float cost = unionArea + inherited;
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            best = index;
+        }
+
+        if (!isBVHLeaf(node))
+        {
+            float childInherited = inherited + unionArea - bvhArea(node.lower, node.upper);
+            if (childInherited + leafArea < bestCost)
+            {
+                heap.push_back(std::make_pair(childInherited, node.child1));
+                std::push_heap(heap.begin(), heap.end(), compare);
+                heap.push_back(std::make_pair(childInherited, node.child2));
+                std::push_heap(heap.begin(), heap.end(), compare);
+            }
+        }
+    }
+    return best;
+}
+
+void insertBVHNode(BoundingVolumeHierarchy &bvh, int leaf)
+{
+    if (bvh.root == BVH_NULL_NODE)
+    {
+        bvh.root = leaf;
+        bvh.nodes[leaf].parent = BVH_NULL_NODE;
+        return;
+    }
+
+    int sibling = findBestBVHSibling(bvh, bvh.nodes[leaf]);
+    int oldParent = bvh.nodes[sibling].parent;
+    int newParent = allocateBVHNode(bvh);
+    bvh.nodes[newParent].parent = oldParent;
+    bvh.nodes[newParent].child1 = sibling;
+    bvh.nodes[newParent].child2 = leaf;
+    replaceBVHChild(bvh, oldParent, sibling, newParent);
+    bvh.nodes[sibling].parent = newParent;
+    bvh.nodes[leaf].parent = newParent;
+    fixBVHUpwards(bvh, newParent);
+}
+
+void removeBVHNode(BoundingVolumeHierarchy &bvh, int leaf)
+{
+    if (leaf == bvh.root)
+    {
+        bvh.root = BVH_NULL_NODE;
+        return;
+    }
+
+    int parent = bvh.nodes[leaf].parent;
+    int grandParent = bvh.nodes[parent].parent;
+    int sibling = bvh.nodes[parent].child1 == leaf ? bvh.nodes[parent].child2 : bvh.nodes[parent].child1;
+
+    // The sibling takes the parent's place
+    replaceBVHChild(bvh, grandParent, parent, sibling);
+    bvh.nodes[sibling].parent = grandParent;
+    freeBVHNode(bvh, parent);
+    fixBVHUpwards(bvh, grandParent);
+}
+
+// Adds an object with the given bounds, returns its leaf for later updates
+int insertBVHLeaf(BoundingVolumeHierarchy &bvh, const glm::vec3 &lower, const glm::vec3 &upper, uint32_t object)
+{
+    int leaf = allocateBVHNode(bvh);
+    bvh.nodes[leaf].lower = lower;
+    bvh.nodes[leaf].upper = upper;
+    bvh.nodes[leaf].object = object;
+    insertBVHNode(bvh, leaf);
+    bvh.leafCount++;
+    return leaf;
+}
+
+void removeBVHLeaf(BoundingVolumeHierarchy &bvh, int leaf)
+{
+    removeBVHNode(bvh, leaf);
+    freeBVHNode(bvh, leaf);
+    bvh.leafCount--;
+}
+
+// For objects that move independently. The leaf keeps a box fattened by the margin, and is
+// only reinserted once the new bounds leave it. Returns true if it was reinserted.
+bool moveBVHLeaf(BoundingVolumeHierarchy &bvh, int leaf, const glm::vec3 &lower, const glm::vec3 &upper)
+{
+    const BVHNode &node = bvh.nodes[leaf];
+    if (glm::all(glm::lessThanEqual(node.lower, lower)) && glm::all(glm::lessThanEqual(upper, node.upper)))
+        return false;
+
+    removeBVHNode(bvh, leaf);
+    bvh.nodes[leaf].lower = lower - glm::vec3(bvh.margin);
+    bvh.nodes[leaf].upper = upper + glm::vec3(bvh.margin);
+    insertBVHNode(bvh, leaf);
+    return true;
+}
+
+// For objects moved together, set every leaf that changed and then call refitBVH once
+inline void setBVHLeafBounds(BoundingVolumeHierarchy &bvh, int leaf, const glm::vec3 &lower, const glm::vec3 &upper)
+{
+    bvh.nodes[leaf].lower = lower;
+    bvh.nodes[leaf].upper = upper;
+}
+
+// Recomputes every parent box from its children, keeping the tree's shape. Quality drops if
+// objects drift far from where they were inserted, but objects moving as a group (a belt
+// turning) keep their neighbours and the boxes stay tight.
+void refitBVH(BoundingVolumeHierarchy &bvh)
+{
+    if (bvh.root == BVH_NULL_NODE)
+        return;
+    PROFILE_SCOPE("BVH refit");
+
+    // Pre-order, so walking it backwards visits children before their parents
+    std::vector<int> &order = bvh.order;
+    order.clear();
+    order.push_back(bvh.root);
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const BVHNode &node = bvh.nodes[order[i]];
+        if (!isBVHLeaf(node))
+        {
+            order.push_back(node.child1);
+            order.push_back(node.child2);
+        }
+    }
+    for (size_t i = order.size(); i-- > 0;)
+        if (!isBVHLeaf(bvh.nodes[order[i]]))
+            refitBVHNode(bvh, order[i]);
+}
+
+// Calls visit(object) for every leaf under index whose box touches the frustum, depth first
+// with each node's second child before its first
+template <typename Visit>
+void cullBVHSubtree(const BoundingVolumeHierarchy &bvh, const FrustumPlanes &frustum, int index, const Visit &visit)
+{
+    // Each entry carries the planes its subtree still has to be tested against
+    int stack[BVH_STACK_SIZE];
+    int planeMasks[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top] = index;
+    planeMasks[top++] = 0x3F;
+    while (top > 0)
+    {
+        top--;
+        const BVHNode &node = bvh.nodes[stack[top]];
+        int planeMask = planeMasks[top];
+
+        glm::vec3 center = (node.lower + node.upper) * 0.5f;
+        glm::vec3 extents = (node.upper - node.lower) * 0.5f;
+        bool outside = false;
+        for (int i = 0; i < 6 && !outside; i++)
+        {
+            if (!(planeMask & (1 << i)))
+                continue;
+            glm::vec3 normal(frustum.planes[i]);
+            float distance = glm::dot(normal, center) + frustum.planes[i].w;
+            float reach = glm::dot(glm::abs(normal), extents);
+            if (distance < -reach)
+                outside = true;
+            else if (distance >= reach)
+                planeMask &= ~(1 << i); // inside for the whole subtree
+        }
+        if (outside)
+            continue;
+
+        if (isBVHLeaf(node))
+        {
+            visit(node.object);
+            continue;
+        }
+        stack[top] = node.child1;
+        planeMasks[top++] = planeMask;
+        stack[top] = node.child2;
+        planeMasks[top++] = planeMask;
+    }
+}
+
+// Replaces visible with the object of every leaf whose box touches the frustum
+void cullBVH(const BoundingVolumeHierarchy &bvh, const FrustumPlanes &frustum, std::vector<uint32_t> &visible)
+{
+    PROFILE_SCOPE("BVH cull");
+    visible.clear();
+    if (bvh.root == BVH_NULL_NODE)
+        return;
+    cullBVHSubtree(bvh, frustum, bvh.root, [&visible](uint32_t object) { visible.push_back(object); });
+}
+
+// Renumbers the nodes in the order cullBVH visits them, so every subtree is one block of the
+// array and walking the tree walks memory forwards. Free nodes are dropped. remap[index] is the
+// new index of each old node, for the leaf indices kept outside the tree.
+void compactBVH(BoundingVolumeHierarchy &bvh, std::vector<int> &remap)
+{
+    remap.assign(bvh.nodes.size(), BVH_NULL_NODE);
+    std::vector<BVHNode> nodes;
+    nodes.reserve(bvh.nodes.size());
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (bvh.root != BVH_NULL_NODE)
+        stack[top++] = bvh.root;
+    while (top > 0)
+    {
+        int index = stack[--top];
+        remap[index] = (int)nodes.size();
+        nodes.push_back(bvh.nodes[index]);
+        if (!isBVHLeaf(bvh.nodes[index]))
+        {
+            stack[top++] = bvh.nodes[index].child1;
+            stack[top++] = bvh.nodes[index].child2;
+        }
+    }
+    for (BVHNode &node : nodes)
+    {
+        if (node.parent != BVH_NULL_NODE)
+            node.parent = remap[node.parent];
+        if (!isBVHLeaf(node))
+        {
+            node.child1 = remap[node.child1];
+            node.child2 = remap[node.child2];
+        }
+    }
+    bvh.nodes.swap(nodes);
+    bvh.root = bvh.root != BVH_NULL_NODE ? remap[bvh.root] : BVH_NULL_NODE;
+    bvh.freeList = BVH_NULL_NODE;
+}
+
+// Leaves in the order cullBVH lists them, and the positions each node's leaves take in it. A
+// range of positions is covered by a few whole subtrees, so separate ranges can be refit and
+// culled on separate threads. Valid until the next insert or remove.
+struct BVHLeafOrder
+{
+    std::vector<int> leaves;         // leaf nodes by position
+    std::vector<uint32_t> firstLeaf; // per node, position of its first leaf
+    std::vector<uint32_t> endLeaf;   // per node, one past the position of its last leaf
+};
+
+void orderBVHSubtree(const BoundingVolumeHierarchy &bvh, BVHLeafOrder &order, int index)
+{
+    const BVHNode &node = bvh.nodes[index];
+    order.firstLeaf[index] = (uint32_t)order.leaves.size();
+    if (isBVHLeaf(node))
+        order.leaves.push_back(index);
+    else
+    {
+        orderBVHSubtree(bvh, order, node.child2);
+        orderBVHSubtree(bvh, order, node.child1);
+    }
+    order.endLeaf[index] = (uint32_t)order.leaves.size();
+}
+
+void orderBVHLeaves(const BoundingVolumeHierarchy &bvh, BVHLeafOrder &order)
+{
+    order.leaves.clear();
+    order.firstLeaf.assign(bvh.nodes.size(), 0);
+    order.endLeaf.assign(bvh.nodes.size(), 0);
+    if (bvh.root != BVH_NULL_NODE)
+        orderBVHSubtree(bvh, order, bvh.root);
+}
+
+// Calls visit(node) for the largest subtrees whose leaves all have positions begin..end-1, in
+// the order of their positions
+template <typename Visit>
+void forEachBVHRangeSubtree(const BoundingVolumeHierarchy &bvh, const BVHLeafOrder &order, size_t begin, size_t end, const Visit &visit)
+{
+    if (bvh.root == BVH_NULL_NODE || begin >= end)
+        return;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = bvh.root;
+    while (top > 0)
+    {
+        int index = stack[--top];
+        if (order.endLeaf[index] <= begin || order.firstLeaf[index] >= end)
+            continue;
+        if (order.firstLeaf[index] >= begin && order.endLeaf[index] <= end)
+        {
+            visit(index);
+            continue;
+        }
+        // The second child's leaves come first, so it is popped first
+        stack[top++] = bvh.nodes[index].child1;
+        stack[top++] = bvh.nodes[index].child2;
+    }
+}
+
+// Recomputes the boxes under index from its leaves, refitBVH for one subtree
+void refitBVHSubtree(BoundingVolumeHierarchy &bvh, int index)
+{
+    const BVHNode &node = bvh.nodes[index];
+    if (isBVHLeaf(node))
+        return;
+    refitBVHSubtree(bvh, node.child1);
+    refitBVHSubtree(bvh, node.child2);
+    refitBVHNode(bvh, index);
+}
+
+// Range of the leaf at position when the order is split into rangeCount ranges the way the
+// worker jobs split objects, leaves.size() * range / rangeCount onwards
+inline int bvhLeafRange(const BVHLeafOrder &order, uint32_t position, int rangeCount)
+{
+    return (int)((((uint64_t)position + 1) * rangeCount - 1) / order.leaves.size());
+}
+
+// Refits the nodes whose leaves span more than one of rangeCount ranges, once the subtrees
+// forEachBVHRangeSubtree gave for every range have been refit
+void refitBVHAcrossRanges(BoundingVolumeHierarchy &bvh, const BVHLeafOrder &order, int rangeCount, int index)
+{
+    if (bvhLeafRange(order, order.firstLeaf[index], rangeCount) == bvhLeafRange(order, order.endLeaf[index] - 1, rangeCount))
+        return;
+    refitBVHAcrossRanges(bvh, order, rangeCount, bvh.nodes[index].child1);
+    refitBVHAcrossRanges(bvh, order, rangeCount, bvh.nodes[index].child2);
+    refitBVHNode(bvh, index);
+}
+
+void refitBVHAcrossRanges(BoundingVolumeHierarchy &bvh, const BVHLeafOrder &order, int rangeCount)
+{
+    if (bvh.root != BVH_NULL_NODE && rangeCount > 0)
+        refitBVHAcrossRanges(bvh, order, rangeCount, bvh.root);
+}
+
+// Distance along the ray to where it enters the box, or a negative value if it misses
+inline float rayBoxDistance(const glm::vec3 &origin, const glm::vec3 &inverseDirection, const BVHNode &node, float maxDistance)
+{
+    glm::vec3 t1 = (node.lower - origin) * inverseDirection;
+    glm::vec3 t2 = (node.upper - origin) * inverseDirection;
+    glm::vec3 entries = glm::min(t1, t2);
+    glm::vec3 exits = glm::max(t1, t2);
+    float enter = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+    float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, maxDistance));
+    return enter <= exit ? enter : -1.0f;
+}
+
+// Finds the nearest object whose box the ray hits within maxDistance. direction need not be
+// normalized, distances are in units of its length. The hit is on the object's bounds.
+bool raycastBVH(const BoundingVolumeHierarchy &bvh, const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance,
+                uint32_t &object, float &distance)
+{
+    if (bvh.root == BVH_NULL_NODE)
+        return false;
+
+    // Division by a zero component gives an infinity, which the slab test handles
+    glm::vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    float best = maxDistance;
+    bool hit = false;
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (rayBoxDistance(origin, inverseDirection, bvh.nodes[bvh.root], best) >= 0.0f)
+        stack[top++] = bvh.root;
+    while (top > 0)
+    {
+        const BVHNode &node = bvh.nodes[stack[--top]];
+        if (isBVHLeaf(node))
+        {
+            float enter = rayBoxDistance(origin, inverseDirection, node, best);
+            if (enter >= 0.0f)
+            {
+                best = enter;
+                object = node.object;
+                hit = true;
+            }
+            continue;
+        }
+
+        // Nearer child on top of the stack, so it tightens best before the other is visited
+        float enter1 = rayBoxDistance(origin, inverseDirection, bvh.nodes[node.child1], best);
+        float enter2 = rayBoxDistance(origin, inverseDirection, bvh.nodes[node.child2], best);
+        int first = node.child1, second = node.child2;
+        if (enter2 >= 0.0f && (enter1 < 0.0f || enter2 < enter1))
+        {
+            std::swap(first, second);
+            std::swap(enter1, enter2);
+        }
+        if (enter2 >= 0.0f)
+            stack[top++] = second;
+        if (enter1 >= 0.0f)
+            stack[top++] = first;
+    }
+    if (hit)
+        distance = best;
+    return hit;
+}
+
+// Replaces results with the object of every leaf whose box touches the sphere
+void querySphereBVH(const BoundingVolumeHierarchy &bvh, const glm::vec3 &center, float radius, std::vector<uint32_t> &results)
+{
+    results.clear();
+    if (bvh.root == BVH_NULL_NODE)
+        return;
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = bvh.root;
+    while (top > 0)
+    {
+        const BVHNode &node = bvh.nodes[stack[--top]];
+        glm::vec3 closest = glm::clamp(center, node.lower, node.upper);
+        glm::vec3 offset = closest - center;
+        if (glm::dot(offset, offset) > radius * radius)
+            continue;
+
+        if (isBVHLeaf(node))
+        {
+            results.push_back(node.object);
+            continue;
+        }
+        stack[top++] = node.child1;
+        stack[top++] = node.child2;
+    }
+}
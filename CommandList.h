@@ -0,0 +1,195 @@
+//
+// Command lists - draws recorded on worker threads and replayed on the GL thread
+//
+// The per-object part of a frame (culling, composing world and normal matrices, working out
+// sort keys) needs no GL, so recordCommandLists splits the objects into contiguous ranges and
+// has the worker pool record each range into a list of its own, with no locking. The record
+// callback can do all of a range's culling as well, as Assignment1 does for its tree, or only
+// read results worked out beforehand, as project1 does for its few parts. A DrawCommand is
+// plain data: a sort key, a target, which only the replay gives a meaning to (an instance
+// batch or a multi-draw mesh), and a pointer to the instance data. The caller keeps that data
+// in place until the replay. Replayed into instance batches, each instance is copied once,
+// straight into the dynamic buffer ring, while the multi-draw renderer takes its usual copy
+// into its draw data. The GL thread then replays every list in one tight loop, filling the
+// batches or the multi-draw renderer, which already turn the frame into a handful of GL calls.
+// Lists are replayed in the order of their ranges, so the frame is the same whatever the
+// number of threads.
+//
+// Waking the pool costs a few microseconds, fewer than COMMAND_LIST_OBJECTS_PER_THREAD objects
+// are recorded on the calling thread.
+//
+// Options:
+//     -recordthreads N    threads that record, every thread of the worker pool by default, 1
+//                         records on the GL thread
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "DynamicBufferRing.h"
+#include "InstancedRenderer.h"
+#include "MultiDrawRenderer.h"
+#include "Profiler.h"
+#include "RenderQueue.h"
+#include "WorkerPool.h"
+
+const size_t COMMAND_LIST_OBJECTS_PER_THREAD = 1024; // fewer than this aren't worth a thread
+
+// One draw, as recorded by a worker
+struct DrawCommand
+{
+    uint64_t sortKey;
+    uint32_t target; // instance batch or mesh index, up to the replay
+    const InstanceData *instance; // owned by the caller, read by the replay
+};
+
+// Written by one thread only while recording
+struct CommandList
+{
+    std::vector<DrawCommand> commands;
+};
+
+struct CommandRecorder
+{
+    int threadCount = 0; // 0 for every thread of the worker pool
+    std::vector<CommandList> lists; // one per thread, the first jobs hold this frame's commands
+    int jobs = 0;
+
+    // Scratch for replaying in key order
+    RenderQueue queue;
+    std::vector<const DrawCommand *> replayOrder;
+    std::vector<size_t> batchFirst; // where each batch's instances start in the replay's allocation
+    std::vector<size_t> batchEnd;
+
+    // Totals for printCommandListStats
+    uint64_t recorded = 0;
+    uint64_t jobsRun = 0;
+    int recordings = 0;
+};
+
+// Reads the options above out of argv
+void parseCommandListArguments(CommandRecorder &recorder, int argc, char *argv[])
+{
+    for (int i = 1; i + 1 < argc; i++)
+        if (strcmp(argv[i], "-recordthreads") == 0)
+            recorder.threadCount = std::max(atoi(argv[++i]), 0);
+}
+
+// Start the worker pool first, there are never more threads than it has
+void initCommandRecorder(CommandRecorder &recorder)
+{
+    int poolThreads = workerPoolThreads(workerPool);
+    int threadCount = recorder.threadCount > 0 ? recorder.threadCount : poolThreads;
+    recorder.threadCount = std::min(std::max(threadCount, 1), poolThreads);
+    recorder.lists.resize(recorder.threadCount);
+}
+
+// instance has to stay where it is until the lists are replayed
+inline void recordDraw(CommandList &list, uint32_t target, uint64_t sortKey, const InstanceData &instance)
+{
+    DrawCommand command;
+    command.sortKey = sortKey;
+    command.target = target;
+    command.instance = &instance;
+    list.commands.push_back(command);
+}
+
+// Calls record(list, begin, end) for ranges covering objects 0..objectCount-1, on the worker
+// pool with a list per range. record must only write to the list it is given and to what
+// belongs to its own objects, and may be called for an empty range.
+template <typename Record>
+void recordCommandLists(CommandRecorder &recorder, size_t objectCount, const Record &record)
+{
+    PROFILE_SCOPE("Record commands");
+    size_t useful = std::max<size_t>(1, objectCount / COMMAND_LIST_OBJECTS_PER_THREAD);
+    recorder.jobs = (int)std::min((size_t)recorder.threadCount, useful);
+    for (int job = 0; job < recorder.jobs; job++)
+        recorder.lists[job].commands.clear();
+    runParallelJobs(workerPool, recorder.jobs, [&](int job, int jobCount) {
+        PROFILE_SCOPE("Record command list");
+        record(recorder.lists[job], objectCount * job / jobCount, objectCount * (job + 1) / jobCount);
+    });
+
+    for (int job = 0; job < recorder.jobs; job++)
+        recorder.recorded += recorder.lists[job].commands.size();
+    recorder.jobsRun += recorder.jobs;
+    recorder.recordings++;
+}
+
+// Fills batches[target] with the commands, nearest first when the keys carry a depth and in
+// recording order among equal keys. Each instance is copied once, straight into a dynamic
+// buffer ring allocation shared by the batches, or added to the batches as usual when the ring
+// has no room.
+void replayCommandLists(CommandRecorder &recorder, InstanceBatch *const batches[], int batchCount)
+{
+    PROFILE_SCOPE("Replay commands");
+    clearRenderQueue(recorder.queue);
+    recorder.replayOrder.clear();
+    recorder.batchEnd.assign(batchCount, 0);
+    for (int job = 0; job < recorder.jobs; job++)
+        for (const DrawCommand &command : recorder.lists[job].commands)
+        {
+            pushRenderItem(recorder.queue, command.sortKey, (uint32_t)recorder.replayOrder.size());
+            recorder.replayOrder.push_back(&command);
+            recorder.batchEnd[command.target]++;
+        }
+    sortRenderQueue(recorder.queue);
+
+    // One allocation, a mapping without persistent storage can't be shared between batches
+    DynamicAllocation allocation;
+    if (!recorder.replayOrder.empty() &&
+        allocateDynamicBuffer(dynamicBufferRing, recorder.replayOrder.size() * sizeof(InstanceData), allocation))
+    {
+        recorder.batchFirst.resize(batchCount);
+        size_t first = 0;
+        for (int target = 0; target < batchCount; target++)
+        {
+            recorder.batchFirst[target] = first;
+            first += recorder.batchEnd[target];
+            recorder.batchEnd[target] = recorder.batchFirst[target];
+        }
+        InstanceData *instances = (InstanceData *)allocation.data;
+        for (const RenderItem &item : recorder.queue.items)
+        {
+            const DrawCommand &command = *recorder.replayOrder[item.index];
+            instances[recorder.batchEnd[command.target]++] = *command.instance;
+        }
+        commitDynamicBuffer(dynamicBufferRing, allocation);
+        for (int target = 0; target < batchCount; target++)
+            useStreamedInstances(*batches[target], allocation.offset + recorder.batchFirst[target] * sizeof(InstanceData),
+                                 recorder.batchEnd[target] - recorder.batchFirst[target]);
+        return;
+    }
+
+    for (int target = 0; target < batchCount; target++)
+        clearInstances(*batches[target]);
+    for (const RenderItem &item : recorder.queue.items)
+    {
+        const DrawCommand &command = *recorder.replayOrder[item.index];
+        addInstance(*batches[command.target], *command.instance);
+    }
+}
+
+// Adds the commands as draws of mesh target, the renderer sorts them itself. Call between
+// beginMultiDraw and the upload.
+void replayCommandLists(const CommandRecorder &recorder, MultiDrawRenderer &renderer)
+{
+    PROFILE_SCOPE("Replay commands");
+    for (int job = 0; job < recorder.jobs; job++)
+        for (const DrawCommand &command : recorder.lists[job].commands)
+            addDraw(renderer, (int)command.target, *command.instance, command.sortKey);
+}
+
+void printCommandListStats(const CommandRecorder &recorder)
+{
+    if (recorder.recordings == 0)
+        return;
+    std::cout << "Command lists: " << (double)recorder.recorded / recorder.recordings << " draws recorded per frame on "
+              << (double)recorder.jobsRun / recorder.recordings << " threads, " << recorder.threadCount << " available" << std::endl;
+}
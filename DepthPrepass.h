@@ -0,0 +1,205 @@
+//
+// Depth pre-pass and front-to-back ordering, with fragment counts to tell when they pay off
+//
+// With the pre-pass on, the opaque draws are submitted twice. The first pass draws them with a
+// SHADER_DEPTH_ONLY variant and color writes off, which only fills the depth buffer. The
+// shading pass then draws them again with the real shaders, depth writes off and GL_LEQUAL, so
+// the fragment shader runs once per pixel, for the nearest surface only. That trades a second
+// geometry pass for the overdraw, which is a win when the fragment shader is the bottleneck
+// (Phong lighting on a software rasterizer) and a loss when it is cheap. Drawing front to back
+// gets part of the same saving from early depth testing alone, and is toggled separately.
+//
+// The shading pass is measured with two queries: the samples that passed the depth test, which
+// is what gets shaded wherever early depth testing applies, and where
+// GL_ARB_pipeline_statistics_query is supported the fragment shader invocations the driver
+// reports. The two differ on drivers that test depth inside the shader (llvmpipe counts every
+// rasterized fragment as an invocation), the first is the one the pre-pass brings down. The
+// queries are read a few frames later, so counting never stalls, and the averages for each
+// combination of the two settings are printed on exit.
+//
+// Options:
+//     -prepass      start with the depth pre-pass on, P toggles it
+//     -unsorted     start with front-to-back ordering off, O toggles it
+//
+
+#pragma once
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include "GLStateCache.h"
+#include "RenderContext.h"
+
+// Frames a fragment count query is given before it is read
+const int DEPTH_PREPASS_QUERY_COUNT = 4;
+
+// Combinations of the two settings, see depthPrepassMode
+const int DEPTH_PREPASS_MODES = 4;
+const char *const DEPTH_PREPASS_MODE_NAMES[DEPTH_PREPASS_MODES] = {"unsorted", "front to back", "pre-pass, unsorted", "pre-pass, front to back"};
+
+struct DepthPrepass
+{
+    bool enabled = false;
+    bool frontToBack = true;
+    bool prepassKeyWasDown = false;
+    bool orderKeyWasDown = false;
+
+    bool countInvocations = false;
+    GLuint sampleQueries[DEPTH_PREPASS_QUERY_COUNT] = {};
+    GLuint invocationQueries[DEPTH_PREPASS_QUERY_COUNT] = {};
+    int queryModes[DEPTH_PREPASS_QUERY_COUNT] = {}; // mode each query pair measured, -1 if none
+    int nextQuery = 0;
+    bool counting = false;
+
+    // Totals and frames measured, for each mode
+    uint64_t samplesPassed[DEPTH_PREPASS_MODES] = {};
+    uint64_t invocations[DEPTH_PREPASS_MODES] = {};
+    int measuredFrames[DEPTH_PREPASS_MODES] = {};
+};
+
+inline int depthPrepassMode(const DepthPrepass &prepass)
+{
+    return (prepass.enabled ? 2 : 0) | (prepass.frontToBack ? 1 : 0);
+}
+
+// Reads the options above out of argv
+void parseDepthPrepassArguments(DepthPrepass &prepass, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-prepass") == 0)
+            prepass.enabled = true;
+        else if (strcmp(argv[i], "-unsorted") == 0)
+            prepass.frontToBack = false;
+    }
+}
+
+// Call once the GL context is current
+void createDepthPrepass(DepthPrepass &prepass)
+{
+    prepass.countInvocations = GLEW_ARB_pipeline_statistics_query != 0;
+    glGenQueries(DEPTH_PREPASS_QUERY_COUNT, prepass.sampleQueries);
+    if (prepass.countInvocations)
+        glGenQueries(DEPTH_PREPASS_QUERY_COUNT, prepass.invocationQueries);
+    for (int i = 0; i < DEPTH_PREPASS_QUERY_COUNT; i++)
+        prepass.queryModes[i] = -1;
+}
+
+// Adds the results of a finished query pair to its mode's totals, waiting for them when wait
+// is set. Both queries end together, so the second is available once the first is.
+bool readDepthPrepassQuery(DepthPrepass &prepass, int slot, bool wait)
+{
+    int mode = prepass.queryModes[slot];
+    if (mode < 0)
+        return true;
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(prepass.sampleQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available && !wait)
+        return false;
+    GLuint64 count = 0;
+    glGetQueryObjectui64v(prepass.sampleQueries[slot], GL_QUERY_RESULT, &count);
+    prepass.samplesPassed[mode] += count;
+    if (prepass.countInvocations)
+    {
+        glGetQueryObjectui64v(prepass.invocationQueries[slot], GL_QUERY_RESULT, &count);
+        prepass.invocations[mode] += count;
+    }
+    prepass.measuredFrames[mode]++;
+    prepass.queryModes[slot] = -1;
+    return true;
+}
+
+void destroyDepthPrepass(DepthPrepass &prepass)
+{
+    glDeleteQueries(DEPTH_PREPASS_QUERY_COUNT, prepass.sampleQueries);
+    if (prepass.countInvocations)
+        glDeleteQueries(DEPTH_PREPASS_QUERY_COUNT, prepass.invocationQueries);
+}
+
+// Call once per frame with the input, toggles the settings when P or O goes down
+void updateDepthPrepassKeys(DepthPrepass &prepass, const RenderContext &context)
+{
+    bool prepassKeyDown = isRenderContextKeyDown(context, GLFW_KEY_P);
+    if (prepassKeyDown && !prepass.prepassKeyWasDown)
+    {
+        prepass.enabled = !prepass.enabled;
+        std::cout << "Depth pre-pass " << (prepass.enabled ? "on" : "off") << std::endl;
+    }
+    prepass.prepassKeyWasDown = prepassKeyDown;
+
+    bool orderKeyDown = isRenderContextKeyDown(context, GLFW_KEY_O);
+    if (orderKeyDown && !prepass.orderKeyWasDown)
+    {
+        prepass.frontToBack = !prepass.frontToBack;
+        std::cout << "Front-to-back ordering " << (prepass.frontToBack ? "on" : "off") << std::endl;
+    }
+    prepass.orderKeyWasDown = orderKeyDown;
+}
+
+// Returns true if the pre-pass is on, the caller then draws its opaque geometry with a
+// SHADER_DEPTH_ONLY variant before calling beginShadingPass
+bool beginDepthPrepass(DepthPrepass &prepass)
+{
+    if (!prepass.enabled)
+        return false;
+    cachedColorMask(glState, GL_FALSE);
+    cachedDepthMask(glState, GL_TRUE);
+    cachedDepthFunc(glState, GL_LESS);
+    return true;
+}
+
+// Call before the opaque draws that run the real shaders, starts counting their fragments
+void beginShadingPass(DepthPrepass &prepass)
+{
+    cachedColorMask(glState, GL_TRUE);
+    cachedDepthMask(glState, prepass.enabled ? GL_FALSE : GL_TRUE);
+    cachedDepthFunc(glState, prepass.enabled ? GL_LEQUAL : GL_LESS);
+
+    // A query still in flight after all these frames is left alone, this frame goes uncounted
+    int slot = prepass.nextQuery;
+    if (!readDepthPrepassQuery(prepass, slot, false))
+        return;
+    glBeginQuery(GL_SAMPLES_PASSED, prepass.sampleQueries[slot]);
+    if (prepass.countInvocations)
+        glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, prepass.invocationQueries[slot]);
+    prepass.queryModes[slot] = depthPrepassMode(prepass);
+    prepass.counting = true;
+}
+
+// Call after the shading pass, puts the depth and color writes back so the next frame's
+// clear reaches both buffers
+void endShadingPass(DepthPrepass &prepass)
+{
+    if (prepass.counting)
+    {
+        glEndQuery(GL_SAMPLES_PASSED);
+        if (prepass.countInvocations)
+            glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+        prepass.nextQuery = (prepass.nextQuery + 1) % DEPTH_PREPASS_QUERY_COUNT;
+        prepass.counting = false;
+    }
+    cachedDepthMask(glState, GL_TRUE);
+    cachedDepthFunc(glState, GL_LESS);
+}
+
+// Waits for the queries still in flight, so every frame rendered is in the averages
+void printDepthPrepassStats(DepthPrepass &prepass)
+{
+    for (int i = 0; i < DEPTH_PREPASS_QUERY_COUNT; i++)
+        readDepthPrepassQuery(prepass, i, true);
+    for (int mode = 0; mode < DEPTH_PREPASS_MODES; mode++)
+    {
+        int frames = prepass.measuredFrames[mode];
+        if (frames == 0)
+            continue;
+        std::cout << "Overdraw (" << DEPTH_PREPASS_MODE_NAMES[mode] << "): "
+                  << (double)prepass.samplesPassed[mode] / frames << " samples passed";
+        if (prepass.countInvocations)
+            std::cout << ", " << (double)prepass.invocations[mode] / frames << " fragment shader invocations";
+        std::cout << " per frame over " << frames << " frames" << std::endl;
+    }
+}
@@ -0,0 +1,238 @@
+//
+// Dynamic buffer ring - per-frame data streamed with memcpy and no driver sync
+//
+// One GL buffer split into three regions, one per frame in flight. Each frame the CPU writes
+// into its own region while the GPU may still be reading the two before it. When a region
+// comes around again the fence set at the end of its frame says whether the GPU is done with
+// it, which it almost always is by then.
+//
+// With GL_ARB_buffer_storage the buffer is mapped once, persistently and coherently, and an
+// allocation is just a pointer into the mapping. Without it (plain GL 3.3) each allocation maps
+// its range unsynchronized, and a region whose fence hasn't signalled is not waited for: the
+// whole buffer is orphaned instead, so the frames still in flight keep the old storage.
+//
+// Uniform blocks, instance attributes and indirect commands are all taken from the same
+// buffer, bound to whichever target reads them at the allocation's offset. Allocations that
+// don't fit in a region return false, the caller uses its own buffer for that frame and the
+// ring grows to fit at the start of the next.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+
+#include "GLStateCache.h"
+
+const int DYNAMIC_BUFFER_REGIONS = 3;
+
+struct DynamicBufferRing
+{
+    GLuint buffer = 0;
+    GLsizeiptr regionSize = 0;
+    GLsizeiptr alignment = 16;      // offsets are rounded up to this, it covers uniform blocks
+    int region = 0;                 // region written this frame
+    GLsizeiptr head = 0;            // bytes used in it
+    GLsizeiptr requested = 0;       // bytes asked for this frame, including what didn't fit
+    unsigned char *persistentData = nullptr; // only set with GL_ARB_buffer_storage
+    GLsync fences[DYNAMIC_BUFFER_REGIONS] = {};
+
+    // Totals for printDynamicBufferStats
+    uint64_t bytesStreamed = 0;
+    uint64_t overflows = 0;
+    int waits = 0;
+    int orphans = 0;
+    int frames = 0;
+};
+
+// Memory handed out by allocateDynamicBuffer, write size bytes to data
+struct DynamicAllocation
+{
+    unsigned char *data = nullptr;
+    GLintptr offset = 0;
+    GLsizeiptr size = 0;
+};
+
+DynamicBufferRing dynamicBufferRing;
+
+inline bool dynamicBufferRingSupported()
+{
+    // Both are core in 3.2, where drivers need not list the extensions
+    return GLEW_VERSION_3_2 || (GLEW_ARB_map_buffer_range && GLEW_ARB_sync);
+}
+
+// The ring is bound to GL_COPY_WRITE_BUFFER to create and map it, a target nothing draws from,
+// so the other bindings (and the state cache's idea of them) are left alone
+void allocateDynamicBufferStorage(DynamicBufferRing &ring)
+{
+    GLsizeiptr size = ring.regionSize * DYNAMIC_BUFFER_REGIONS;
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+        ring.persistentData = (unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+    }
+    else
+        glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void releaseDynamicBufferStorage(DynamicBufferRing &ring)
+{
+    for (int i = 0; i < DYNAMIC_BUFFER_REGIONS; i++)
+        if (ring.fences[i] != nullptr)
+        {
+            glClientWaitSync(ring.fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(ring.fences[i]);
+            ring.fences[i] = nullptr;
+        }
+    if (ring.persistentData != nullptr)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        ring.persistentData = nullptr;
+    }
+    glDeleteBuffers(1, &ring.buffer);
+    ring.buffer = 0;
+}
+
+// regionSize is what one frame can stream, the buffer is three times that
+bool createDynamicBufferRing(DynamicBufferRing &ring, GLsizeiptr regionSize)
+{
+    if (!dynamicBufferRingSupported())
+    {
+        std::cerr << "Buffer ring not supported, per-frame data goes through glBufferSubData" << std::endl;
+        return false;
+    }
+    GLint uniformAlignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+    ring.alignment = std::max<GLsizeiptr>(16, uniformAlignment);
+    ring.regionSize = (regionSize + ring.alignment - 1) / ring.alignment * ring.alignment;
+    ring.region = DYNAMIC_BUFFER_REGIONS - 1; // the first frame starts at region 0
+    allocateDynamicBufferStorage(ring);
+    return true;
+}
+
+void destroyDynamicBufferRing(DynamicBufferRing &ring)
+{
+    if (ring.buffer != 0)
+        releaseDynamicBufferStorage(ring);
+}
+
+// Call at the start of every frame, before anything is allocated
+void beginDynamicBufferFrame(DynamicBufferRing &ring)
+{
+    if (ring.buffer == 0)
+        return;
+    ring.frames++;
+
+    // Last frame didn't fit, start over with regions big enough for it
+    if (ring.requested > ring.regionSize)
+    {
+        GLsizeiptr regionSize = std::max(ring.requested + ring.requested / 2, ring.regionSize * 2);
+        releaseDynamicBufferStorage(ring);
+        ring.regionSize = (regionSize + ring.alignment - 1) / ring.alignment * ring.alignment;
+        allocateDynamicBufferStorage(ring);
+        // The new buffer may reuse the old name, which the state cache still thinks is bound
+        invalidateGLState(glState);
+    }
+    ring.requested = 0;
+    ring.head = 0;
+    ring.region = (ring.region + 1) % DYNAMIC_BUFFER_REGIONS;
+
+    GLsync &fence = ring.fences[ring.region];
+    if (fence == nullptr)
+        return;
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+    {
+        if (ring.persistentData != nullptr)
+        {
+            // Immutable storage can't be orphaned, the GPU is more than two frames behind
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            ring.waits++;
+        }
+        else
+        {
+            // New storage for the whole buffer, every region is free again
+            glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+            glBufferData(GL_COPY_WRITE_BUFFER, ring.regionSize * DYNAMIC_BUFFER_REGIONS, nullptr, GL_STREAM_DRAW);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            for (int i = 0; i < DYNAMIC_BUFFER_REGIONS; i++)
+                if (ring.fences[i] != nullptr && i != ring.region)
+                {
+                    glDeleteSync(ring.fences[i]);
+                    ring.fences[i] = nullptr;
+                }
+            ring.orphans++;
+        }
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+// Reserves size bytes in this frame's region. Returns false if the ring is unavailable or the
+// region is full.
+bool allocateDynamicBuffer(DynamicBufferRing &ring, GLsizeiptr size, DynamicAllocation &allocation)
+{
+    if (ring.buffer == 0)
+        return false;
+    GLsizeiptr begin = (ring.head + ring.alignment - 1) / ring.alignment * ring.alignment;
+    ring.requested += (size + ring.alignment - 1) / ring.alignment * ring.alignment;
+    if (begin + size > ring.regionSize)
+    {
+        ring.overflows++;
+        return false;
+    }
+
+    allocation.offset = ring.regionSize * ring.region + begin;
+    allocation.size = size;
+    if (ring.persistentData != nullptr)
+        allocation.data = ring.persistentData + allocation.offset;
+    else
+    {
+        // The fences (or the orphaning) guarantee nothing reads this range any more
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+        allocation.data = (unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, allocation.offset, size,
+                                                            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        if (allocation.data == nullptr)
+            return false;
+    }
+    ring.head = begin + size;
+    ring.bytesStreamed += size;
+    return true;
+}
+
+// Call once the allocation is written, before anything draws from it
+void commitDynamicBuffer(DynamicBufferRing &ring, const DynamicAllocation &allocation)
+{
+    // A coherent persistent mapping is seen by the GPU as it is written
+    (void)allocation;
+    if (ring.persistentData != nullptr)
+        return;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Call after the frame's last draw, the fence marks when this region can be written again
+void endDynamicBufferFrame(DynamicBufferRing &ring)
+{
+    if (ring.buffer == 0)
+        return;
+    ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void printDynamicBufferStats(const DynamicBufferRing &ring)
+{
+    if (ring.frames == 0)
+        return;
+    std::cout << "Buffer ring: " << (double)ring.bytesStreamed / ring.frames / 1024.0 << " KB streamed per frame, "
+              << ring.waits << " waits, " << ring.orphans << " orphans, " << ring.overflows << " overflows" << std::endl;
+}
@@ -0,0 +1,242 @@
+//
+// Frame time benchmark over a replayed input path
+//
+// With -benchmark FILE the run takes its input from a recorded path (-replay FILE at the time
+// steps it was recorded with, or the built-in path in InputReplay.h at 60 Hz when none is
+// given), so every run renders the same frames. Each frame is timed on the CPU, from the start
+// of one frame to the start of the next, so waits in swap or flush are included. Where the
+// context has timer queries the GPU time of the frame is measured too. The queries are read a
+// few frames later, so the measurement never stalls the pipeline.
+//
+// On exit p50/p95/p99/max frame times and the draw call and triangle counts the renderers
+// reported to the GL state cache are written to FILE as JSON.
+//
+// Options:
+//     -benchmark FILE    replay a path and write the results to FILE
+//     -warmup N          leave the first N frames out of the results, 0 by default
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "GLStateCache.h"
+#include "RenderContext.h"
+
+// Frames a GPU timer query is given before it is read
+const int BENCHMARK_QUERY_COUNT = 4;
+
+struct FrameBenchmark
+{
+    const char *outputPath = nullptr; // benchmarking is off without one
+    int warmupFrames = 0;
+
+    // One entry per frame, -1 where the GPU time is unknown
+    std::vector<double> cpuMilliseconds;
+    std::vector<double> gpuMilliseconds;
+    std::vector<int> drawCalls;
+    std::vector<uint64_t> triangles;
+
+    double startTime = 0.0;
+    double frameStart = -1.0;
+    bool started = false;
+    bool gpuTimers = false;
+    GLuint queries[BENCHMARK_QUERY_COUNT] = {};
+    int queryFrames[BENCHMARK_QUERY_COUNT] = {}; // frame each query measured, -1 if none
+};
+
+// Reads the options above out of argv. Without a path of its own the benchmark replays the
+// built-in one, at 60 Hz unless -timestep says otherwise. A -replay path runs at the time
+// steps it was recorded with, or at -timestep when given.
+void parseBenchmarkArguments(FrameBenchmark &benchmark, RenderContext &context, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-benchmark") == 0)
+            benchmark.outputPath = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-warmup") == 0)
+            benchmark.warmupFrames = std::max(0, atoi(argv[++i]));
+    }
+    if (benchmark.outputPath == nullptr)
+        return;
+
+    // A recorded path keeps the time steps it was recorded with
+    if (context.replayPath == nullptr)
+    {
+        makeDefaultInputPath(context.inputPath);
+        context.replaying = true;
+        if (context.timeStep <= 0.0)
+            context.timeStep = 1.0 / 60.0;
+    }
+}
+
+// Called by the first frame, once the context is current
+void startFrameBenchmark(FrameBenchmark &benchmark, const RenderContext &context)
+{
+    benchmark.started = true;
+    benchmark.startTime = renderContextClock(context);
+    // Frames shouldn't wait for the display
+    if (context.window != nullptr)
+        glfwSwapInterval(0);
+
+    benchmark.gpuTimers = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (benchmark.gpuTimers)
+        glGenQueries(BENCHMARK_QUERY_COUNT, benchmark.queries);
+    for (int i = 0; i < BENCHMARK_QUERY_COUNT; i++)
+        benchmark.queryFrames[i] = -1;
+}
+
+// Stores the result of a finished query, waiting for it when wait is set
+bool readBenchmarkQuery(FrameBenchmark &benchmark, const RenderContext &context, int slot, bool wait)
+{
+    int frame = benchmark.queryFrames[slot];
+    if (frame < 0)
+        return true;
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(benchmark.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available && !wait)
+        return false;
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(benchmark.queries[slot], GL_QUERY_RESULT, &nanoseconds);
+    // Some drivers time the first query from an uninitialized start, anything longer than the
+    // benchmark has been running can't be right
+    double milliseconds = nanoseconds / 1.0e6;
+    if (milliseconds <= (renderContextClock(context) - benchmark.startTime) * 1000.0)
+        benchmark.gpuMilliseconds[frame] = milliseconds;
+    benchmark.queryFrames[slot] = -1;
+    return true;
+}
+
+// Call first thing in the render loop
+void beginBenchmarkFrame(FrameBenchmark &benchmark, const RenderContext &context)
+{
+    if (benchmark.outputPath == nullptr)
+        return;
+    if (!benchmark.started)
+        startFrameBenchmark(benchmark, context);
+
+    double now = renderContextClock(context);
+    if (benchmark.frameStart >= 0.0)
+        benchmark.cpuMilliseconds.back() = (now - benchmark.frameStart) * 1000.0;
+    benchmark.frameStart = now;
+
+    int frame = (int)benchmark.cpuMilliseconds.size();
+    benchmark.cpuMilliseconds.push_back(-1.0);
+    benchmark.gpuMilliseconds.push_back(-1.0);
+    benchmark.drawCalls.push_back(0);
+    benchmark.triangles.push_back(0);
+
+    if (benchmark.gpuTimers)
+    {
+        // The slot's last query is BENCHMARK_QUERY_COUNT frames old and almost always done.
+        // If it isn't, that frame's GPU time is dropped rather than waited for.
+        int slot = frame % BENCHMARK_QUERY_COUNT;
+        if (!readBenchmarkQuery(benchmark, context, slot, false))
+            benchmark.queryFrames[slot] = -1;
+        glBeginQuery(GL_TIME_ELAPSED, benchmark.queries[slot]);
+        benchmark.queryFrames[slot] = frame;
+    }
+}
+
+// Call after the frame's last draw, before it is presented
+void endBenchmarkFrame(FrameBenchmark &benchmark, const GLStateCache &cache)
+{
+    if (benchmark.outputPath == nullptr || benchmark.cpuMilliseconds.empty())
+        return;
+    if (benchmark.gpuTimers)
+        glEndQuery(GL_TIME_ELAPSED);
+    benchmark.drawCalls.back() = cache.drawCalls;
+    benchmark.triangles.back() = cache.triangles;
+}
+
+// Nearest-rank percentile of sorted values
+double benchmarkPercentile(const std::vector<double> &sorted, double percent)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t rank = (size_t)(percent / 100.0 * sorted.size() + 0.999999);
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+void writeBenchmarkTimes(FILE *file, const char *name, std::vector<double> times)
+{
+    times.erase(std::remove_if(times.begin(), times.end(), [](double t) { return t < 0.0; }), times.end());
+    if (times.empty())
+    {
+        fprintf(file, "  \"%s\": null,\n", name);
+        return;
+    }
+    std::sort(times.begin(), times.end());
+    double sum = 0.0;
+    for (double t : times)
+        sum += t;
+    fprintf(file, "  \"%s\": {\"samples\": %zu, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n",
+            name, times.size(), sum / times.size(), benchmarkPercentile(times, 50.0), benchmarkPercentile(times, 95.0),
+            benchmarkPercentile(times, 99.0), times.back());
+}
+
+// Times the last frame, collects the outstanding queries and writes the results. Call after
+// the render loop, while the context is still current.
+void finishFrameBenchmark(FrameBenchmark &benchmark, const RenderContext &context, const char *programName)
+{
+    if (benchmark.outputPath == nullptr || benchmark.cpuMilliseconds.empty())
+        return;
+    glFinish();
+    benchmark.cpuMilliseconds.back() = (renderContextClock(context) - benchmark.frameStart) * 1000.0;
+    if (benchmark.gpuTimers)
+    {
+        for (int slot = 0; slot < BENCHMARK_QUERY_COUNT; slot++)
+            readBenchmarkQuery(benchmark, context, slot, true);
+        glDeleteQueries(BENCHMARK_QUERY_COUNT, benchmark.queries);
+    }
+
+    size_t first = std::min((size_t)benchmark.warmupFrames, benchmark.cpuMilliseconds.size());
+    std::vector<double> cpu(benchmark.cpuMilliseconds.begin() + first, benchmark.cpuMilliseconds.end());
+    std::vector<double> gpu(benchmark.gpuMilliseconds.begin() + first, benchmark.gpuMilliseconds.end());
+    double drawSum = 0.0, triangleSum = 0.0;
+    int drawMax = 0;
+    uint64_t triangleMax = 0;
+    for (size_t i = first; i < benchmark.drawCalls.size(); i++)
+    {
+        drawSum += benchmark.drawCalls[i];
+        triangleSum += (double)benchmark.triangles[i];
+        drawMax = std::max(drawMax, benchmark.drawCalls[i]);
+        triangleMax = std::max(triangleMax, benchmark.triangles[i]);
+    }
+    size_t measured = std::max<size_t>(cpu.size(), 1);
+
+    FILE *file = fopen(benchmark.outputPath, "w");
+    if (file == nullptr)
+    {
+        std::cerr << "Could not write benchmark results to " << benchmark.outputPath << std::endl;
+        return;
+    }
+    fprintf(file, "{\n");
+    fprintf(file, "  \"program\": \"%s\",\n", programName);
+    fprintf(file, "  \"input\": \"%s\",\n", context.replayPath != nullptr ? context.replayPath : "built-in");
+    fprintf(file, "  \"width\": %d,\n  \"height\": %d,\n  \"headless\": %s,\n", context.width, context.height,
+            context.headless ? "true" : "false");
+    // null when the replay's recorded time steps were used
+    if (context.timeStep > 0.0)
+        fprintf(file, "  \"time_step\": %.6f,\n", context.timeStep);
+    else
+        fprintf(file, "  \"time_step\": null,\n");
+    fprintf(file, "  \"frames\": %zu,\n  \"warmup_frames\": %zu,\n", cpu.size(), first);
+    writeBenchmarkTimes(file, "cpu_frame_ms", cpu);
+    writeBenchmarkTimes(file, "gpu_frame_ms", gpu);
+    fprintf(file, "  \"draw_calls\": {\"mean\": %.2f, \"max\": %d},\n", drawSum / measured, drawMax);
+    fprintf(file, "  \"triangles\": {\"mean\": %.1f, \"max\": %llu}\n", triangleSum / measured, (unsigned long long)triangleMax);
+    fprintf(file, "}\n");
+    fclose(file);
+
+    std::sort(cpu.begin(), cpu.end());
+    std::cout << "Benchmark: " << cpu.size() << " frames, p50 " << benchmarkPercentile(cpu, 50.0) << " ms, p99 "
+              << benchmarkPercentile(cpu, 99.0) << " ms, results in " << benchmark.outputPath << std::endl;
+}
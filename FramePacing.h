@@ -0,0 +1,199 @@
+//
+// Frame pacing - frames in flight, a target frame time and input-to-present latency
+//
+// Drivers let the CPU queue several frames ahead of the GPU, and input latched for a frame
+// only reaches the screen once every frame queued before it has. waitForFrameSlot keeps the CPU
+// at most N frames ahead with a fence per frame, then, with a target frame time, sleeps until
+// shortly before the frame is due and spins the rest, since a sleep can wake up late by a
+// scheduler tick. Only after both waits does the program latch its input with
+// beginRenderContextFrame, so the waiting adds nothing to the input's age.
+//
+// With no more than three frames in flight the dynamic buffer ring's regions are always free
+// by the time they come around, the fences here do its waiting.
+//
+// After each present a GL timestamp is queried, and once the frame's fence has signalled it is
+// turned into CPU time and compared with the moment the frame's input was latched. That is
+// the time until the frame was rendered and handed to the window system, the display may add
+// up to one refresh on top. The percentiles are printed on exit.
+//
+// Options:
+//     -fps N               target frame rate, frames run as fast as they can without it
+//     -framesinflight N    frames the CPU may queue ahead of the GPU, 1 to 3, 2 by default
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "FrameBenchmark.h"
+#include "Profiler.h"
+#include "RenderContext.h"
+
+const int FRAME_PACING_MAX_FRAMES_IN_FLIGHT = 3;
+
+// The end of a sleep is spun instead, sleeps may overshoot by about this much
+const double FRAME_PACING_SPIN_SECONDS = 0.002;
+
+// A frame the GPU may still be working on
+struct PacedFrame
+{
+    GLsync fence = nullptr;
+    GLuint presentQuery = 0;
+    double inputClock = 0.0; // renderContextClock when its input was latched
+};
+
+struct FramePacer
+{
+    // Options
+    double targetFrameTime = 0.0; // seconds, 0 to not pace
+    int framesInFlight = 2;
+
+    PacedFrame frames[FRAME_PACING_MAX_FRAMES_IN_FLIGHT];
+    int frame = 0;
+    double deadline = -1.0;     // when the next frame is due, renderContextClock seconds
+    bool timers = false;
+    double gpuClockOffset = 0.0; // add to a GL timestamp in seconds for renderContextClock
+
+    // For printFramePacingStats
+    std::vector<double> latencyMilliseconds;
+    double sleptSeconds = 0.0;
+    double fenceSeconds = 0.0;
+    int fenceWaits = 0;
+    int pacedFrames = 0;
+};
+
+// Reads the options above out of argv
+void parseFramePacingArguments(FramePacer &pacer, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-fps") == 0)
+        {
+            double rate = atof(argv[++i]);
+            pacer.targetFrameTime = rate > 0.0 ? 1.0 / rate : 0.0;
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-framesinflight") == 0)
+            pacer.framesInFlight = std::min(std::max(atoi(argv[++i]), 1), FRAME_PACING_MAX_FRAMES_IN_FLIGHT);
+    }
+}
+
+// Reads both clocks at about the same moment, so GPU timestamps can be compared with CPU times
+void syncFramePacingClock(FramePacer &pacer, const RenderContext &context)
+{
+    GLint64 gpuNow = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+    pacer.gpuClockOffset = renderContextClock(context) - gpuNow / 1.0e9;
+}
+
+// Call once the GL context is current
+void createFramePacer(FramePacer &pacer, const RenderContext &context)
+{
+    pacer.timers = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (!pacer.timers)
+        return;
+    for (int i = 0; i < FRAME_PACING_MAX_FRAMES_IN_FLIGHT; i++)
+        glGenQueries(1, &pacer.frames[i].presentQuery);
+    syncFramePacingClock(pacer, context);
+}
+
+// Waits for a frame to finish on the GPU, then records its latency
+void retirePacedFrame(FramePacer &pacer, PacedFrame &frame)
+{
+    if (frame.fence == nullptr)
+        return;
+    if (glClientWaitSync(frame.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        pacer.fenceSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        pacer.fenceWaits++;
+    }
+    glDeleteSync(frame.fence);
+    frame.fence = nullptr;
+
+    // Queried before the fence, so the result is there now
+    if (pacer.timers)
+    {
+        GLuint64 presented = 0;
+        glGetQueryObjectui64v(frame.presentQuery, GL_QUERY_RESULT, &presented);
+        double latency = presented / 1.0e9 + pacer.gpuClockOffset - frame.inputClock;
+        if (latency >= 0.0)
+            pacer.latencyMilliseconds.push_back(latency * 1000.0);
+    }
+}
+
+// Call at the top of the render loop, before beginRenderContextFrame. Blocks until the GPU is
+// no more than framesInFlight - 1 frames behind and the target frame time has passed.
+void waitForFrameSlot(FramePacer &pacer, const RenderContext &context)
+{
+    PROFILE_SCOPE("Frame pacing");
+    retirePacedFrame(pacer, pacer.frames[pacer.frame % pacer.framesInFlight]);
+
+    if (pacer.targetFrameTime > 0.0)
+    {
+        double now = renderContextClock(context);
+        // More than a frame late, start over from now rather than rushing to catch up
+        if (pacer.deadline < 0.0 || now > pacer.deadline + pacer.targetFrameTime)
+            pacer.deadline = now;
+        double sleep = pacer.deadline - now - FRAME_PACING_SPIN_SECONDS;
+        if (sleep > 0.0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(sleep));
+        while (renderContextClock(context) < pacer.deadline)
+            std::this_thread::yield();
+        pacer.sleptSeconds += std::max(0.0, renderContextClock(context) - now);
+        pacer.deadline += pacer.targetFrameTime;
+    }
+
+    if (pacer.timers)
+        syncFramePacingClock(pacer, context);
+}
+
+// Call right after endRenderContextFrame
+void endPacedFrame(FramePacer &pacer, const RenderContext &context)
+{
+    PacedFrame &frame = pacer.frames[pacer.frame % pacer.framesInFlight];
+    frame.inputClock = context.inputClock;
+    if (pacer.timers)
+        glQueryCounter(frame.presentQuery, GL_TIMESTAMP);
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pacer.frame++;
+    pacer.pacedFrames++;
+}
+
+void destroyFramePacer(FramePacer &pacer)
+{
+    for (int i = 0; i < FRAME_PACING_MAX_FRAMES_IN_FLIGHT; i++)
+    {
+        retirePacedFrame(pacer, pacer.frames[i]);
+        if (pacer.frames[i].presentQuery != 0)
+            glDeleteQueries(1, &pacer.frames[i].presentQuery);
+        pacer.frames[i].presentQuery = 0;
+    }
+}
+
+// Waits for the frames still in flight first, so every frame is in the report
+void printFramePacingStats(FramePacer &pacer)
+{
+    for (int i = 0; i < FRAME_PACING_MAX_FRAMES_IN_FLIGHT; i++)
+        retirePacedFrame(pacer, pacer.frames[i]);
+    if (pacer.pacedFrames == 0)
+        return;
+    std::cout << "Frame pacing: " << pacer.framesInFlight << " frames in flight, " << pacer.fenceWaits << " fence waits ("
+              << pacer.fenceSeconds * 1000.0 / pacer.pacedFrames << " ms per frame), "
+              << pacer.sleptSeconds * 1000.0 / pacer.pacedFrames << " ms paced per frame" << std::endl;
+    if (pacer.latencyMilliseconds.empty())
+        return;
+    std::vector<double> sorted = pacer.latencyMilliseconds;
+    std::sort(sorted.begin(), sorted.end());
+    std::cout << "Input to present: p50 " << benchmarkPercentile(sorted, 50.0) << " ms, p95 " << benchmarkPercentile(sorted, 95.0)
+              << " ms, p99 " << benchmarkPercentile(sorted, 99.0) << " ms, max " << sorted.back() << " ms over "
+              << sorted.size() << " frames" << std::endl;
+}
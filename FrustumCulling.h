@@ -0,0 +1,225 @@
+//
+// View-frustum culling of bounding spheres
+//
+// The six planes are extracted from projection * view (Gribb/Hartmann): each is a sum or
+// difference of the matrix's fourth row and one of the other rows, normalized so the plane
+// equation gives a distance. A sphere is outside when it lies entirely behind any plane.
+//
+// Spheres are kept structure-of-arrays (all x, then all y, ...) so eight of them are tested
+// against a plane with a few AVX instructions. Without AVX the same loop runs four wide with
+// SSE, and one at a time elsewhere. The result is a compact list of visible indices for the
+// renderer to walk.
+//
+// The build doesn't need -mavx: with GCC or Clang on x86 the AVX loop is compiled for AVX on
+// its own, and cullSpheres picks it at run time when the CPU has it. Built with -mavx (or
+// /arch:AVX) it is used unconditionally.
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "Profiler.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUSTUM_CULLING_AVX 1
+#define FRUSTUM_CULLING_AVX_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FRUSTUM_CULLING_AVX 1
+#define FRUSTUM_CULLING_AVX_TARGET __attribute__((target("avx")))
+#define FRUSTUM_CULLING_AVX_AT_RUNTIME 1
+#endif
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define FRUSTUM_CULLING_SSE 1
+#endif
+
+// Left, right, bottom, top, near, far. xyz is the inward normal, w the offset.
+struct FrustumPlanes
+{
+    glm::vec4 planes[6];
+};
+
+// Bounding spheres of the objects to cull, padded to a multiple of eight
+struct CullingSpheres
+{
+    std::vector<float> x, y, z, radius;
+    uint32_t count = 0;
+};
+
+FrustumPlanes extractFrustumPlanes(const glm::mat4 &viewProjection)
+{
+    // glm is column-major, row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++)
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+    FrustumPlanes frustum;
+    frustum.planes[0] = rows[3] + rows[0];
+    frustum.planes[1] = rows[3] - rows[0];
+    frustum.planes[2] = rows[3] + rows[1];
+    frustum.planes[3] = rows[3] - rows[1];
+    frustum.planes[4] = rows[3] + rows[2];
+    frustum.planes[5] = rows[3] - rows[2];
+    for (int i = 0; i < 6; i++)
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+    return frustum;
+}
+
+inline bool sphereInFrustum(const FrustumPlanes &frustum, const glm::vec3 &center, float radius)
+{
+    for (int i = 0; i < 6; i++)
+        if (glm::dot(glm::vec3(frustum.planes[i]), center) + frustum.planes[i].w < -radius)
+            return false;
+    return true;
+}
+
+// A sphere around the local-space sphere (center, radius) once world is applied. With
+// non-uniform scale the largest axis scale is used, so the result always contains the object.
+inline void transformBoundingSphere(const glm::mat4 &world, const glm::vec3 &center, float radius, glm::vec3 &worldCenter, float &worldRadius)
+{
+    worldCenter = glm::vec3(world * glm::vec4(center, 1.0f));
+    float scaleSquared = std::max(glm::dot(glm::vec3(world[0]), glm::vec3(world[0])),
+                                  std::max(glm::dot(glm::vec3(world[1]), glm::vec3(world[1])),
+                                           glm::dot(glm::vec3(world[2]), glm::vec3(world[2]))));
+    worldRadius = radius * sqrtf(scaleSquared);
+}
+
+void clearCullingSpheres(CullingSpheres &spheres)
+{
+    spheres.x.clear();
+    spheres.y.clear();
+    spheres.z.clear();
+    spheres.radius.clear();
+    spheres.count = 0;
+}
+
+// Returns the index the sphere is reported as in the visible list
+uint32_t addCullingSphere(CullingSpheres &spheres, const glm::vec3 &center, float radius)
+{
+    // Keep the padding lanes out of the way: a huge negative radius is never visible
+    if (spheres.count % 8 == 0)
+    {
+        spheres.x.resize(spheres.count + 8, 0.0f);
+        spheres.y.resize(spheres.count + 8, 0.0f);
+        spheres.z.resize(spheres.count + 8, 0.0f);
+        spheres.radius.resize(spheres.count + 8, -1e30f);
+    }
+    spheres.x[spheres.count] = center.x;
+    spheres.y[spheres.count] = center.y;
+    spheres.z[spheres.count] = center.z;
+    spheres.radius[spheres.count] = radius;
+    return spheres.count++;
+}
+
+#if defined(FRUSTUM_CULLING_AVX)
+FRUSTUM_CULLING_AVX_TARGET void cullSpheresAVX(const FrustumPlanes &frustum, const CullingSpheres &spheres, std::vector<uint32_t> &visible)
+{
+    __m256 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int p = 0; p < 6; p++)
+    {
+        planeX[p] = _mm256_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm256_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm256_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm256_set1_ps(frustum.planes[p].w);
+    }
+    for (uint32_t i = 0; i < spheres.count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(&spheres.x[i]);
+        __m256 y = _mm256_loadu_ps(&spheres.y[i]);
+        __m256 z = _mm256_loadu_ps(&spheres.z[i]);
+        __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+
+        // Lanes stay set while the sphere is in front of (or straddling) every plane
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, planeX[p]), _mm256_mul_ps(y, planeY[p])),
+                                            _mm256_add_ps(_mm256_mul_ps(z, planeZ[p]), planeW[p]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(inside);
+        for (int lane = 0; mask != 0; lane++, mask >>= 1)
+            if (mask & 1)
+                visible.push_back(i + lane);
+    }
+}
+#endif
+
+#if defined(FRUSTUM_CULLING_SSE)
+void cullSpheresSSE(const FrustumPlanes &frustum, const CullingSpheres &spheres, std::vector<uint32_t> &visible)
+{
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int p = 0; p < 6; p++)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+    for (uint32_t i = 0; i < spheres.count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&spheres.x[i]);
+        __m128 y = _mm_loadu_ps(&spheres.y[i]);
+        __m128 z = _mm_loadu_ps(&spheres.z[i]);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+
+        __m128 inside = _mm_cmpeq_ps(x, x); // all ones, positions are never NaN
+        for (int p = 0; p < 6; p++)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, planeX[p]), _mm_mul_ps(y, planeY[p])),
+                                         _mm_add_ps(_mm_mul_ps(z, planeZ[p]), planeW[p]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; mask != 0; lane++, mask >>= 1)
+            if (mask & 1)
+                visible.push_back(i + lane);
+    }
+}
+#endif
+
+// True if the AVX loop can run on this CPU
+inline bool frustumCullingUsesAVX()
+{
+#if defined(FRUSTUM_CULLING_AVX_AT_RUNTIME)
+    static const bool supported = __builtin_cpu_supports("avx") != 0;
+    return supported;
+#elif defined(FRUSTUM_CULLING_AVX)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Replaces visible with the index of every sphere that touches the frustum, in index order.
+// Returns how many were visible.
+uint32_t cullSpheres(const FrustumPlanes &frustum, const CullingSpheres &spheres, std::vector<uint32_t> &visible)
+{
+    PROFILE_SCOPE("Frustum cull");
+    visible.clear();
+#if defined(FRUSTUM_CULLING_AVX)
+    if (frustumCullingUsesAVX())
+    {
+        cullSpheresAVX(frustum, spheres, visible);
+        return (uint32_t)visible.size();
+    }
+#endif
+#if defined(FRUSTUM_CULLING_SSE)
+    cullSpheresSSE(frustum, spheres, visible);
+#else
+    for (uint32_t i = 0; i < spheres.count; i++)
+        if (sphereInFrustum(frustum, glm::vec3(spheres.x[i], spheres.y[i], spheres.z[i]), spheres.radius[i]))
+            visible.push_back(i);
+#endif
+    // The last batch may run into the padding, which is never visible
+    return (uint32_t)visible.size();
+}
@@ -0,0 +1,258 @@
+//
+// Cache of bound GL state, so redundant binds never reach the driver
+//
+// Every bind the render loops make per frame (program, VAO, texture units, buffer bindings,
+// enable/disable, depth and color writes) goes through the cached* functions below. They
+// remember the last value set and skip the GL call when it wouldn't change anything, counting
+// both cases so the savings show up in the stats. The state is kept from one frame to the
+// next, so a frame that binds what the last one left bound makes no calls at all. GL calls
+// made behind the cache's back (resource creation, texture uploads at load time, deleting a
+// bound object) leave it stale, invalidateGLState has to be called after them.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <iostream>
+
+const GLuint GL_STATE_UNKNOWN = 0xFFFFFFFFu;
+const int GL_STATE_TEXTURE_UNITS = 16;
+const int GL_STATE_UNIFORM_BINDINGS = 16;
+
+// Texture targets, buffer targets and capabilities that are tracked, anything else is passed
+// straight through
+const GLenum GL_STATE_TEXTURE_TARGETS[] = {GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY};
+const GLenum GL_STATE_BUFFER_TARGETS[] = {GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER,
+                                          GL_DRAW_INDIRECT_BUFFER, GL_PIXEL_UNPACK_BUFFER};
+const GLenum GL_STATE_CAPABILITIES[] = {GL_DEPTH_TEST, GL_CULL_FACE, GL_BLEND, GL_SCISSOR_TEST, GL_STENCIL_TEST};
+
+const int GL_STATE_TEXTURE_TARGET_COUNT = sizeof(GL_STATE_TEXTURE_TARGETS) / sizeof(GLenum);
+const int GL_STATE_BUFFER_TARGET_COUNT = sizeof(GL_STATE_BUFFER_TARGETS) / sizeof(GLenum);
+const int GL_STATE_CAPABILITY_COUNT = sizeof(GL_STATE_CAPABILITIES) / sizeof(GLenum);
+
+struct GLStateUniformBinding
+{
+    GLuint buffer;
+    GLintptr offset;
+    GLsizeiptr size; // 0 for glBindBufferBase
+};
+
+// Zero-initialized it matches a fresh context, where everything is unbound and disabled, the
+// depth and color write state starts at GL's own defaults
+struct GLStateCache
+{
+    GLuint program;
+    GLuint vertexArray;
+    GLuint activeTexture; // unit index, not GL_TEXTUREi
+    GLuint textures[GL_STATE_TEXTURE_UNITS][GL_STATE_TEXTURE_TARGET_COUNT];
+    GLuint buffers[GL_STATE_BUFFER_TARGET_COUNT];
+    GLStateUniformBinding uniformBindings[GL_STATE_UNIFORM_BINDINGS];
+    int capabilities[GL_STATE_CAPABILITY_COUNT]; // 1 enabled, 0 disabled, -1 unknown
+    GLuint depthMask = GL_TRUE;
+    GLuint depthFunc = GL_LESS;
+    GLuint colorMask = GL_TRUE; // all four channels together
+
+    // Calls passed to GL and skipped, this frame and since the first frame
+    int issued = 0;
+    int skipped = 0;
+    uint64_t totalIssued = 0;
+    uint64_t totalSkipped = 0;
+    int frames = 0;
+
+    // Draw calls and triangles submitted this frame
+    int drawCalls = 0;
+    uint64_t triangles = 0;
+};
+
+GLStateCache glState;
+
+inline int glStateIndex(const GLenum *values, int count, GLenum value)
+{
+    for (int i = 0; i < count; i++)
+        if (values[i] == value)
+            return i;
+    return -1;
+}
+
+// Records the new value and returns true if the call has to be made
+inline bool glStateChanged(GLStateCache &cache, GLuint &current, GLuint value)
+{
+    if (current == value)
+    {
+        cache.skipped++;
+        return false;
+    }
+    current = value;
+    cache.issued++;
+    return true;
+}
+
+// Forgets all state, the next call of each kind always goes through
+void invalidateGLState(GLStateCache &cache)
+{
+    cache.program = GL_STATE_UNKNOWN;
+    cache.vertexArray = GL_STATE_UNKNOWN;
+    cache.activeTexture = GL_STATE_UNKNOWN;
+    for (int unit = 0; unit < GL_STATE_TEXTURE_UNITS; unit++)
+        for (int target = 0; target < GL_STATE_TEXTURE_TARGET_COUNT; target++)
+            cache.textures[unit][target] = GL_STATE_UNKNOWN;
+    for (int target = 0; target < GL_STATE_BUFFER_TARGET_COUNT; target++)
+        cache.buffers[target] = GL_STATE_UNKNOWN;
+    for (int binding = 0; binding < GL_STATE_UNIFORM_BINDINGS; binding++)
+        cache.uniformBindings[binding].buffer = GL_STATE_UNKNOWN;
+    for (int capability = 0; capability < GL_STATE_CAPABILITY_COUNT; capability++)
+        cache.capabilities[capability] = -1;
+    cache.depthMask = GL_STATE_UNKNOWN;
+    cache.depthFunc = GL_STATE_UNKNOWN;
+    cache.colorMask = GL_STATE_UNKNOWN;
+}
+
+// Call at the start of every frame, adds last frame's counts to the totals. The cached state
+// itself carries over.
+void beginGLStateFrame(GLStateCache &cache)
+{
+    cache.totalIssued += cache.issued;
+    cache.totalSkipped += cache.skipped;
+    cache.frames++;
+    cache.issued = 0;
+    cache.skipped = 0;
+    cache.drawCalls = 0;
+    cache.triangles = 0;
+}
+
+// The renderers report every draw call here, indexCount per instance
+inline void countGLDraw(GLStateCache &cache, GLsizei indexCount, GLsizei instanceCount = 1)
+{
+    cache.drawCalls++;
+    cache.triangles += (uint64_t)(indexCount / 3) * instanceCount;
+}
+
+void cachedUseProgram(GLStateCache &cache, GLuint program)
+{
+    if (glStateChanged(cache, cache.program, program))
+        glUseProgram(program);
+}
+
+void cachedBindVertexArray(GLStateCache &cache, GLuint vertexArray)
+{
+    if (!glStateChanged(cache, cache.vertexArray, vertexArray))
+        return;
+    glBindVertexArray(vertexArray);
+    // The element buffer binding belongs to the VAO
+    cache.buffers[glStateIndex(GL_STATE_BUFFER_TARGETS, GL_STATE_BUFFER_TARGET_COUNT, GL_ELEMENT_ARRAY_BUFFER)] = GL_STATE_UNKNOWN;
+}
+
+// unit is an index, 0 for GL_TEXTURE0
+void cachedActiveTexture(GLStateCache &cache, GLuint unit)
+{
+    if (glStateChanged(cache, cache.activeTexture, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+// Binds to the active unit, like glBindTexture
+void cachedBindTexture(GLStateCache &cache, GLenum target, GLuint texture)
+{
+    int index = glStateIndex(GL_STATE_TEXTURE_TARGETS, GL_STATE_TEXTURE_TARGET_COUNT, target);
+    if (index < 0 || cache.activeTexture >= (GLuint)GL_STATE_TEXTURE_UNITS)
+    {
+        glBindTexture(target, texture);
+        cache.issued++;
+        return;
+    }
+    if (glStateChanged(cache, cache.textures[cache.activeTexture][index], texture))
+        glBindTexture(target, texture);
+}
+
+void cachedBindBuffer(GLStateCache &cache, GLenum target, GLuint buffer)
+{
+    int index = glStateIndex(GL_STATE_BUFFER_TARGETS, GL_STATE_BUFFER_TARGET_COUNT, target);
+    if (index < 0)
+    {
+        glBindBuffer(target, buffer);
+        cache.issued++;
+        return;
+    }
+    if (glStateChanged(cache, cache.buffers[index], buffer))
+        glBindBuffer(target, buffer);
+}
+
+// Indexed uniform buffer binding, size 0 binds the whole buffer like glBindBufferBase. Both
+// calls also change the generic GL_UNIFORM_BUFFER binding.
+void cachedBindBufferRange(GLStateCache &cache, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    if (index < (GLuint)GL_STATE_UNIFORM_BINDINGS)
+    {
+        GLStateUniformBinding &binding = cache.uniformBindings[index];
+        if (binding.buffer == buffer && binding.offset == offset && binding.size == size)
+        {
+            cache.skipped++;
+            return;
+        }
+        binding.buffer = buffer;
+        binding.offset = offset;
+        binding.size = size;
+    }
+    if (size == 0)
+        glBindBufferBase(GL_UNIFORM_BUFFER, index, buffer);
+    else
+        glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+    cache.buffers[glStateIndex(GL_STATE_BUFFER_TARGETS, GL_STATE_BUFFER_TARGET_COUNT, GL_UNIFORM_BUFFER)] = buffer;
+    cache.issued++;
+}
+
+void cachedSetCapability(GLStateCache &cache, GLenum capability, bool enabled)
+{
+    int index = glStateIndex(GL_STATE_CAPABILITIES, GL_STATE_CAPABILITY_COUNT, capability);
+    if (index >= 0 && cache.capabilities[index] == (enabled ? 1 : 0))
+    {
+        cache.skipped++;
+        return;
+    }
+    if (index >= 0)
+        cache.capabilities[index] = enabled ? 1 : 0;
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+    cache.issued++;
+}
+
+void cachedEnable(GLStateCache &cache, GLenum capability)
+{
+    cachedSetCapability(cache, capability, true);
+}
+
+void cachedDisable(GLStateCache &cache, GLenum capability)
+{
+    cachedSetCapability(cache, capability, false);
+}
+
+void cachedDepthMask(GLStateCache &cache, GLboolean write)
+{
+    if (glStateChanged(cache, cache.depthMask, write))
+        glDepthMask(write);
+}
+
+void cachedDepthFunc(GLStateCache &cache, GLenum func)
+{
+    if (glStateChanged(cache, cache.depthFunc, func))
+        glDepthFunc(func);
+}
+
+// Sets the writes of all four channels at once
+void cachedColorMask(GLStateCache &cache, GLboolean write)
+{
+    if (glStateChanged(cache, cache.colorMask, write))
+        glColorMask(write, write, write, write);
+}
+
+// Average binds per frame that reached GL and that the state cache skipped
+void printGLStateStats(const GLStateCache &cache)
+{
+    if (cache.frames == 0)
+        return;
+    std::cout << "GL state cache: " << (double)cache.totalIssued / cache.frames << " calls issued and "
+              << (double)cache.totalSkipped / cache.frames << " skipped per frame" << std::endl;
+}
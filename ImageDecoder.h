@@ -0,0 +1,258 @@
+//
+// Image decoders - pluggable backends behind loadTexture
+//
+// stb_image is always available and handles every format. When built with
+// -DUSE_LIBJPEG_TURBO (and linked with -ljpeg), JPEG files go through libjpeg-turbo instead,
+// which uses SSE2/AVX2/NEON for the IDCT and colour conversion and can scale the image down
+// inside the IDCT, so pixels that would be thrown away are never fully decoded.
+//
+// Decoding is split in two steps so the caller can size the destination first and have the
+// decoder write straight into it (for example into a texture upload ring slot).
+//
+
+#pragma once
+
+#include <stb/stb_image.h>
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef USE_LIBJPEG_TURBO
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+struct ImageDecodeRequest
+{
+    int desiredChannels = 0; // 0 keeps the channel count stored in the file
+    int maxWidth = 0;        // 0 means no limit, otherwise the image is halved until it fits
+    int maxHeight = 0;
+    bool flipVertically = false;
+};
+
+// Size and layout of the decoded pixels, after scaling and channel conversion
+struct ImageInfo
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+};
+
+class ImageDecoder
+{
+public:
+    virtual ~ImageDecoder() {}
+    virtual const char *name() const = 0;
+    virtual bool canDecode(const unsigned char *data, size_t size) const = 0;
+    virtual bool getInfo(const unsigned char *data, size_t size, const ImageDecodeRequest &request, ImageInfo &info) = 0;
+    // pixels must hold info.width * info.height * info.channels bytes, rows are tightly packed
+    virtual bool decode(const unsigned char *data, size_t size, const ImageDecodeRequest &request, const ImageInfo &info, unsigned char *pixels) = 0;
+};
+
+// Number of times an image has to be halved to fit in the requested size, at most 3 (1/8)
+inline int imageScaleShift(int width, int height, const ImageDecodeRequest &request)
+{
+    int shift = 0;
+    while (shift < 3 &&
+           ((request.maxWidth > 0 && ((width + (1 << shift) - 1) >> shift) > request.maxWidth) ||
+            (request.maxHeight > 0 && ((height + (1 << shift) - 1) >> shift) > request.maxHeight)))
+    {
+        shift++;
+    }
+    return shift;
+}
+
+class StbImageDecoder : public ImageDecoder
+{
+public:
+    const char *name() const { return "stb_image"; }
+
+    bool canDecode(const unsigned char *, size_t) const { return true; }
+
+    bool getInfo(const unsigned char *data, size_t size, const ImageDecodeRequest &request, ImageInfo &info)
+    {
+        int width, height, channels;
+        if (!stbi_info_from_memory(data, (int)size, &width, &height, &channels))
+            return false;
+
+        int shift = imageScaleShift(width, height, request);
+        info.width = (width + (1 << shift) - 1) >> shift;
+        info.height = (height + (1 << shift) - 1) >> shift;
+        info.channels = request.desiredChannels != 0 ? request.desiredChannels : channels;
+        return true;
+    }
+
+    bool decode(const unsigned char *data, size_t size, const ImageDecodeRequest &request, const ImageInfo &info, unsigned char *pixels)
+    {
+        stbi_set_flip_vertically_on_load(request.flipVertically);
+
+        int width, height, channels;
+        unsigned char *full = stbi_load_from_memory(data, (int)size, &width, &height, &channels, info.channels);
+        if (!full)
+            return false;
+
+        if (width == info.width && height == info.height)
+        {
+            memcpy(pixels, full, (size_t)width * height * info.channels);
+        }
+        else
+        {
+            // stb_image cannot scale while decoding, box filter the full image down instead, by
+            // the same power of two on both axes that getInfo sized the result with
+            int factor = 1 << imageScaleShift(width, height, request);
+            for (int y = 0; y < info.height; y++)
+            {
+                for (int x = 0; x < info.width; x++)
+                {
+                    for (int c = 0; c < info.channels; c++)
+                    {
+                        int sum = 0, count = 0;
+                        for (int sy = y * factor; sy < std::min(height, (y + 1) * factor); sy++)
+                        {
+                            for (int sx = x * factor; sx < std::min(width, (x + 1) * factor); sx++)
+                            {
+                                sum += full[((size_t)sy * width + sx) * info.channels + c];
+                                count++;
+                            }
+                        }
+                        pixels[((size_t)y * info.width + x) * info.channels + c] = (unsigned char)(sum / count);
+                    }
+                }
+            }
+        }
+
+        stbi_image_free(full);
+        return true;
+    }
+};
+
+#ifdef USE_LIBJPEG_TURBO
+
+// libjpeg reports fatal errors by calling exit(), jump back to the decoder instead
+struct JpegErrorManager
+{
+    jpeg_error_mgr base;
+    jmp_buf jump;
+};
+
+inline void jpegErrorExit(j_common_ptr cinfo)
+{
+    longjmp(((JpegErrorManager *)cinfo->err)->jump, 1);
+}
+
+class LibjpegTurboDecoder : public ImageDecoder
+{
+public:
+    const char *name() const { return "libjpeg-turbo"; }
+
+    bool canDecode(const unsigned char *data, size_t size) const
+    {
+        return size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+    }
+
+    bool getInfo(const unsigned char *data, size_t size, const ImageDecodeRequest &request, ImageInfo &info)
+    {
+        jpeg_decompress_struct cinfo;
+        JpegErrorManager error;
+        if (!begin(cinfo, error, data, size, request))
+            return false;
+
+        info.width = cinfo.output_width;
+        info.height = cinfo.output_height;
+        info.channels = cinfo.output_components;
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+    bool decode(const unsigned char *data, size_t size, const ImageDecodeRequest &request, const ImageInfo &info, unsigned char *pixels)
+    {
+        jpeg_decompress_struct cinfo;
+        JpegErrorManager error;
+        if (!begin(cinfo, error, data, size, request))
+            return false;
+        if ((int)cinfo.output_width != info.width || (int)cinfo.output_height != info.height || cinfo.output_components != info.channels)
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        if (setjmp(error.jump))
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        jpeg_start_decompress(&cinfo);
+        size_t stride = (size_t)info.width * info.channels;
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            int y = cinfo.output_scanline;
+            JSAMPROW row = pixels + stride * (request.flipVertically ? info.height - 1 - y : y);
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+private:
+    // Reads the header and configures scaling and output colour space, output_width/height
+    // and output_components are valid afterwards
+    bool begin(jpeg_decompress_struct &cinfo, JpegErrorManager &error, const unsigned char *data, size_t size, const ImageDecodeRequest &request)
+    {
+        cinfo.err = jpeg_std_error(&error.base);
+        error.base.error_exit = jpegErrorExit;
+        if (setjmp(error.jump))
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, data, (unsigned long)size);
+        jpeg_read_header(&cinfo, TRUE);
+
+        // Leave CMYK/YCCK files to stb_image, libjpeg cannot convert them to RGB
+        if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+        {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        // Scaling happens in the IDCT, so 1/2, 1/4 and 1/8 cost less than a full decode
+        int shift = imageScaleShift(cinfo.image_width, cinfo.image_height, request);
+        cinfo.scale_num = 8 >> shift;
+        cinfo.scale_denom = 8;
+
+        int channels = request.desiredChannels;
+        if (channels == 0)
+            channels = cinfo.jpeg_color_space == JCS_GRAYSCALE ? 1 : 3;
+        if (channels == 1)
+            cinfo.out_color_space = JCS_GRAYSCALE;
+        else if (channels == 4)
+            cinfo.out_color_space = JCS_EXT_RGBA;
+        else
+            cinfo.out_color_space = JCS_RGB;
+
+        jpeg_calc_output_dimensions(&cinfo);
+        return true;
+    }
+};
+
+#endif
+
+// Picks the fastest backend that understands the data
+ImageDecoder *findImageDecoder(const unsigned char *data, size_t size)
+{
+#ifdef USE_LIBJPEG_TURBO
+    static LibjpegTurboDecoder jpegDecoder;
+    if (jpegDecoder.canDecode(data, size))
+        return &jpegDecoder;
+#else
+    (void)data;
+    (void)size;
+#endif
+    static StbImageDecoder stbDecoder;
+    return &stbDecoder;
+}
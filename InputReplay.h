@@ -0,0 +1,123 @@
+//
+// Recorded input paths, replayed so a run is the same every time
+//
+// A path is one entry per frame: how far time advances, how far the cursor moves and which
+// keys are down. RenderContext.h records one from a live session with -record and plays it
+// back with -replay, answering the programs' key, cursor and time queries from the path
+// instead of the window. A benchmark without a path file replays the built-in path below.
+//
+// The file is plain text, one frame per line:
+//     <time step in seconds> <cursor dx> <cursor dy> <GLFW key codes held down...>
+// Lines starting with # are comments.
+//
+
+#pragma once
+
+#include <GLFW/glfw3.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct InputFrame
+{
+    double timeStep = 0.0;
+    double cursorDeltaX = 0.0;
+    double cursorDeltaY = 0.0;
+    std::vector<int> keys;
+};
+
+struct InputPath
+{
+    std::vector<InputFrame> frames;
+};
+
+bool loadInputPath(InputPath &path, const char *filename)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        std::cerr << "Could not open input path " << filename << std::endl;
+        return false;
+    }
+
+    path.frames.clear();
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        InputFrame frame;
+        if (!(fields >> frame.timeStep >> frame.cursorDeltaX >> frame.cursorDeltaY))
+        {
+            std::cerr << "Bad line in input path " << filename << ": " << line << std::endl;
+            return false;
+        }
+        int key;
+        while (fields >> key)
+            if (key >= GLFW_KEY_SPACE && key <= GLFW_KEY_LAST)
+                frame.keys.push_back(key);
+        path.frames.push_back(frame);
+    }
+    return true;
+}
+
+bool saveInputPath(const InputPath &path, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == nullptr)
+    {
+        std::cerr << "Could not write input path " << filename << std::endl;
+        return false;
+    }
+    fprintf(file, "# time step, cursor dx, cursor dy, GLFW key codes held down\n");
+    for (const InputFrame &frame : path.frames)
+    {
+        // Enough digits that a replay adds up to the same times as the recording
+        fprintf(file, "%.17g %.17g %.17g", frame.timeStep, frame.cursorDeltaX, frame.cursorDeltaY);
+        for (int key : frame.keys)
+            fprintf(file, " %d", key);
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    return true;
+}
+
+// Ten seconds at 60 Hz. The view sways left and right and a little up and down, ending where it
+// started, while the keys go through four phases: stand still, walk forward while turning the
+// robot arm, raise the arm, back off to the side. Only keys both programs read are used.
+void makeDefaultInputPath(InputPath &path)
+{
+    const int phaseFrames = 150;
+    const double pi = 3.14159265358979323846;
+    path.frames.clear();
+    for (int i = 0; i < 4 * phaseFrames; i++)
+    {
+        InputFrame frame;
+        frame.timeStep = 1.0 / 60.0;
+        frame.cursorDeltaX = 1.5 * sin(2.0 * pi * i / (2 * phaseFrames));
+        frame.cursorDeltaY = 0.5 * sin(2.0 * pi * i / (4 * phaseFrames));
+        switch (i / phaseFrames)
+        {
+        case 0:
+            break;
+        case 1:
+            frame.keys.push_back(GLFW_KEY_W);
+            frame.keys.push_back(GLFW_KEY_LEFT);
+            break;
+        case 2:
+            frame.keys.push_back(GLFW_KEY_UP);
+            break;
+        default:
+            frame.keys.push_back(GLFW_KEY_S);
+            frame.keys.push_back(GLFW_KEY_D);
+            break;
+        }
+        path.frames.push_back(frame);
+    }
+}
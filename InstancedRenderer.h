@@ -0,0 +1,212 @@
+//
+// Instanced drawing of many objects that share one mesh
+//
+// Instead of one glDrawElements per object, each with its own object block, a batch keeps the
+// per-instance data (world and normal matrix, tint and texture array layer) in a vertex buffer
+// read with an attribute divisor of 1, and draws every instance with a single
+// glDrawElementsInstanced. Draw with a SHADER_INSTANCED variant. The object block still
+// applies to the whole batch, its world matrix is multiplied in front of each instance's, so a
+// belt or a system can be moved as a unit without touching the instance buffer.
+//
+// The buffer is only re-uploaded when instances were added since the last draw, a batch that
+// is filled once costs nothing per frame beyond the draw call itself. A batch refilled every
+// frame streams its instances through the dynamic buffer ring instead, and settles back into
+// its own buffer the first frame it isn't refilled, since the ring's copy is soon overwritten.
+// A caller that writes the instances into the ring itself, as the command list replay does,
+// hands the batch that range with useStreamedInstances and skips the copy into instances. The
+// range is only drawn in the frame it was written in.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "DynamicBufferRing.h"
+#include "GLStateCache.h"
+#include "NormalMatrix.h"
+#include "Profiler.h"
+#include "ShaderPermutations.h"
+
+// One instance as laid out in the attribute buffer
+struct InstanceData
+{
+    glm::mat4 worldMatrix;
+    glm::vec4 normalMatrix[3]; // read as a mat3, the w components are unused
+    glm::vec4 tint;
+    float textureLayer;
+    float padding[3]; // keeps every instance 16-byte aligned
+};
+
+static_assert(sizeof(InstanceData) == 144, "InstanceData must match the attribute layout");
+
+struct InstanceBatch
+{
+    ShaderVertexLayout layout;
+    GLuint VAO = 0;
+    GLsizei indexCount = 0;
+    GLuint instanceBuffer = 0;
+    size_t capacity = 0; // instances the GL buffer currently has room for
+    std::vector<InstanceData> instances;
+    bool dirty = false;
+    bool inRing = false; // the attributes point into the dynamic buffer ring
+    int ringFrame = 0;   // ring frame the instances were streamed in
+    size_t streamedCount = 0;  // instances written to the ring by the caller, drawn instead
+    size_t streamedOffset = 0; // byte offset of the first of them in the ring
+};
+
+inline void setInstanceAttribute(GLuint location, GLint size, size_t offset)
+{
+    glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid *)offset);
+    glEnableVertexAttribArray(location);
+    glVertexAttribDivisor(location, 1);
+}
+
+// Points the instance attributes of the bound VAO at the buffer bound to GL_ARRAY_BUFFER,
+// starting base bytes in. Matrices take one location per column.
+void setInstanceAttributesAt(const ShaderVertexLayout &layout, size_t base)
+{
+    for (int column = 0; column < 4; column++)
+        setInstanceAttribute((GLuint)(layout.instanceWorldMatrix + column), 4, base + offsetof(InstanceData, worldMatrix) + column * sizeof(glm::vec4));
+    for (int column = 0; column < 3; column++)
+        setInstanceAttribute((GLuint)(layout.instanceNormalMatrix + column), 3, base + offsetof(InstanceData, normalMatrix) + column * sizeof(glm::vec4));
+    setInstanceAttribute((GLuint)layout.instanceTint, 4, base + offsetof(InstanceData, tint));
+    setInstanceAttribute((GLuint)layout.instanceLayer, 1, base + offsetof(InstanceData, textureLayer));
+}
+
+// Same, starting firstInstance entries in
+void setInstanceAttributes(const ShaderVertexLayout &layout, size_t firstInstance)
+{
+    setInstanceAttributesAt(layout, firstInstance * sizeof(InstanceData));
+}
+
+inline InstanceData makeInstanceData(const glm::mat4 &worldMatrix, int layer, const glm::vec4 &tint)
+{
+    InstanceData instance;
+    instance.worldMatrix = worldMatrix;
+    glm::mat3 normalMatrix = computeNormalMatrix(worldMatrix);
+    for (int column = 0; column < 3; column++)
+        instance.normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+    instance.tint = tint;
+    instance.textureLayer = (float)layer;
+    instance.padding[0] = instance.padding[1] = instance.padding[2] = 0.0f;
+    return instance;
+}
+
+// Adds the instance attributes to an existing mesh VAO that has its element buffer bound.
+// The VAO itself is changed, so it should only be drawn through this batch from then on.
+void createInstanceBatch(InstanceBatch &batch, const ShaderVertexLayout &layout, GLuint meshVAO, GLsizei indexCount, size_t initialCapacity)
+{
+    batch.layout = layout;
+    batch.VAO = meshVAO;
+    batch.indexCount = indexCount;
+    batch.capacity = initialCapacity > 0 ? initialCapacity : 1;
+
+    glBindVertexArray(meshVAO);
+    glGenBuffers(1, &batch.instanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, batch.instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, batch.capacity * sizeof(InstanceData), nullptr, GL_DYNAMIC_DRAW);
+    setInstanceAttributes(layout, 0);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void destroyInstanceBatch(InstanceBatch &batch)
+{
+    glDeleteBuffers(1, &batch.instanceBuffer);
+    batch.instanceBuffer = 0;
+    batch.instances.clear();
+}
+
+void clearInstances(InstanceBatch &batch)
+{
+    batch.instances.clear();
+    batch.streamedCount = 0;
+    batch.dirty = true;
+}
+
+// layer selects the slice of the bound texture array, it is ignored by untextured variants
+void addInstance(InstanceBatch &batch, const glm::mat4 &worldMatrix, int layer, const glm::vec4 &tint = glm::vec4(1.0f))
+{
+    batch.instances.push_back(makeInstanceData(worldMatrix, layer, tint));
+    batch.dirty = true;
+}
+
+// For instances prepared ahead with makeInstanceData, saves recomputing the normal matrix
+void addInstance(InstanceBatch &batch, const InstanceData &instance)
+{
+    batch.instances.push_back(instance);
+    batch.dirty = true;
+}
+
+// For count instances the caller wrote to a committed dynamic buffer allocation, offset bytes
+// into the ring. They replace the batch's instances for this frame only.
+void useStreamedInstances(InstanceBatch &batch, size_t offset, size_t count)
+{
+    batch.instances.clear();
+    batch.streamedOffset = offset;
+    batch.streamedCount = count;
+    batch.ringFrame = dynamicBufferRing.frames;
+    batch.dirty = true;
+}
+
+// Uploads the instances if they changed, then draws all of them in one call. The program, the
+// object block range and the texture array must already be bound. Drawing the batch again in
+// the same frame, for another pass, reuses the upload.
+void drawInstances(InstanceBatch &batch)
+{
+    // Streamed instances are gone once the ring has moved on from their frame
+    if (batch.streamedCount > 0 && batch.ringFrame != dynamicBufferRing.frames)
+        batch.streamedCount = 0;
+    if (batch.instances.empty() && batch.streamedCount == 0)
+        return;
+    PROFILE_SCOPE("Draw instances");
+    PROFILE_GPU_SCOPE("Instanced draw");
+
+    cachedBindVertexArray(glState, batch.VAO);
+    GLsizei count = (GLsizei)batch.instances.size();
+    size_t size = batch.instances.size() * sizeof(InstanceData);
+    DynamicAllocation allocation;
+    if (batch.streamedCount > 0)
+    {
+        if (batch.dirty)
+        {
+            cachedBindBuffer(glState, GL_ARRAY_BUFFER, dynamicBufferRing.buffer);
+            setInstanceAttributesAt(batch.layout, batch.streamedOffset);
+            batch.inRing = true;
+            batch.dirty = false;
+        }
+        count = (GLsizei)batch.streamedCount;
+    }
+    else if (batch.dirty && allocateDynamicBuffer(dynamicBufferRing, size, allocation))
+    {
+        memcpy(allocation.data, batch.instances.data(), size);
+        commitDynamicBuffer(dynamicBufferRing, allocation);
+        cachedBindBuffer(glState, GL_ARRAY_BUFFER, dynamicBufferRing.buffer);
+        setInstanceAttributesAt(batch.layout, allocation.offset);
+        batch.inRing = true;
+        batch.ringFrame = dynamicBufferRing.frames;
+        batch.dirty = false;
+    }
+    else if (batch.dirty || (batch.inRing && batch.ringFrame != dynamicBufferRing.frames))
+    {
+        cachedBindBuffer(glState, GL_ARRAY_BUFFER, batch.instanceBuffer);
+        while (batch.capacity < batch.instances.size())
+            batch.capacity *= 2;
+        // Orphan the old contents so the driver doesn't wait for last frame's draw
+        glBufferData(GL_ARRAY_BUFFER, batch.capacity * sizeof(InstanceData), nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, batch.instances.data());
+        if (batch.inRing)
+            setInstanceAttributes(batch.layout, 0);
+        batch.inRing = false;
+        batch.dirty = false;
+    }
+
+    glDrawElementsInstanced(GL_TRIANGLES, batch.indexCount, GL_UNSIGNED_INT, 0, count);
+    countGLDraw(glState, batch.indexCount, count);
+}
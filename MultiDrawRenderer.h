@@ -0,0 +1,317 @@
+//
+// Multi-draw indirect renderer for scenes made of different meshes
+//
+// Every static mesh is appended to one shared vertex buffer and one shared index buffer at
+// load time, so the whole scene is drawn from a single VAO. Each frame the draws are recorded
+// as DrawElementsIndirectCommand entries, and their per-draw data (world and normal matrix,
+// tint, texture array layer) goes into a buffer laid out like InstanceData. Each command draws
+// one instance with baseInstance set to its draw ID, so the divisor-1 attributes of the
+// SHADER_INSTANCED variant fetch that draw's entry without any uniform changes in between.
+//
+// Draws can be given a RenderQueue sort key, and are submitted in key order: grouped by mesh,
+// and front to back when the key carries a depth.
+//
+// With GL 4.3 (or ARB_multi_draw_indirect) the frame is one glMultiDrawElementsIndirect call.
+// Older contexts replay the same commands in a loop, using base instances where available and
+// otherwise re-pointing the per-draw attributes before each draw.
+//
+// The draw data and the indirect commands are streamed through the dynamic buffer ring, the
+// renderer's own buffers are only filled when the ring has no room.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "DynamicBufferRing.h"
+#include "InstancedRenderer.h"
+#include "Profiler.h"
+#include "RenderQueue.h"
+#include "ShaderPermutations.h"
+
+struct MeshVertex
+{
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texCoord;
+};
+
+// Same layout as the GL command structure
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Where a mesh lives in the shared buffers
+struct MeshRange
+{
+    GLuint firstIndex = 0;
+    GLuint indexCount = 0;
+    GLint baseVertex = 0;
+};
+
+struct MultiDrawRenderer
+{
+    ShaderVertexLayout layout;
+    GLuint VAO = 0;
+    GLuint vertexBuffer = 0;
+    GLuint indexBuffer = 0;
+    GLuint drawDataBuffer = 0;
+    GLuint indirectBuffer = 0;
+    size_t drawCapacity = 0; // draws the GL buffers currently have room for
+
+    // Where uploadMultiDraw put this frame's draw data and commands, the ring or the buffers above
+    GLuint drawDataSource = 0;
+    size_t drawDataBase = 0;
+    GLuint commandSource = 0;
+    size_t commandBase = 0;
+
+    std::vector<MeshRange> meshes;
+    std::vector<MeshVertex> vertices; // only kept until buildMultiDrawBuffers
+    std::vector<GLuint> indices;
+
+    // Draws in the order they were added, and in submission order after sorting
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<InstanceData> drawData;
+    RenderQueue queue;
+    std::vector<DrawElementsIndirectCommand> sortedCommands;
+    std::vector<InstanceData> sortedDrawData;
+
+    bool multiDrawIndirect = false;
+    bool baseInstance = false;
+};
+
+// Appends a mesh to the shared buffers, returns the id to draw it with. Indices are relative
+// to the mesh's own vertices.
+int addMesh(MultiDrawRenderer &renderer, const MeshVertex *vertices, size_t vertexCount, const GLuint *indices, size_t indexCount)
+{
+    MeshRange range;
+    range.firstIndex = (GLuint)renderer.indices.size();
+    range.indexCount = (GLuint)indexCount;
+    range.baseVertex = (GLint)renderer.vertices.size();
+    renderer.vertices.insert(renderer.vertices.end(), vertices, vertices + vertexCount);
+    renderer.indices.insert(renderer.indices.end(), indices, indices + indexCount);
+    renderer.meshes.push_back(range);
+    return (int)renderer.meshes.size() - 1;
+}
+
+// Uploads every mesh added so far and sets up the shared VAO, call once after the last
+// addMesh. Needs a GL 3.2 context for glDrawElementsBaseVertex.
+void buildMultiDrawBuffers(MultiDrawRenderer &renderer, const ShaderVertexLayout &layout, size_t initialDrawCapacity)
+{
+    renderer.layout = layout;
+    // Core in 4.2 and 4.3, where drivers need not list the extensions
+    renderer.baseInstance = GLEW_VERSION_4_2 || GLEW_ARB_base_instance;
+    renderer.multiDrawIndirect = (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && renderer.baseInstance;
+    renderer.drawCapacity = initialDrawCapacity > 0 ? initialDrawCapacity : 1;
+
+    glGenVertexArrays(1, &renderer.VAO);
+    glBindVertexArray(renderer.VAO);
+
+    glGenBuffers(1, &renderer.vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, renderer.vertices.size() * sizeof(MeshVertex), renderer.vertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer((GLuint)layout.position, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (GLvoid *)offsetof(MeshVertex, position));
+    glEnableVertexAttribArray((GLuint)layout.position);
+    glVertexAttribPointer((GLuint)layout.normal, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (GLvoid *)offsetof(MeshVertex, normal));
+    glEnableVertexAttribArray((GLuint)layout.normal);
+    glVertexAttribPointer((GLuint)layout.texCoord, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (GLvoid *)offsetof(MeshVertex, texCoord));
+    glEnableVertexAttribArray((GLuint)layout.texCoord);
+
+    glGenBuffers(1, &renderer.indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, renderer.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, renderer.indices.size() * sizeof(GLuint), renderer.indices.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &renderer.drawDataBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer.drawDataBuffer);
+    glBufferData(GL_ARRAY_BUFFER, renderer.drawCapacity * sizeof(InstanceData), nullptr, GL_DYNAMIC_DRAW);
+    setInstanceAttributes(layout, 0);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (renderer.multiDrawIndirect)
+    {
+        glGenBuffers(1, &renderer.indirectBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, renderer.indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, renderer.drawCapacity * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+
+    // The GL copies are all that's needed from here on
+    std::vector<MeshVertex>().swap(renderer.vertices);
+    std::vector<GLuint>().swap(renderer.indices);
+}
+
+void destroyMultiDrawRenderer(MultiDrawRenderer &renderer)
+{
+    glDeleteVertexArrays(1, &renderer.VAO);
+    GLuint buffers[4] = {renderer.vertexBuffer, renderer.indexBuffer, renderer.drawDataBuffer, renderer.indirectBuffer};
+    glDeleteBuffers(4, buffers);
+    renderer.VAO = renderer.vertexBuffer = renderer.indexBuffer = renderer.drawDataBuffer = renderer.indirectBuffer = 0;
+    renderer.meshes.clear();
+}
+
+void beginMultiDraw(MultiDrawRenderer &renderer)
+{
+    renderer.commands.clear();
+    renderer.drawData.clear();
+    clearRenderQueue(renderer.queue);
+}
+
+// Records a draw of a mesh with its draw data made by makeInstanceData. Draws with equal sort
+// keys are submitted in the order they were added.
+void addDraw(MultiDrawRenderer &renderer, int mesh, const InstanceData &instance, uint64_t sortKey = 0)
+{
+    const MeshRange &range = renderer.meshes[mesh];
+    DrawElementsIndirectCommand command;
+    command.count = range.indexCount;
+    command.instanceCount = 1;
+    command.firstIndex = range.firstIndex;
+    command.baseVertex = range.baseVertex;
+    command.baseInstance = 0; // the draw ID, assigned once the draws are sorted
+    pushRenderItem(renderer.queue, sortKey, (uint32_t)renderer.commands.size());
+    renderer.commands.push_back(command);
+    renderer.drawData.push_back(instance);
+}
+
+// Same, layer selects the slice of the bound texture array
+void addDraw(MultiDrawRenderer &renderer, int mesh, const glm::mat4 &worldMatrix, int layer, const glm::vec4 &tint = glm::vec4(1.0f), uint64_t sortKey = 0)
+{
+    addDraw(renderer, mesh, makeInstanceData(worldMatrix, layer, tint), sortKey);
+}
+
+// Puts the draws in key order, each one's draw ID becomes its position in that order
+void sortMultiDraw(MultiDrawRenderer &renderer)
+{
+    PROFILE_SCOPE("Sort draws");
+    sortRenderQueue(renderer.queue);
+    size_t drawCount = renderer.queue.items.size();
+    renderer.sortedCommands.resize(drawCount);
+    renderer.sortedDrawData.resize(drawCount);
+    for (size_t i = 0; i < drawCount; i++)
+    {
+        uint32_t draw = renderer.queue.items[i].index;
+        renderer.sortedCommands[i] = renderer.commands[draw];
+        renderer.sortedCommands[i].baseInstance = (GLuint)i;
+        renderer.sortedDrawData[i] = renderer.drawData[draw];
+    }
+}
+
+// Sorts and uploads this frame's draws, after which drawMultiDraw can submit them as many
+// times as the frame has passes
+void uploadMultiDraw(MultiDrawRenderer &renderer)
+{
+    if (renderer.commands.empty())
+        return;
+    PROFILE_SCOPE("Upload draws");
+
+    sortMultiDraw(renderer);
+    const std::vector<DrawElementsIndirectCommand> &commands = renderer.sortedCommands;
+    size_t drawCount = commands.size();
+    while (renderer.drawCapacity < drawCount)
+        renderer.drawCapacity *= 2;
+
+    // The draw data streams through the ring when it fits. Otherwise last frame's contents of
+    // drawDataBuffer are orphaned so the driver doesn't wait for its draws.
+    cachedBindVertexArray(glState, renderer.VAO);
+    size_t drawDataSize = drawCount * sizeof(InstanceData);
+    DynamicAllocation allocation;
+    if (allocateDynamicBuffer(dynamicBufferRing, drawDataSize, allocation))
+    {
+        memcpy(allocation.data, renderer.sortedDrawData.data(), drawDataSize);
+        commitDynamicBuffer(dynamicBufferRing, allocation);
+        renderer.drawDataSource = dynamicBufferRing.buffer;
+        renderer.drawDataBase = allocation.offset;
+        cachedBindBuffer(glState, GL_ARRAY_BUFFER, renderer.drawDataSource);
+    }
+    else
+    {
+        renderer.drawDataSource = renderer.drawDataBuffer;
+        renderer.drawDataBase = 0;
+        cachedBindBuffer(glState, GL_ARRAY_BUFFER, renderer.drawDataSource);
+        glBufferData(GL_ARRAY_BUFFER, renderer.drawCapacity * sizeof(InstanceData), nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, drawDataSize, renderer.sortedDrawData.data());
+    }
+    setInstanceAttributesAt(renderer.layout, renderer.drawDataBase);
+
+    if (!renderer.multiDrawIndirect)
+        return;
+    size_t commandSize = drawCount * sizeof(DrawElementsIndirectCommand);
+    if (allocateDynamicBuffer(dynamicBufferRing, commandSize, allocation))
+    {
+        memcpy(allocation.data, commands.data(), commandSize);
+        commitDynamicBuffer(dynamicBufferRing, allocation);
+        renderer.commandSource = dynamicBufferRing.buffer;
+        renderer.commandBase = allocation.offset;
+    }
+    else
+    {
+        renderer.commandSource = renderer.indirectBuffer;
+        renderer.commandBase = 0;
+        cachedBindBuffer(glState, GL_DRAW_INDIRECT_BUFFER, renderer.commandSource);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, renderer.drawCapacity * sizeof(DrawElementsIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commandSize, commands.data());
+    }
+}
+
+// Submits the draws uploadMultiDraw uploaded. The SHADER_INSTANCED program, the object block
+// range and the texture array must already be bound.
+void drawMultiDraw(MultiDrawRenderer &renderer)
+{
+    if (renderer.commands.empty())
+        return;
+    PROFILE_SCOPE("Submit draws");
+    PROFILE_GPU_SCOPE("Multi-draw");
+
+    const std::vector<DrawElementsIndirectCommand> &commands = renderer.sortedCommands;
+    cachedBindVertexArray(glState, renderer.VAO);
+    if (renderer.multiDrawIndirect)
+    {
+        cachedBindBuffer(glState, GL_DRAW_INDIRECT_BUFFER, renderer.commandSource);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void *)renderer.commandBase, (GLsizei)commands.size(), 0);
+        // One call, with every command's triangles
+        countGLDraw(glState, 0, 0);
+        for (const DrawElementsIndirectCommand &command : commands)
+            glState.triangles += command.count / 3;
+    }
+    else if (renderer.baseInstance)
+    {
+        for (const DrawElementsIndirectCommand &command : commands)
+        {
+            glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+                                                          (GLvoid *)(command.firstIndex * sizeof(GLuint)), 1,
+                                                          command.baseVertex, command.baseInstance);
+            countGLDraw(glState, command.count);
+        }
+    }
+    else
+    {
+        // Without base instances every draw reads entry 0, so move entry 0 to the draw's data
+        cachedBindBuffer(glState, GL_ARRAY_BUFFER, renderer.drawDataSource);
+        for (const DrawElementsIndirectCommand &command : commands)
+        {
+            setInstanceAttributesAt(renderer.layout, renderer.drawDataBase + command.baseInstance * sizeof(InstanceData));
+            glDrawElementsBaseVertex(GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+                                     (GLvoid *)(command.firstIndex * sizeof(GLuint)), command.baseVertex);
+            countGLDraw(glState, command.count);
+        }
+        setInstanceAttributesAt(renderer.layout, renderer.drawDataBase);
+    }
+}
+
+// Uploads this frame's draws and submits all of them, for frames with a single pass
+void submitMultiDraw(MultiDrawRenderer &renderer)
+{
+    uploadMultiDraw(renderer);
+    drawMultiDraw(renderer);
+}
@@ -0,0 +1,109 @@
+//
+// Normal matrices computed on the CPU, once per object instead of once per vertex
+//
+// The normal matrix is transpose(inverse(mat3(model))). For the upper 3x3 with columns
+// c0, c1, c2 that is the cofactor matrix divided by the determinant:
+//     columns (c1 x c2, c2 x c0, c0 x c1) / dot(c0, c1 x c2)
+// so no general inverse is needed. Batches are computed four objects at a time with SSE,
+// and objects known to have a uniform scale skip even that: their normal matrix is the
+// rotation part divided by the squared scale.
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define NORMAL_MATRIX_SSE 1
+#endif
+
+// Any model matrix, including non-uniform scale and mirroring
+inline glm::mat3 computeNormalMatrix(const glm::mat4 &model)
+{
+    glm::vec3 c0(model[0]), c1(model[1]), c2(model[2]);
+    glm::vec3 r0 = glm::cross(c1, c2);
+    float invDet = 1.0f / glm::dot(c0, r0);
+    return glm::mat3(r0 * invDet, glm::cross(c2, c0) * invDet, glm::cross(c0, c1) * invDet);
+}
+
+// Fast path for rotation * uniform scale (plus translation), no cross products or determinant
+inline glm::mat3 computeUniformScaleNormalMatrix(const glm::mat4 &model)
+{
+    glm::vec3 c0(model[0]);
+    float invScaleSquared = 1.0f / glm::dot(c0, c0);
+    return glm::mat3(c0 * invScaleSquared, glm::vec3(model[1]) * invScaleSquared, glm::vec3(model[2]) * invScaleSquared);
+}
+
+// Computes normals[i] for models[i], four at a time when SSE is available.
+// uniformScale may be null, otherwise objects flagged true take the fast path.
+void computeNormalMatrices(const glm::mat4 *models, const bool *uniformScale, glm::mat3 *normals, size_t count)
+{
+    size_t i = 0;
+#ifdef NORMAL_MATRIX_SSE
+    // Gather the general objects into groups of four, structure-of-arrays style
+    size_t batch[4];
+    int batchSize = 0;
+    for (; i <= count; i++)
+    {
+        if (i < count)
+        {
+            if (uniformScale != nullptr && uniformScale[i])
+            {
+                normals[i] = computeUniformScaleNormalMatrix(models[i]);
+                continue;
+            }
+            batch[batchSize++] = i;
+            if (batchSize < 4)
+                continue;
+        }
+        if (batchSize == 0)
+            break;
+
+        // Pad partial batches by repeating the last object
+        for (int lane = batchSize; lane < 4; lane++)
+            batch[lane] = batch[batchSize - 1];
+
+        // m[col][row] holds that element for all four objects
+        __m128 m[3][3];
+        for (int col = 0; col < 3; col++)
+            for (int row = 0; row < 3; row++)
+                m[col][row] = _mm_setr_ps(models[batch[0]][col][row], models[batch[1]][col][row],
+                                          models[batch[2]][col][row], models[batch[3]][col][row]);
+
+        // Cofactor columns: c1 x c2, c2 x c0, c0 x c1
+        __m128 cof[3][3];
+        for (int col = 0; col < 3; col++)
+        {
+            const __m128 *a = m[(col + 1) % 3];
+            const __m128 *b = m[(col + 2) % 3];
+            cof[col][0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+            cof[col][1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+            cof[col][2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+        }
+
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], cof[0][0]), _mm_mul_ps(m[0][1], cof[0][1])), _mm_mul_ps(m[0][2], cof[0][2]));
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        float out[3][3][4];
+        for (int col = 0; col < 3; col++)
+            for (int row = 0; row < 3; row++)
+                _mm_storeu_ps(out[col][row], _mm_mul_ps(cof[col][row], invDet));
+
+        for (int lane = 0; lane < batchSize; lane++)
+            for (int col = 0; col < 3; col++)
+                normals[batch[lane]][col] = glm::vec3(out[col][0][lane], out[col][1][lane], out[col][2][lane]);
+        batchSize = 0;
+    }
+#else
+    for (; i < count; i++)
+    {
+        if (uniformScale != nullptr && uniformScale[i])
+            normals[i] = computeUniformScaleNormalMatrix(models[i]);
+        else
+            normals[i] = computeNormalMatrix(models[i]);
+    }
+#endif
+}
@@ -5,8 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+//Parses an already opened stream, which can also be an in-memory asset
 bool loadOBJ(
-	const char * path,
+	FILE * file,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<glm::vec3> & out_normals,
 	std::vector<glm::vec2> & out_uvs) {
@@ -16,14 +17,6 @@ bool loadOBJ(
 	std::vector<glm::vec2> temp_uvs;
 	std::vector<glm::vec3> temp_normals;
 
-	FILE * file;
-	file = fopen(path, "r");
-	if (!file) {
-		printf("Impossible to open the file ! Are you in the right path ?\n");
-		printf(path);
-		return false;
-	}
-
 	while (1) {
 
 		char lineHeader[128];
@@ -130,3 +123,21 @@ bool loadOBJ(
 	return true;
 }
 
+bool loadOBJ(
+	const char * path,
+	std::vector<glm::vec3> & out_vertices,
+	std::vector<glm::vec3> & out_normals,
+	std::vector<glm::vec2> & out_uvs) {
+
+	FILE * file;
+	file = fopen(path, "r");
+	if (!file) {
+		printf("Impossible to open the file ! Are you in the right path ?\n");
+		printf(path);
+		return false;
+	}
+
+	bool loaded = loadOBJ(file, out_vertices, out_normals, out_uvs);
+	fclose(file);
+	return loaded;
+}
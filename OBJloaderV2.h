@@ -5,8 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+//Parses an already opened stream, which can also be an in-memory asset
 bool loadOBJ2(
-	const char * path,
+	FILE * file,
 	std::vector<int> & vertexIndices,
 	std::vector<glm::vec3> & temp_vertices,
 	std::vector<glm::vec3> & out_normals,
@@ -16,14 +17,6 @@ bool loadOBJ2(
 	std::vector<glm::vec2> temp_uvs;
 	std::vector<glm::vec3> temp_normals;
 
-	FILE * file;
-	file = fopen(path, "r");
-	if (!file){
-		printf("Impossible to open the file ! Are you in the right path ?\n");
-		getchar();
-		return false;
-	}
-
 	while (1){
 
 		char lineHeader[128];
@@ -129,3 +122,23 @@ bool loadOBJ2(
 
 	return true;
 }
+
+bool loadOBJ2(
+	const char * path,
+	std::vector<int> & vertexIndices,
+	std::vector<glm::vec3> & temp_vertices,
+	std::vector<glm::vec3> & out_normals,
+	std::vector<glm::vec2> & out_uvs){
+
+	FILE * file;
+	file = fopen(path, "r");
+	if (!file){
+		printf("Impossible to open the file ! Are you in the right path ?\n");
+		getchar();
+		return false;
+	}
+
+	bool loaded = loadOBJ2(file, vertexIndices, temp_vertices, out_normals, out_uvs);
+	fclose(file);
+	return loaded;
+}
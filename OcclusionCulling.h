@@ -0,0 +1,414 @@
+//
+// Occlusion culling against a low-resolution depth buffer rasterized on the CPU
+//
+// Each frame the large occluders (planets, robot parts) are transformed by projection * view,
+// clipped against the near plane and rasterized into a 256x128 buffer holding the nearest
+// occluder depth per pixel, four pixels at a time with SSE. The buffer is then summarized as
+// 8x8 tiles with the nearest and farthest depth in each. An object's bounding box is projected
+// to a screen rectangle and its nearest depth, and it is hidden only if every pixel under the
+// rectangle has an occluder in front of that depth. Most tiles are decided from the summary
+// alone: farther than the tile's farthest depth is hidden there, nearer than its nearest depth
+// means the object is visible.
+//
+// Depth is window depth in [0, 1] as GL writes it, 1 where no occluder was drawn. Occluder
+// triangles are only written where they cover a pixel center, so at this resolution an object
+// peeking past an occluder's silhouette by less than a pixel can be culled. Everything else
+// errs on the side of drawing: boxes crossing the near plane are always visible.
+//
+// Rasterization splits the buffer into horizontal bands, one per thread, which share the
+// triangle list and never write to the same pixels. Tests split the boxes the same way. Both
+// run on the worker pool, and only use as many threads as there are triangles or boxes to keep
+// them busy, a handful of cubes is rasterized on the calling thread. No GPU readback is
+// involved, the result is the same with or without a display.
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "Profiler.h"
+#include "WorkerPool.h"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define OCCLUSION_CULLING_SSE 1
+#endif
+
+const int OCCLUSION_WIDTH = 256;
+const int OCCLUSION_HEIGHT = 128;
+const int OCCLUSION_TILE_SIZE = 8;
+const int OCCLUSION_TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE;
+const int OCCLUSION_TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE;
+const int OCCLUSION_MAX_THREADS = OCCLUSION_TILES_Y; // one row of tiles per band at most
+const size_t OCCLUSION_BOXES_PER_THREAD = 512;       // fewer than this aren't worth a thread
+const size_t OCCLUSION_TRIANGLES_PER_THREAD = 256;   // nor are fewer triangles than this
+
+// Triangles of an occluder in its model space
+struct OccluderMesh
+{
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> indices;
+};
+
+struct OcclusionBox
+{
+    glm::vec3 lower, upper; // world space
+};
+
+// A triangle in buffer pixels, with its depth as a plane z = a + b * x + c * y
+struct OccluderTriangle
+{
+    float x[3], y[3];
+    float minX, maxX, minY, maxY;
+    float depthA, depthB, depthC;
+};
+
+struct OcclusionBuffer
+{
+    std::vector<float> depth; // OCCLUSION_WIDTH * OCCLUSION_HEIGHT, row 0 at the bottom
+    std::vector<float> tileNearest, tileFarthest;
+    glm::mat4 viewProjection;
+    int threadCount = 1;
+
+    std::vector<OccluderTriangle> triangles;
+    std::vector<glm::vec4> clipPositions; // scratch for addOccluder
+
+    // Totals since the first frame, for printOcclusionStats, added to from the workers
+    std::atomic<uint64_t> tested{0};
+    std::atomic<uint64_t> hidden{0};
+    int frames = 0;
+};
+
+// threadCount 0 uses every thread of the worker pool, up to one band per row of tiles
+void initOcclusionBuffer(OcclusionBuffer &buffer, int threadCount = 0)
+{
+    if (threadCount <= 0)
+        threadCount = workerPoolThreads(workerPool);
+    buffer.threadCount = std::min(std::max(threadCount, 1), OCCLUSION_MAX_THREADS);
+    buffer.depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.0f);
+    buffer.tileNearest.assign(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 1.0f);
+    buffer.tileFarthest.assign(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 1.0f);
+}
+
+// Starts a frame seen through viewProjection, with no occluders
+void beginOcclusionFrame(OcclusionBuffer &buffer, const glm::mat4 &viewProjection)
+{
+    buffer.viewProjection = viewProjection;
+    buffer.triangles.clear();
+    buffer.frames++;
+}
+
+// A triangle in clip space, which has to be in front of the near plane
+void addOccluderTriangle(OcclusionBuffer &buffer, const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c)
+{
+    OccluderTriangle triangle;
+    float z[3];
+    const glm::vec4 *clip[3] = {&a, &b, &c};
+    for (int i = 0; i < 3; i++)
+    {
+        float inverseW = 1.0f / clip[i]->w;
+        triangle.x[i] = (clip[i]->x * inverseW * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        triangle.y[i] = (clip[i]->y * inverseW * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        z[i] = clip[i]->z * inverseW * 0.5f + 0.5f;
+    }
+
+    // Counter-clockwise order, so the edge functions are positive inside. Back faces are kept,
+    // occluder meshes don't have to be closed or consistently wound.
+    float area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0]) -
+                 (triangle.x[2] - triangle.x[0]) * (triangle.y[1] - triangle.y[0]);
+    if (area == 0.0f)
+        return;
+    if (area < 0.0f)
+    {
+        std::swap(triangle.x[1], triangle.x[2]);
+        std::swap(triangle.y[1], triangle.y[2]);
+        std::swap(z[1], z[2]);
+        area = -area;
+    }
+
+    triangle.minX = std::max(std::min(std::min(triangle.x[0], triangle.x[1]), triangle.x[2]), 0.0f);
+    triangle.maxX = std::min(std::max(std::max(triangle.x[0], triangle.x[1]), triangle.x[2]), (float)OCCLUSION_WIDTH);
+    triangle.minY = std::max(std::min(std::min(triangle.y[0], triangle.y[1]), triangle.y[2]), 0.0f);
+    triangle.maxY = std::min(std::max(std::max(triangle.y[0], triangle.y[1]), triangle.y[2]), (float)OCCLUSION_HEIGHT);
+    if (triangle.minX >= triangle.maxX || triangle.minY >= triangle.maxY)
+        return; // off screen
+
+    // Window depth is linear in screen space, solve for its plane
+    float dx1 = triangle.x[1] - triangle.x[0], dy1 = triangle.y[1] - triangle.y[0], dz1 = z[1] - z[0];
+    float dx2 = triangle.x[2] - triangle.x[0], dy2 = triangle.y[2] - triangle.y[0], dz2 = z[2] - z[0];
+    triangle.depthB = (dz1 * dy2 - dz2 * dy1) / area;
+    triangle.depthC = (dz2 * dx1 - dz1 * dx2) / area;
+    triangle.depthA = z[0] - triangle.depthB * triangle.x[0] - triangle.depthC * triangle.y[0];
+    buffer.triangles.push_back(triangle);
+}
+
+// Queues an occluder's triangles, placed by world. Parts behind the near plane are clipped
+// away. The occluder must lie inside the object it stands for, or it can hide what's behind.
+void addOccluder(OcclusionBuffer &buffer, const OccluderMesh &mesh, const glm::mat4 &world)
+{
+    glm::mat4 modelViewProjection = buffer.viewProjection * world;
+    buffer.clipPositions.resize(mesh.positions.size());
+    for (size_t i = 0; i < mesh.positions.size(); i++)
+        buffer.clipPositions[i] = modelViewProjection * glm::vec4(mesh.positions[i], 1.0f);
+
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+    {
+        const glm::vec4 *corners[3] = {&buffer.clipPositions[mesh.indices[i]], &buffer.clipPositions[mesh.indices[i + 1]],
+                                       &buffer.clipPositions[mesh.indices[i + 2]]};
+
+        // GL's near plane is z = -w, clip the triangle to the side where z + w >= 0
+        glm::vec4 polygon[4];
+        int count = 0;
+        for (int edge = 0; edge < 3; edge++)
+        {
+            const glm::vec4 &from = *corners[edge];
+            const glm::vec4 &to = *corners[(edge + 1) % 3];
+            float fromDistance = from.z + from.w;
+            float toDistance = to.z + to.w;
+            if (fromDistance >= 0.0f)
+                polygon[count++] = from;
+            if ((fromDistance >= 0.0f) != (toDistance >= 0.0f))
+                polygon[count++] = from + (to - from) * (fromDistance / (fromDistance - toDistance));
+        }
+        for (int corner = 2; corner < count; corner++)
+            addOccluderTriangle(buffer, polygon[0], polygon[corner - 1], polygon[corner]);
+    }
+}
+
+// Writes the triangles' depth into rows [firstRow, endRow)
+void rasterizeOcclusionBand(OcclusionBuffer &buffer, int firstRow, int endRow)
+{
+    PROFILE_SCOPE("Occluder band");
+    std::fill(buffer.depth.begin() + firstRow * OCCLUSION_WIDTH, buffer.depth.begin() + endRow * OCCLUSION_WIDTH, 1.0f);
+
+    for (const OccluderTriangle &triangle : buffer.triangles)
+    {
+        // Pixel centers inside the triangle's bounds and this band
+        int minY = std::max(firstRow, (int)(triangle.minY + 0.5f));
+        int maxY = std::min(endRow - 1, (int)(triangle.maxY - 0.5f));
+        int minX = (int)(triangle.minX + 0.5f) & ~3; // whole groups of four
+        int maxX = std::min(OCCLUSION_WIDTH - 1, (int)(triangle.maxX - 0.5f));
+        if (minY > maxY || minX > maxX)
+            continue;
+
+        // Edge i runs from corner i to corner i + 1, value = stepX * x + stepY * y + offset
+        float edgeStepX[3], edgeStepY[3], edgeOffset[3];
+        for (int i = 0; i < 3; i++)
+        {
+            int next = (i + 1) % 3;
+            edgeStepX[i] = triangle.y[i] - triangle.y[next];
+            edgeStepY[i] = triangle.x[next] - triangle.x[i];
+            edgeOffset[i] = -(edgeStepX[i] * triangle.x[i] + edgeStepY[i] * triangle.y[i]);
+        }
+
+        for (int y = minY; y <= maxY; y++)
+        {
+            float centerY = y + 0.5f;
+            float *row = &buffer.depth[y * OCCLUSION_WIDTH];
+#if defined(OCCLUSION_CULLING_SSE)
+            __m128 centerX = _mm_add_ps(_mm_set1_ps((float)minX), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+            __m128 zero = _mm_setzero_ps();
+            __m128 edges[3], edgeSteps[3];
+            for (int i = 0; i < 3; i++)
+            {
+                edges[i] = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(edgeStepX[i])), _mm_set1_ps(edgeStepY[i] * centerY + edgeOffset[i]));
+                edgeSteps[i] = _mm_set1_ps(edgeStepX[i] * 4.0f);
+            }
+            __m128 depth = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(triangle.depthB)),
+                                      _mm_set1_ps(triangle.depthA + triangle.depthC * centerY));
+            __m128 depthStep = _mm_set1_ps(triangle.depthB * 4.0f);
+            for (int x = minX; x <= maxX; x += 4)
+            {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edges[0], zero), _mm_cmpge_ps(edges[1], zero)),
+                                           _mm_cmpge_ps(edges[2], zero));
+                if (_mm_movemask_ps(inside) != 0)
+                {
+                    __m128 current = _mm_loadu_ps(row + x);
+                    __m128 nearest = _mm_min_ps(current, depth);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+                }
+                for (int i = 0; i < 3; i++)
+                    edges[i] = _mm_add_ps(edges[i], edgeSteps[i]);
+                depth = _mm_add_ps(depth, depthStep);
+            }
+#else
+            for (int x = minX; x <= maxX; x++)
+            {
+                float centerX = x + 0.5f;
+                bool inside = true;
+                for (int i = 0; i < 3; i++)
+                    inside = inside && edgeStepX[i] * centerX + edgeStepY[i] * centerY + edgeOffset[i] >= 0.0f;
+                if (inside)
+                    row[x] = std::min(row[x], triangle.depthA + triangle.depthB * centerX + triangle.depthC * centerY);
+            }
+#endif
+        }
+    }
+
+    // Nearest and farthest depth of each tile in the band
+    for (int tileY = firstRow / OCCLUSION_TILE_SIZE; tileY < endRow / OCCLUSION_TILE_SIZE; tileY++)
+        for (int tileX = 0; tileX < OCCLUSION_TILES_X; tileX++)
+        {
+            float nearest = 1.0f, farthest = 0.0f;
+            for (int y = tileY * OCCLUSION_TILE_SIZE; y < (tileY + 1) * OCCLUSION_TILE_SIZE; y++)
+                for (int x = tileX * OCCLUSION_TILE_SIZE; x < (tileX + 1) * OCCLUSION_TILE_SIZE; x++)
+                {
+                    float value = buffer.depth[y * OCCLUSION_WIDTH + x];
+                    nearest = std::min(nearest, value);
+                    farthest = std::max(farthest, value);
+                }
+            buffer.tileNearest[tileY * OCCLUSION_TILES_X + tileX] = nearest;
+            buffer.tileFarthest[tileY * OCCLUSION_TILES_X + tileX] = farthest;
+        }
+}
+
+// Rasterizes every occluder added this frame, call before testing any boxes
+void rasterizeOccluders(OcclusionBuffer &buffer)
+{
+    PROFILE_SCOPE("Rasterize occluders");
+    size_t useful = buffer.triangles.size() / OCCLUSION_TRIANGLES_PER_THREAD + 1;
+    int bandCount = (int)std::min((size_t)buffer.threadCount, useful);
+    runParallelJobs(workerPool, bandCount, [&buffer](int band, int bands) {
+        int firstTileRow = OCCLUSION_TILES_Y * band / bands;
+        int endTileRow = OCCLUSION_TILES_Y * (band + 1) / bands;
+        rasterizeOcclusionBand(buffer, firstTileRow * OCCLUSION_TILE_SIZE, endTileRow * OCCLUSION_TILE_SIZE);
+    });
+}
+
+// World-space bounds of the model-space box (lower, upper) placed by world
+inline OcclusionBox makeOcclusionBox(const glm::mat4 &world, const glm::vec3 &lower, const glm::vec3 &upper)
+{
+    glm::vec3 center(world * glm::vec4((lower + upper) * 0.5f, 1.0f));
+    glm::vec3 halfSize = (upper - lower) * 0.5f;
+    glm::vec3 extent = glm::abs(glm::vec3(world[0])) * halfSize.x + glm::abs(glm::vec3(world[1])) * halfSize.y +
+                       glm::abs(glm::vec3(world[2])) * halfSize.z;
+    OcclusionBox box;
+    box.lower = center - extent;
+    box.upper = center + extent;
+    return box;
+}
+
+// True if every pixel the box could cover has an occluder in front of it
+bool isBoxOccluded(const OcclusionBuffer &buffer, const OcclusionBox &box)
+{
+    float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f, nearest = 1.0f;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        glm::vec3 position((corner & 1) ? box.upper.x : box.lower.x, (corner & 2) ? box.upper.y : box.lower.y,
+                           (corner & 4) ? box.upper.z : box.lower.z);
+        glm::vec4 clip = buffer.viewProjection * glm::vec4(position, 1.0f);
+        if (clip.z < -clip.w)
+            return false; // reaches past the near plane
+        float inverseW = 1.0f / clip.w;
+        float x = (clip.x * inverseW * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        float y = (clip.y * inverseW * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        nearest = std::min(nearest, clip.z * inverseW * 0.5f + 0.5f);
+    }
+
+    // Every pixel whose area the rectangle touches, not only the covered centers
+    int firstX = std::max(0, (int)std::floor(minX));
+    int lastX = std::min(OCCLUSION_WIDTH - 1, (int)std::floor(maxX));
+    int firstY = std::max(0, (int)std::floor(minY));
+    int lastY = std::min(OCCLUSION_HEIGHT - 1, (int)std::floor(maxY));
+    if (firstX > lastX || firstY > lastY)
+        return false; // off screen, that's for frustum culling to decide
+
+    for (int tileY = firstY / OCCLUSION_TILE_SIZE; tileY <= lastY / OCCLUSION_TILE_SIZE; tileY++)
+        for (int tileX = firstX / OCCLUSION_TILE_SIZE; tileX <= lastX / OCCLUSION_TILE_SIZE; tileX++)
+        {
+            int tile = tileY * OCCLUSION_TILES_X + tileX;
+            if (nearest > buffer.tileFarthest[tile])
+                continue; // behind everything in this tile
+            if (nearest <= buffer.tileNearest[tile])
+                return false; // in front of everything in this tile
+
+            int endX = std::min(lastX, (tileX + 1) * OCCLUSION_TILE_SIZE - 1);
+            int endY = std::min(lastY, (tileY + 1) * OCCLUSION_TILE_SIZE - 1);
+            for (int y = std::max(firstY, tileY * OCCLUSION_TILE_SIZE); y <= endY; y++)
+                for (int x = std::max(firstX, tileX * OCCLUSION_TILE_SIZE); x <= endX; x++)
+                    if (nearest <= buffer.depth[y * OCCLUSION_WIDTH + x])
+                        return false;
+        }
+    return true;
+}
+
+// For boxes tested with isBoxOccluded directly, from any thread. Once per range of boxes, the
+// totals are shared.
+inline void countOcclusionTests(OcclusionBuffer &buffer, size_t tested, size_t hidden)
+{
+    buffer.tested += tested;
+    buffer.hidden += hidden;
+}
+
+// Sets visible[i] to 0 for every box that is hidden and 1 otherwise. Returns how many were
+// hidden.
+size_t testOcclusion(OcclusionBuffer &buffer, const std::vector<OcclusionBox> &boxes, std::vector<uint8_t> &visible)
+{
+    PROFILE_SCOPE("Test occlusion");
+    visible.resize(boxes.size());
+    size_t useful = boxes.size() / OCCLUSION_BOXES_PER_THREAD + 1;
+    int jobs = (int)std::min((size_t)buffer.threadCount, useful);
+    std::vector<size_t> hiddenPerJob(jobs, 0);
+    runParallelJobs(workerPool, jobs, [&](int job, int jobCount) {
+        size_t begin = boxes.size() * job / jobCount;
+        size_t end = boxes.size() * (job + 1) / jobCount;
+        for (size_t i = begin; i < end; i++)
+        {
+            bool occluded = isBoxOccluded(buffer, boxes[i]);
+            visible[i] = occluded ? 0 : 1;
+            hiddenPerJob[job] += occluded ? 1 : 0;
+        }
+    });
+
+    size_t hidden = 0;
+    for (size_t count : hiddenPerJob)
+        hidden += count;
+    countOcclusionTests(buffer, boxes.size(), hidden);
+    return hidden;
+}
+
+// Triangles of a sphere of the given radius around the origin. The faces lie just inside it,
+// so it can stand in for any finer sphere mesh of that radius.
+void makeOccluderSphere(OccluderMesh &mesh, float radius, int rings, int segments)
+{
+    mesh.positions.clear();
+    mesh.indices.clear();
+    const float pi = 3.14159265f;
+    float scaled = radius * 0.99f; // the model's own faces sit slightly inside its radius too
+    for (int ring = 0; ring <= rings; ring++)
+    {
+        float polar = pi * ring / rings;
+        for (int segment = 0; segment <= segments; segment++)
+        {
+            float azimuth = 2.0f * pi * segment / segments;
+            mesh.positions.push_back(scaled * glm::vec3(sinf(polar) * cosf(azimuth), cosf(polar), sinf(polar) * sinf(azimuth)));
+        }
+    }
+    for (int ring = 0; ring < rings; ring++)
+        for (int segment = 0; segment < segments; segment++)
+        {
+            uint32_t first = ring * (segments + 1) + segment;
+            uint32_t below = first + segments + 1;
+            uint32_t quad[6] = {first, below, first + 1, first + 1, below, below + 1};
+            mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+        }
+}
+
+// Average boxes tested and hidden per frame
+void printOcclusionStats(const OcclusionBuffer &buffer)
+{
+    if (buffer.frames == 0)
+        return;
+    std::cout << "Occlusion culling: " << (double)buffer.hidden / buffer.frames << " of "
+              << (double)buffer.tested / buffer.frames << " objects hidden per frame" << std::endl;
+}
@@ -0,0 +1,371 @@
+//
+// Scoped CPU and GPU profiler with Chrome trace output
+//
+// PROFILE_SCOPE("name") times the rest of the enclosing block on the CPU. Each thread writes its
+// scopes into a ring buffer of its own, so recording takes no lock: the owning thread fills a
+// slot and then publishes it by advancing the ring's write index. Whoever writes the trace reads
+// the published slots and drops any the owner overwrote meanwhile. Threads that exit hand their
+// ring to the next new thread, so threads that come and go reuse a few rings.
+//
+// PROFILE_GPU_SCOPE("name") times the GL commands issued in the block. Its start and end are
+// GL_TIMESTAMP queries from a pool, which unlike GL_TIME_ELAPSED can nest and be placed on the
+// CPU timeline. They are read a few frames later, once the GPU has caught up.
+//
+// Run with -profile FILE to record. The trace is written to FILE on exit and whenever F12 is
+// pressed, open it in chrome://tracing or ui.perfetto.dev. The markers are compiled in unless
+// NDEBUG is defined, release builds need -DUSE_PROFILER. Compiled out they generate no code
+// and -profile only prints how to rebuild.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <iostream>
+
+#if defined(USE_PROFILER) || !defined(NDEBUG)
+#define PROFILER_ENABLED 1
+#endif
+
+#define PROFILER_CONCAT_(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_(a, b)
+
+#ifdef PROFILER_ENABLED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scopes kept per thread, the oldest are overwritten first
+const uint32_t PROFILER_RING_SIZE = 1 << 16;
+
+// Atomic so a slot being overwritten while the trace is written is a detectable race, not
+// undefined behaviour. Relaxed loads and stores compile to plain moves.
+struct ProfilerEvent
+{
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> start;    // nanoseconds since the profiler started
+    std::atomic<uint64_t> duration;
+};
+
+struct ProfilerRing
+{
+    ProfilerEvent events[PROFILER_RING_SIZE];
+    std::atomic<uint64_t> written{0}; // events ever published
+    int threadId = 0;
+    std::string threadName;
+    bool inUse = false; // owned by a live thread, guarded by Profiler::ringsMutex
+};
+
+struct GPUProfilerSpan
+{
+    const char *name;
+    GLuint startQuery;
+    GLuint endQuery;
+};
+
+struct Profiler
+{
+    bool recording = false;
+    const char *tracePath = nullptr;
+    std::chrono::steady_clock::time_point epoch;
+
+    // Every ring any thread has had, never freed while the program runs
+    std::mutex ringsMutex;
+    std::vector<ProfilerRing *> rings;
+    int nextThreadId = 1;
+
+    // GPU spans, written and read on the GL thread only
+    bool gpuTimers = false;
+    int64_t gpuClockOffset = 0; // add to a GL timestamp for profiler time
+    std::vector<GLuint> freeQueries;
+    std::vector<GPUProfilerSpan> pendingSpans;
+    ProfilerRing *gpuRing = nullptr;
+
+    bool dumpKeyWasDown = false;
+};
+
+Profiler profiler;
+
+inline uint64_t profilerNow()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profiler.epoch).count();
+}
+
+// A ring nobody owns, or a new one
+ProfilerRing *claimProfilerRing(const char *name)
+{
+    std::lock_guard<std::mutex> lock(profiler.ringsMutex);
+    for (ProfilerRing *ring : profiler.rings)
+        if (!ring->inUse)
+        {
+            ring->inUse = true;
+            return ring;
+        }
+    ProfilerRing *ring = new ProfilerRing();
+    ring->threadId = profiler.nextThreadId++;
+    ring->threadName = name != nullptr ? name : "Thread " + std::to_string(ring->threadId);
+    ring->inUse = true;
+    profiler.rings.push_back(ring);
+    return ring;
+}
+
+// The calling thread's ring, claimed on its first scope and given back when it exits
+struct ProfilerThreadRing
+{
+    ProfilerRing *ring = nullptr;
+    ~ProfilerThreadRing()
+    {
+        if (ring == nullptr)
+            return;
+        std::lock_guard<std::mutex> lock(profiler.ringsMutex);
+        ring->inUse = false;
+    }
+};
+
+inline ProfilerRing &profilerThreadRing()
+{
+    static thread_local ProfilerThreadRing threadRing;
+    if (threadRing.ring == nullptr)
+        threadRing.ring = claimProfilerRing(nullptr);
+    return *threadRing.ring;
+}
+
+// Names the calling thread's track in the trace, before its first scope
+void setProfilerThreadName(const char *name)
+{
+    ProfilerRing &ring = profilerThreadRing();
+    std::lock_guard<std::mutex> lock(profiler.ringsMutex);
+    ring.threadName = name;
+}
+
+// Only the owning thread writes, so publishing is a single release store
+inline void recordProfilerEvent(ProfilerRing &ring, const char *name, uint64_t start, uint64_t duration)
+{
+    uint64_t index = ring.written.load(std::memory_order_relaxed);
+    ProfilerEvent &event = ring.events[index & (PROFILER_RING_SIZE - 1)];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.duration.store(duration, std::memory_order_relaxed);
+    ring.written.store(index + 1, std::memory_order_release);
+}
+
+struct ProfilerScope
+{
+    const char *name;
+    uint64_t start;
+
+    explicit ProfilerScope(const char *scopeName) : name(scopeName), start(0)
+    {
+        if (profiler.recording)
+            start = profilerNow() + 1; // 0 means not recording
+    }
+    ~ProfilerScope()
+    {
+        if (start != 0 && profiler.recording)
+            recordProfilerEvent(profilerThreadRing(), name, start - 1, profilerNow() - (start - 1));
+    }
+};
+
+inline GLuint takeProfilerQuery()
+{
+    if (profiler.freeQueries.empty())
+    {
+        GLuint queries[16];
+        glGenQueries(16, queries);
+        profiler.freeQueries.insert(profiler.freeQueries.end(), queries, queries + 16);
+    }
+    GLuint query = profiler.freeQueries.back();
+    profiler.freeQueries.pop_back();
+    return query;
+}
+
+struct GPUProfilerScope
+{
+    GPUProfilerSpan span;
+
+    explicit GPUProfilerScope(const char *name)
+    {
+        span.name = nullptr;
+        if (!profiler.recording || !profiler.gpuTimers)
+            return;
+        span.name = name;
+        span.startQuery = takeProfilerQuery();
+        span.endQuery = takeProfilerQuery();
+        glQueryCounter(span.startQuery, GL_TIMESTAMP);
+    }
+    ~GPUProfilerScope()
+    {
+        if (span.name == nullptr)
+            return;
+        glQueryCounter(span.endQuery, GL_TIMESTAMP);
+        profiler.pendingSpans.push_back(span);
+    }
+};
+
+#define PROFILE_SCOPE(name) ProfilerScope PROFILER_CONCAT(profilerScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GPUProfilerScope PROFILER_CONCAT(gpuProfilerScope, __LINE__)(name)
+
+// Reads -profile FILE out of argv
+void parseProfilerArguments(int argc, char *argv[])
+{
+    for (int i = 1; i + 1 < argc; i++)
+        if (strcmp(argv[i], "-profile") == 0)
+            profiler.tracePath = argv[++i];
+}
+
+// Starts recording if -profile was given. Call once the GL context is current, on the thread
+// that owns it.
+void startProfiler()
+{
+    if (profiler.tracePath == nullptr)
+        return;
+    profiler.epoch = std::chrono::steady_clock::now();
+    setProfilerThreadName("Main");
+
+    profiler.gpuTimers = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (profiler.gpuTimers)
+    {
+        // Both clocks read at about the same moment line the GPU spans up with the CPU scopes
+        GLint64 gpuNow = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+        profiler.gpuClockOffset = (int64_t)profilerNow() - gpuNow;
+        profiler.gpuRing = claimProfilerRing("GPU");
+    }
+    profiler.recording = true;
+}
+
+// Moves finished GPU spans into the GPU track. They finish in order, so this stops at the
+// first one still in flight unless wait is set.
+void resolveGPUProfilerSpans(bool wait)
+{
+    size_t resolved = 0;
+    for (; resolved < profiler.pendingSpans.size(); resolved++)
+    {
+        const GPUProfilerSpan &span = profiler.pendingSpans[resolved];
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(span.endQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && !wait)
+            break;
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(span.startQuery, GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(span.endQuery, GL_QUERY_RESULT, &end);
+        int64_t cpuStart = (int64_t)start + profiler.gpuClockOffset;
+        if (cpuStart >= 0 && end >= start)
+            recordProfilerEvent(*profiler.gpuRing, span.name, (uint64_t)cpuStart, end - start);
+        profiler.freeQueries.push_back(span.startQuery);
+        profiler.freeQueries.push_back(span.endQuery);
+    }
+    profiler.pendingSpans.erase(profiler.pendingSpans.begin(), profiler.pendingSpans.begin() + resolved);
+}
+
+// Writes every scope still in the rings as Chrome trace events
+bool writeProfilerTrace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == nullptr)
+    {
+        std::cerr << "Could not write profiler trace to " << path << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(profiler.ringsMutex);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    size_t eventCount = 0;
+    for (ProfilerRing *ring : profiler.rings)
+    {
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", ring->threadId, ring->threadName.c_str());
+        first = false;
+
+        // Slots from before written - ring size may be overwritten while they are copied, so
+        // only those still newer than that afterwards are kept
+        uint64_t written = ring->written.load(std::memory_order_acquire);
+        uint64_t begin = written > PROFILER_RING_SIZE ? written - PROFILER_RING_SIZE : 0;
+        struct Copy
+        {
+            const char *name;
+            uint64_t start, duration;
+        };
+        std::vector<Copy> copies;
+        copies.reserve((size_t)(written - begin));
+        for (uint64_t i = begin; i < written; i++)
+        {
+            const ProfilerEvent &event = ring->events[i & (PROFILER_RING_SIZE - 1)];
+            Copy copy = {event.name.load(std::memory_order_relaxed), event.start.load(std::memory_order_relaxed),
+                         event.duration.load(std::memory_order_relaxed)};
+            copies.push_back(copy);
+        }
+        uint64_t writtenAfter = ring->written.load(std::memory_order_acquire);
+        // The owner may be writing slot writtenAfter already, which index writtenAfter - size
+        // shares, so that one goes too
+        uint64_t firstValid = writtenAfter >= PROFILER_RING_SIZE ? writtenAfter + 1 - PROFILER_RING_SIZE : 0;
+
+        for (uint64_t i = std::max(begin, firstValid); i < written; i++)
+        {
+            const Copy &copy = copies[(size_t)(i - begin)];
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    copy.name, ring->threadId, copy.start / 1000.0, copy.duration / 1000.0);
+            eventCount++;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    std::cout << "Wrote " << eventCount << " profiler events to " << path << std::endl;
+    return true;
+}
+
+// Call once per frame on the GL thread. Collects finished GPU spans and writes the trace when
+// dumpKeyDown goes down.
+void endProfilerFrame(bool dumpKeyDown)
+{
+    if (!profiler.recording)
+        return;
+    if (profiler.gpuTimers)
+        resolveGPUProfilerSpans(false);
+    if (dumpKeyDown && !profiler.dumpKeyWasDown)
+        writeProfilerTrace(profiler.tracePath);
+    profiler.dumpKeyWasDown = dumpKeyDown;
+}
+
+// Waits for the last GPU spans and writes the trace. Call before the GL context goes away.
+void stopProfiler()
+{
+    if (!profiler.recording)
+        return;
+    if (profiler.gpuTimers)
+    {
+        resolveGPUProfilerSpans(true);
+        glDeleteQueries((GLsizei)profiler.freeQueries.size(), profiler.freeQueries.data());
+        profiler.freeQueries.clear();
+    }
+    profiler.recording = false;
+    writeProfilerTrace(profiler.tracePath);
+}
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_GPU_SCOPE(name) ((void)0)
+
+#include <cstring>
+
+inline void parseProfilerArguments(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], "-profile") == 0)
+            std::cerr << "Built without the profiler, rebuild with -DUSE_PROFILER" << std::endl;
+}
+inline void setProfilerThreadName(const char *) {}
+inline void startProfiler() {}
+inline void endProfilerFrame(bool) {}
+inline void stopProfiler() {}
+
+#endif
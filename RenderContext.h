@@ -0,0 +1,460 @@
+//
+// Window or headless GL context, chosen on the command line
+//
+// By default a GLFW window is created as before. With -headless there is no window at all: the
+// context comes from EGL without a surface (EGL_MESA_platform_surfaceless, built with
+// -DUSE_EGL -lEGL) or from OSMesa (-DUSE_OSMESA -lOSMesa), so it runs on machines with no
+// display and no GPU through llvmpipe. Frames are rendered into a framebuffer object of the
+// requested size, which stays bound for the whole run.
+//
+// Either way the run can be limited to a number of frames or a duration, and the programs read
+// time and input through the functions below, so the same render loop works in both modes.
+// Keys, cursor and time are latched once per frame, when beginRenderContextFrame polls events,
+// and answered from that snapshot for the rest of the frame. Latching at the start of the frame
+// rather than after the previous swap keeps whatever waiting happens in between (see
+// FramePacing.h) out of the input's latency. The snapshot can come from a recorded input path
+// instead of the window (see InputReplay.h), which makes a run repeat exactly. A headless run
+// without a path has no input, keys are never down and the cursor never moves.
+//
+// Options:
+//     -headless          no window, render offscreen
+//     -size WxH          framebuffer size, 800x600 by default
+//     -frames N          exit after N frames
+//     -duration S        exit after S seconds
+//     -record FILE       save this run's input path on exit
+//     -replay FILE       take input from a recorded path, exit when it ends
+//     -timestep S        advance time by exactly S seconds per frame
+//
+
+#pragma once
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "InputReplay.h"
+#include "Profiler.h"
+
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef USE_OSMESA
+#include <GL/osmesa.h>
+#endif
+
+struct RenderContext
+{
+    // Options
+    bool headless = false;
+    int width = 800;
+    int height = 600;
+    int frameLimit = 0;          // 0 for no limit
+    double durationLimit = 0.0;  // seconds, 0 for no limit
+    const char *recordPath = nullptr;
+    const char *replayPath = nullptr;
+    double timeStep = 0.0;       // 0 to follow the clock
+
+    GLFWwindow *window = nullptr;
+#ifdef USE_EGL
+    EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+    EGLContext eglContext = EGL_NO_CONTEXT;
+#endif
+#ifdef USE_OSMESA
+    OSMesaContext osMesaContext = nullptr;
+    std::vector<unsigned char> osMesaBuffer; // OSMesa needs one, though nothing is drawn to it
+#endif
+    GLuint framebuffer = 0;
+    GLuint colorRenderbuffer = 0;
+    GLuint depthRenderbuffer = 0;
+
+    std::chrono::steady_clock::time_point startTime;
+    double loopStartTime = -1.0; // when the first frame started, loading isn't counted
+    int frames = 0;
+    bool closeRequested = false;
+
+    // This frame's input, see latchRenderContextInput
+    bool keys[GLFW_KEY_LAST + 1] = {};
+    double cursorX = 0.0;
+    double cursorY = 0.0;
+    double time = 0.0;
+    double inputClock = 0.0; // renderContextClock when it was latched
+
+    // The path being replayed or recorded
+    InputPath inputPath;
+    bool replaying = false;
+    bool recording = false;
+    size_t replayFrame = 0;
+    bool replayFinished = false;
+};
+
+// Reads the options above out of argv, anything else is left for the program
+void parseRenderContextArguments(RenderContext &context, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-headless") == 0)
+            context.headless = true;
+        else if (i + 1 < argc && strcmp(argv[i], "-size") == 0)
+        {
+            int width, height;
+            if (sscanf(argv[++i], "%dx%d", &width, &height) == 2 && width > 0 && height > 0)
+            {
+                context.width = width;
+                context.height = height;
+            }
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-frames") == 0)
+            context.frameLimit = std::max(0, atoi(argv[++i]));
+        else if (i + 1 < argc && strcmp(argv[i], "-duration") == 0)
+            context.durationLimit = std::max(0.0, atof(argv[++i]));
+        else if (i + 1 < argc && strcmp(argv[i], "-record") == 0)
+            context.recordPath = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-replay") == 0)
+            context.replayPath = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-timestep") == 0)
+            context.timeStep = std::max(0.0, atof(argv[++i]));
+    }
+}
+
+#ifdef USE_EGL
+bool createEGLContext(RenderContext &context, int majorVersion, int minorVersion)
+{
+    // The surfaceless platform needs no display server at all, plain EGL is the fallback
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != nullptr)
+        context.eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (context.eglDisplay == EGL_NO_DISPLAY)
+        context.eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint eglMajor, eglMinor;
+    if (context.eglDisplay == EGL_NO_DISPLAY || !eglInitialize(context.eglDisplay, &eglMajor, &eglMinor))
+    {
+        std::cerr << "Failed to initialize EGL" << std::endl;
+        return false;
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    EGLint configAttributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(context.eglDisplay, configAttributes, &config, 1, &configCount) || configCount == 0)
+        config = (EGLConfig)0; // EGL_NO_CONFIG_KHR, fine for a context that never gets a surface
+
+    EGLint contextAttributes[] = {EGL_CONTEXT_MAJOR_VERSION, majorVersion, EGL_CONTEXT_MINOR_VERSION, minorVersion,
+                                  EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+    context.eglContext = eglCreateContext(context.eglDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+    if (context.eglContext == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(context.eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, context.eglContext))
+    {
+        std::cerr << "Failed to create a surfaceless EGL context (error 0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef USE_OSMESA
+bool createOSMesaContext(RenderContext &context, int majorVersion, int minorVersion)
+{
+    const int attributes[] = {OSMESA_FORMAT, OSMESA_RGBA, OSMESA_DEPTH_BITS, 24,
+                              OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+                              OSMESA_CONTEXT_MAJOR_VERSION, majorVersion, OSMESA_CONTEXT_MINOR_VERSION, minorVersion, 0};
+    context.osMesaContext = OSMesaCreateContextAttribs(attributes, nullptr);
+    context.osMesaBuffer.resize((size_t)context.width * context.height * 4);
+    if (context.osMesaContext == nullptr ||
+        !OSMesaMakeCurrent(context.osMesaContext, context.osMesaBuffer.data(), GL_UNSIGNED_BYTE, context.width, context.height))
+    {
+        std::cerr << "Failed to create an OSMesa context" << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+bool createHeadlessContext(RenderContext &context, int majorVersion, int minorVersion)
+{
+#if defined(USE_EGL)
+    return createEGLContext(context, majorVersion, minorVersion);
+#elif defined(USE_OSMESA)
+    return createOSMesaContext(context, majorVersion, minorVersion);
+#else
+    (void)context;
+    (void)majorVersion;
+    (void)minorVersion;
+    std::cerr << "Built without a headless backend, rebuild with -DUSE_EGL -lEGL or -DUSE_OSMESA -lOSMesa" << std::endl;
+    return false;
+#endif
+}
+
+// Wall-clock seconds since the context was created, whatever the input comes from
+double renderContextClock(const RenderContext &context)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - context.startTime).count();
+}
+
+// Wall-clock seconds since the first frame started
+double renderLoopTime(const RenderContext &context)
+{
+    return context.loopStartTime < 0.0 ? 0.0 : renderContextClock(context) - context.loopStartTime;
+}
+
+// Takes the next frame's keys, cursor and time, from the replayed path or from the window.
+// Called when the context is created and after each frame's events are polled, which is the
+// only time GLFW's key and cursor state changes anyway.
+void latchRenderContextInput(RenderContext &context)
+{
+    context.inputClock = renderContextClock(context);
+    if (context.replaying)
+    {
+        // The window can still be closed with escape, the path's own keys steer the scene
+        if (context.window != nullptr && glfwGetKey(context.window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+            context.closeRequested = true;
+        if (context.replayFrame >= context.inputPath.frames.size())
+        {
+            context.replayFinished = true;
+            return;
+        }
+        const InputFrame &frame = context.inputPath.frames[context.replayFrame++];
+        context.time += context.timeStep > 0.0 ? context.timeStep : frame.timeStep;
+        context.cursorX += frame.cursorDeltaX;
+        context.cursorY += frame.cursorDeltaY;
+        std::fill(context.keys, context.keys + GLFW_KEY_LAST + 1, false);
+        for (int key : frame.keys)
+            context.keys[key] = true;
+        return;
+    }
+
+    double previousTime = context.time;
+    double previousCursorX = context.cursorX;
+    double previousCursorY = context.cursorY;
+    context.time = context.timeStep > 0.0 ? context.time + context.timeStep : renderContextClock(context);
+    if (context.window != nullptr)
+    {
+        for (int key = GLFW_KEY_SPACE; key <= GLFW_KEY_LAST; key++)
+            context.keys[key] = glfwGetKey(context.window, key) == GLFW_PRESS;
+        glfwGetCursorPos(context.window, &context.cursorX, &context.cursorY);
+    }
+
+    if (context.recording)
+    {
+        InputFrame frame;
+        frame.timeStep = context.time - previousTime;
+        // The first frame starts where the cursor already is
+        if (!context.inputPath.frames.empty())
+        {
+            frame.cursorDeltaX = context.cursorX - previousCursorX;
+            frame.cursorDeltaY = context.cursorY - previousCursorY;
+        }
+        for (int key = GLFW_KEY_SPACE; key <= GLFW_KEY_LAST; key++)
+            if (context.keys[key])
+                frame.keys.push_back(key);
+        context.inputPath.frames.push_back(frame);
+    }
+}
+
+// Offscreen color and depth targets, bound in place of the window's framebuffer
+bool createOffscreenFramebuffer(RenderContext &context)
+{
+    glGenRenderbuffers(1, &context.colorRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, context.colorRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, context.width, context.height);
+    glGenRenderbuffers(1, &context.depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, context.depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, context.width, context.height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &context.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, context.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, context.colorRenderbuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, context.depthRenderbuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cerr << "Offscreen framebuffer is incomplete" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Creates the window, or the headless context and its framebuffer, and loads GL through
+// GLEW. A headless context is always at least 3.3 core, which everything drawn here needs.
+bool createRenderContext(RenderContext &context, const char *title, int majorVersion, int minorVersion, bool coreProfile)
+{
+    if (context.headless)
+    {
+        if (majorVersion * 10 + minorVersion < 33)
+        {
+            majorVersion = 3;
+            minorVersion = 3;
+        }
+        if (!createHeadlessContext(context, majorVersion, minorVersion))
+            return false;
+    }
+    else
+    {
+        if (!glfwInit())
+        {
+            std::cerr << "Failed to initialize GLFW" << std::endl;
+            return false;
+        }
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, majorVersion);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minorVersion);
+        if (coreProfile)
+        {
+            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+            glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        }
+        context.window = glfwCreateWindow(context.width, context.height, title, nullptr, nullptr);
+        if (context.window == nullptr)
+        {
+            std::cerr << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return false;
+        }
+        glfwMakeContextCurrent(context.window);
+    }
+
+    glewExperimental = true; // Needed for core profile
+    GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // A GLX build of GLEW has loaded the GL functions by now, it only misses the X display
+    if (context.headless && glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)
+        glewStatus = GLEW_OK;
+#endif
+    if (glewStatus != GLEW_OK)
+    {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        return false;
+    }
+
+    if (context.headless && !createOffscreenFramebuffer(context))
+        return false;
+    glViewport(0, 0, context.width, context.height);
+    context.startTime = std::chrono::steady_clock::now();
+
+    // A path may already be set up, by a benchmark with no file of its own
+    if (context.replayPath != nullptr && !loadInputPath(context.inputPath, context.replayPath))
+        return false;
+    if (context.replayPath != nullptr)
+        context.replaying = true;
+    context.recording = context.recordPath != nullptr && !context.replaying;
+    latchRenderContextInput(context);
+    return true;
+}
+
+// Seconds of simulated time, as of this frame's input. Follows the clock unless a path is
+// replayed or -timestep is set.
+double renderContextTime(const RenderContext &context)
+{
+    return context.time;
+}
+
+
+// The render loop's condition. False once the window was closed, the program asked to stop, a
+// replayed path has no input left for another frame or a frame or time limit is up.
+bool renderContextRunning(RenderContext &context)
+{
+    if (context.loopStartTime < 0.0)
+        context.loopStartTime = renderContextClock(context);
+    if (context.closeRequested || context.replayFinished || (context.window != nullptr && glfwWindowShouldClose(context.window)))
+        return false;
+    if (context.replaying && context.frames > 0 && context.replayFrame >= context.inputPath.frames.size())
+        return false;
+    if (context.frameLimit > 0 && context.frames >= context.frameLimit)
+        return false;
+    if (context.durationLimit > 0.0 && renderLoopTime(context) >= context.durationLimit)
+        return false;
+    return true;
+}
+
+// Polls events and latches this frame's input, call it as late as possible before the input is
+// used. The first frame uses the input latched when the context was created.
+void beginRenderContextFrame(RenderContext &context)
+{
+    if (context.frames == 0)
+        return;
+    if (context.window != nullptr)
+        glfwPollEvents();
+    latchRenderContextInput(context);
+}
+
+// Presents the frame in a window, or just submits it offscreen
+void endRenderContextFrame(RenderContext &context)
+{
+    PROFILE_SCOPE("Present");
+    if (context.window != nullptr)
+        glfwSwapBuffers(context.window);
+    else
+        glFlush();
+    context.frames++;
+}
+
+void closeRenderContext(RenderContext &context)
+{
+    context.closeRequested = true;
+}
+
+bool isRenderContextKeyDown(const RenderContext &context, int key)
+{
+    return key >= GLFW_KEY_SPACE && key <= GLFW_KEY_LAST && context.keys[key];
+}
+
+// A replayed cursor starts at the origin, only its movement matters
+void getRenderContextCursor(const RenderContext &context, double &x, double &y)
+{
+    x = context.cursorX;
+    y = context.cursorY;
+}
+
+void destroyRenderContext(RenderContext &context)
+{
+    if (context.headless && context.frames > 0)
+    {
+        double seconds = renderLoopTime(context);
+        std::cout << "Rendered " << context.frames << " frames at " << context.width << "x" << context.height << " in "
+                  << seconds << " s (" << seconds * 1000.0 / context.frames << " ms per frame)" << std::endl;
+    }
+    // A loop left between latching and presenting has latched one frame too many
+    if (context.recording && context.inputPath.frames.size() > (size_t)context.frames)
+        context.inputPath.frames.resize(context.frames);
+    if (context.recording && saveInputPath(context.inputPath, context.recordPath))
+        std::cout << "Recorded " << context.inputPath.frames.size() << " frames of input to " << context.recordPath << std::endl;
+    if (context.framebuffer != 0)
+    {
+        glDeleteFramebuffers(1, &context.framebuffer);
+        GLuint renderbuffers[2] = {context.colorRenderbuffer, context.depthRenderbuffer};
+        glDeleteRenderbuffers(2, renderbuffers);
+        context.framebuffer = context.colorRenderbuffer = context.depthRenderbuffer = 0;
+    }
+
+    if (context.window != nullptr)
+    {
+        glfwTerminate();
+        context.window = nullptr;
+    }
+#ifdef USE_EGL
+    if (context.eglDisplay != EGL_NO_DISPLAY)
+    {
+        eglMakeCurrent(context.eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (context.eglContext != EGL_NO_CONTEXT)
+            eglDestroyContext(context.eglDisplay, context.eglContext);
+        eglTerminate(context.eglDisplay);
+        context.eglDisplay = EGL_NO_DISPLAY;
+        context.eglContext = EGL_NO_CONTEXT;
+    }
+#endif
+#ifdef USE_OSMESA
+    if (context.osMesaContext != nullptr)
+    {
+        OSMesaDestroyContext(context.osMesaContext);
+        context.osMesaContext = nullptr;
+    }
+#endif
+}
@@ -0,0 +1,130 @@
+//
+// Render queue sorted by 64-bit keys
+//
+// Each draw is pushed with a key that packs, from the most significant bits down:
+//     pass (4) | program (10) | texture (12) | mesh (14) | depth (24)
+// so sorting the keys groups draws by pass, then by program, texture and mesh, which keeps
+// state changes between consecutive draws to a minimum. Within a group opaque draws go front
+// to back, so early depth testing rejects as much as possible, and transparent ones back to
+// front. Programs, textures and meshes go in by their GL name or index, anything past the
+// field width wraps, which only costs some sorting quality, never correctness.
+//
+// The keys are sorted with an LSD radix sort, one byte per pass. All eight histograms are
+// built in a single read of the keys, and a byte that is the same for every key (typically the
+// pass and program bytes) is skipped, so a frame usually costs far fewer than eight passes.
+// The sort is stable, draws with equal keys keep the order they were pushed in.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum RenderPass
+{
+    RENDER_PASS_OPAQUE = 0,
+    RENDER_PASS_TRANSPARENT = 1,
+};
+
+const int RENDER_KEY_DEPTH_BITS = 24;
+const int RENDER_KEY_MESH_BITS = 14;
+const int RENDER_KEY_TEXTURE_BITS = 12;
+const int RENDER_KEY_PROGRAM_BITS = 10;
+const int RENDER_KEY_PASS_BITS = 4;
+
+const int RENDER_KEY_MESH_SHIFT = RENDER_KEY_DEPTH_BITS;
+const int RENDER_KEY_TEXTURE_SHIFT = RENDER_KEY_MESH_SHIFT + RENDER_KEY_MESH_BITS;
+const int RENDER_KEY_PROGRAM_SHIFT = RENDER_KEY_TEXTURE_SHIFT + RENDER_KEY_TEXTURE_BITS;
+const int RENDER_KEY_PASS_SHIFT = RENDER_KEY_PROGRAM_SHIFT + RENDER_KEY_PROGRAM_BITS;
+
+static_assert(RENDER_KEY_PASS_SHIFT + RENDER_KEY_PASS_BITS == 64, "Sort key fields must fill 64 bits");
+
+// A draw in the queue, index refers to the caller's own array of draws
+struct RenderItem
+{
+    uint64_t key;
+    uint32_t index;
+};
+
+struct RenderQueue
+{
+    std::vector<RenderItem> items;
+    std::vector<RenderItem> scratch;
+    int sortPasses = 0; // radix passes the last sort needed
+};
+
+inline uint64_t renderKeyField(uint64_t value, int bits, int shift)
+{
+    return (value & ((1ull << bits) - 1)) << shift;
+}
+
+// depth is the view distance divided by the far plane, clamped to [0, 1]
+inline uint64_t makeSortKey(RenderPass pass, uint32_t program, uint32_t texture, uint32_t mesh, float depth)
+{
+    const uint32_t maxDepth = (1u << RENDER_KEY_DEPTH_BITS) - 1;
+    uint32_t quantizedDepth = (uint32_t)(std::min(std::max(depth, 0.0f), 1.0f) * maxDepth);
+    if (pass == RENDER_PASS_TRANSPARENT)
+        quantizedDepth = maxDepth - quantizedDepth; // back to front
+    return renderKeyField(pass, RENDER_KEY_PASS_BITS, RENDER_KEY_PASS_SHIFT) |
+           renderKeyField(program, RENDER_KEY_PROGRAM_BITS, RENDER_KEY_PROGRAM_SHIFT) |
+           renderKeyField(texture, RENDER_KEY_TEXTURE_BITS, RENDER_KEY_TEXTURE_SHIFT) |
+           renderKeyField(mesh, RENDER_KEY_MESH_BITS, RENDER_KEY_MESH_SHIFT) |
+           quantizedDepth;
+}
+
+void clearRenderQueue(RenderQueue &queue)
+{
+    queue.items.clear();
+}
+
+void pushRenderItem(RenderQueue &queue, uint64_t key, uint32_t index)
+{
+    RenderItem item;
+    item.key = key;
+    item.index = index;
+    queue.items.push_back(item);
+}
+
+// Sorts the items by key, afterwards queue.items is in execution order
+void sortRenderQueue(RenderQueue &queue)
+{
+    size_t count = queue.items.size();
+    queue.sortPasses = 0;
+    if (count < 2)
+        return;
+
+    // counts[b][v] is the number of keys whose byte b is v
+    uint32_t counts[8][256] = {};
+    for (const RenderItem &item : queue.items)
+        for (int byte = 0; byte < 8; byte++)
+            counts[byte][(item.key >> (byte * 8)) & 0xFF]++;
+
+    queue.scratch.resize(count);
+    RenderItem *source = queue.items.data();
+    RenderItem *destination = queue.scratch.data();
+    for (int byte = 0; byte < 8; byte++)
+    {
+        int shift = byte * 8;
+        if (counts[byte][(source[0].key >> shift) & 0xFF] == count)
+            continue; // every key has the same value here
+
+        uint32_t offsets[256];
+        uint32_t total = 0;
+        for (int value = 0; value < 256; value++)
+        {
+            offsets[value] = total;
+            total += counts[byte][value];
+        }
+        for (size_t i = 0; i < count; i++)
+            destination[offsets[(source[i].key >> shift) & 0xFF]++] = source[i];
+
+        std::swap(source, destination);
+        queue.sortPasses++;
+    }
+
+    // An odd number of passes leaves the result in the scratch buffer
+    if (source != queue.items.data())
+        queue.items.swap(queue.scratch);
+}
@@ -0,0 +1,188 @@
+//
+// Shader program binary cache
+//
+// Linked programs are saved with glGetProgramBinary and loaded back with glProgramBinary on
+// the next launch, skipping GLSL compilation entirely. Entries are keyed by a hash of the
+// shader sources together with the GL vendor, renderer and version strings, since a binary
+// is only valid for the driver that produced it. Every entry carries a checksum, and if the
+// driver still rejects a binary the caller simply compiles from source and the entry is
+// overwritten.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "ContentHash.h"
+
+const char SHADER_CACHE_MAGIC[8] = {'C', '3', '7', '1', 'S', 'H', 'D', 'R'};
+const uint32_t SHADER_CACHE_VERSION = 1;
+
+struct ShaderCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t binaryFormat;
+    uint64_t key;
+    uint64_t binaryLength;
+    uint64_t binaryHash;
+};
+
+struct ShaderCache
+{
+    std::string directory;
+    bool enabled = false;
+    uint64_t driverHash = 0;
+    int hits = 0;
+    int misses = 0;
+};
+
+// Call once the GL context is current. The directory defaults to $COMP371_SHADER_CACHE or
+// "shader_cache" and is created if needed.
+bool initShaderCache(ShaderCache &cache, const char *directory = nullptr)
+{
+    GLint formatCount = 0;
+    // Core in 4.1, where drivers need not list the extension
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    cache.enabled = formatCount > 0;
+    if (!cache.enabled)
+        return false;
+
+    if (directory == nullptr)
+        directory = getenv("COMP371_SHADER_CACHE");
+    cache.directory = directory != nullptr ? directory : "shader_cache";
+#ifdef _WIN32
+    _mkdir(cache.directory.c_str());
+#else
+    mkdir(cache.directory.c_str(), 0755);
+#endif
+
+    std::string driver;
+    const GLenum driverStrings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+    for (GLenum name : driverStrings)
+    {
+        const GLubyte *value = glGetString(name);
+        driver += value != nullptr ? (const char *)value : "";
+        driver += '\n';
+    }
+    cache.driverHash = hashContents(driver.data(), driver.size());
+    return true;
+}
+
+uint64_t shaderCacheKey(const ShaderCache &cache, const char *vertexSource, const char *fragmentSource)
+{
+    uint64_t key = hashContents(vertexSource, strlen(vertexSource), cache.driverHash);
+    return hashContents(fragmentSource, strlen(fragmentSource), key);
+}
+
+std::string shaderCachePath(const ShaderCache &cache, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return cache.directory + "/" + name;
+}
+
+// Ask the driver to keep the binary around, call before glLinkProgram
+void prepareProgramForCache(const ShaderCache &cache, GLuint program)
+{
+    if (cache.enabled)
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+// Returns a linked program from the cache, or 0 if there is no valid entry for this key
+GLuint loadProgramBinary(ShaderCache &cache, uint64_t key)
+{
+    if (!cache.enabled)
+        return 0;
+
+    std::vector<unsigned char> contents;
+    if (!readFileContents(shaderCachePath(cache, key).c_str(), contents) || contents.size() < sizeof(ShaderCacheHeader))
+    {
+        cache.misses++;
+        return 0;
+    }
+
+    ShaderCacheHeader header;
+    memcpy(&header, contents.data(), sizeof(header));
+    const unsigned char *binary = contents.data() + sizeof(header);
+    bool valid = memcmp(header.magic, SHADER_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == SHADER_CACHE_VERSION &&
+                 header.key == key &&
+                 header.binaryLength == contents.size() - sizeof(header) &&
+                 header.binaryHash == hashContents(binary, (size_t)header.binaryLength);
+    if (!valid)
+    {
+        cache.misses++;
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.binaryFormat, binary, (GLsizei)header.binaryLength);
+
+    // Drivers reject binaries after an update or for another GPU, that is a normal miss
+    GLint linkStatus = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+    if (linkStatus == GL_FALSE)
+    {
+        glDeleteProgram(program);
+        cache.misses++;
+        return 0;
+    }
+
+    cache.hits++;
+    return program;
+}
+
+void storeProgramBinary(ShaderCache &cache, uint64_t key, GLuint program)
+{
+    if (!cache.enabled || program == 0)
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<unsigned char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    ShaderCacheHeader header;
+    memcpy(header.magic, SHADER_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SHADER_CACHE_VERSION;
+    header.binaryFormat = format;
+    header.key = key;
+    header.binaryLength = (uint64_t)length;
+    header.binaryHash = hashContents(binary.data(), (size_t)length);
+
+    // Write to a temporary file first so a crash never leaves a truncated entry behind
+    std::string path = shaderCachePath(cache, key);
+    std::string temporaryPath = path + ".tmp";
+    FILE *file = fopen(temporaryPath.c_str(), "wb");
+    if (!file)
+        return;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(binary.data(), 1, (size_t)length, file) == (size_t)length;
+    written = fclose(file) == 0 && written;
+    if (!written)
+    {
+        remove(temporaryPath.c_str());
+        return;
+    }
+    remove(path.c_str());
+    rename(temporaryPath.c_str(), path.c_str());
+}
@@ -0,0 +1,443 @@
+//
+// Shader permutations built from one source
+//
+// Both programs draw with variants of the same uber shader below. A variant is selected by a
+// bitmask of ShaderFeatures, which is turned into #defines ahead of the source, so a draw only
+// pays for what it uses: unlit planets skip the lighting code and the normal transform, objects
+// without a texture skip the sampler. Variants are kept by bitmask, and linked binaries also go
+// through the on-disk ShaderCache.
+//
+// Compilation doesn't block: requestShaderVariant only issues the compile and link, and
+// pollShaderVariants picks up the results once GL_KHR_parallel_shader_compile reports them
+// complete. Until then getShaderVariant hands out a flat grey placeholder.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ShaderCache.h"
+#include "ShaderProgram.h"
+
+enum ShaderFeatures : uint32_t
+{
+    SHADER_LIT = 1 << 0,               // Phong lighting, otherwise the surface color is output as is
+    SHADER_TEXTURED = 1 << 1,          // surface color from diffuseTexture (diffuseTextureArray when instanced), otherwise from objectColor
+    SHADER_INSTANCED = 1 << 2,         // world matrix, tint and texture layer from per-instance attributes
+    SHADER_CPU_NORMAL_MATRIX = 1 << 3, // normalMatrix (and each instance's) computed on the CPU, otherwise per vertex
+    SHADER_PLACEHOLDER = 1 << 4,       // flat grey, drawn while the requested variant compiles
+    SHADER_DEPTH_ONLY = 1 << 5,        // position only and an empty fragment shader, for the depth pre-pass
+};
+
+const uint32_t SHADER_FEATURE_COUNT = 6;
+const char *const SHADER_FEATURE_DEFINES[SHADER_FEATURE_COUNT] = {"LIT", "TEXTURED", "INSTANCED", "CPU_NORMAL_MATRIX", "PLACEHOLDER", "DEPTH_ONLY"};
+
+// Attribute locations, which differ between the two programs' vertex layouts
+struct ShaderVertexLayout
+{
+    int position = 0;
+    int normal = 1;
+    int texCoord = 2;
+    int instanceWorldMatrix = 3; // uses four consecutive locations
+    int instanceTint = 7;
+    int instanceLayer = 8;
+    int instanceNormalMatrix = 9; // uses three consecutive locations
+};
+
+// A variant whose compile and link have been issued but not checked yet
+struct PendingShaderVariant
+{
+    uint32_t features = 0;
+    GLuint program = 0;
+    GLuint vs = 0;
+    GLuint fs = 0;
+    uint64_t cacheKey = 0;
+};
+
+struct ShaderLibrary
+{
+    ShaderVertexLayout layout;
+    ShaderCache *binaryCache = nullptr;
+    bool parallelCompile = false;
+    std::map<uint32_t, ShaderProgram> programs; // finished variants, id 0 for ones that failed
+    std::vector<PendingShaderVariant> pending;
+    ShaderProgram *placeholders[2] = {nullptr, nullptr}; // flat grey, without and with SHADER_INSTANCED
+    int compiled = 0;
+};
+
+// Shared by both stages, laid out like FrameUniforms and ObjectUniforms in UniformBuffers.h
+const char *UBER_UNIFORM_BLOCKS = R"(
+layout (std140) uniform FrameUniforms
+{
+    mat4 viewMatrix;
+    mat4 projectionMatrix;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 viewPos;
+};
+
+layout (std140) uniform ObjectUniforms
+{
+    mat4 worldMatrix;
+    mat3 normalMatrix;
+    vec4 objectColor;
+};
+)";
+
+// gl_Position is invariant so a depth-only variant lays down exactly the depths the shading
+// variants test against with GL_LEQUAL
+const char *UBER_VERTEX_SHADER = R"(
+invariant gl_Position;
+
+layout (location = POSITION_LOCATION) in vec3 aPos;
+layout (location = NORMAL_LOCATION) in vec3 aNormal;
+layout (location = TEXCOORD_LOCATION) in vec2 aTexCoord;
+#ifdef INSTANCED
+layout (location = INSTANCE_WORLD_MATRIX_LOCATION) in mat4 instanceWorldMatrix;
+layout (location = INSTANCE_TINT_LOCATION) in vec4 instanceTint;
+layout (location = INSTANCE_LAYER_LOCATION) in float instanceLayer;
+
+out vec4 Tint;
+flat out float TextureLayer;
+#ifdef CPU_NORMAL_MATRIX
+layout (location = INSTANCE_NORMAL_MATRIX_LOCATION) in mat3 instanceNormalMatrix;
+#endif
+#endif
+
+out vec2 TexCoord;
+#ifdef LIT
+out vec3 Normal;
+out vec3 FragPos;
+#endif
+
+void main() {
+#ifdef INSTANCED
+    // The object block places the whole batch, each instance is placed within it
+    mat4 world = worldMatrix * instanceWorldMatrix;
+    Tint = instanceTint;
+    TextureLayer = instanceLayer;
+#else
+    mat4 world = worldMatrix;
+#endif
+    vec4 worldPosition = world * vec4(aPos, 1.0);
+    gl_Position = projectionMatrix * viewMatrix * worldPosition;
+    TexCoord = aTexCoord;
+#ifdef LIT
+    FragPos = worldPosition.xyz;
+#if defined(CPU_NORMAL_MATRIX) && defined(INSTANCED)
+    Normal = normalMatrix * instanceNormalMatrix * aNormal;
+#elif defined(CPU_NORMAL_MATRIX)
+    Normal = normalMatrix * aNormal;
+#else
+    Normal = mat3(transpose(inverse(world))) * aNormal;
+#endif
+#endif
+}
+)";
+
+const char *UBER_FRAGMENT_SHADER = R"(
+#ifdef DEPTH_ONLY
+// The depth is written by the fixed function stages, there is nothing to shade
+void main() {
+}
+#else
+out vec4 FragColor;
+
+in vec2 TexCoord;
+#ifdef LIT
+in vec3 Normal;
+in vec3 FragPos;
+#endif
+
+#ifdef INSTANCED
+in vec4 Tint;
+flat in float TextureLayer;
+#endif
+
+#if defined(TEXTURED) && defined(INSTANCED)
+uniform sampler2DArray diffuseTextureArray;
+#elif defined(TEXTURED)
+uniform sampler2D diffuseTexture;
+#endif
+
+void main() {
+#if defined(PLACEHOLDER)
+    vec4 surface = vec4(0.5, 0.5, 0.5, 1.0);
+#elif defined(TEXTURED) && defined(INSTANCED)
+    vec4 surface = texture(diffuseTextureArray, vec3(TexCoord, TextureLayer)) * Tint;
+#elif defined(TEXTURED)
+    vec4 surface = texture(diffuseTexture, TexCoord);
+#elif defined(INSTANCED)
+    vec4 surface = vec4(objectColor.rgb * Tint.rgb, 1.0);
+#else
+    vec4 surface = vec4(objectColor.rgb, 1.0);
+#endif
+
+#ifdef LIT
+    // Ambient
+    float ambientStrength = 0.1;
+    vec3 ambient = ambientStrength * lightColor.rgb;
+
+    // Diffuse
+    vec3 norm = normalize(Normal);
+    vec3 lightDir = normalize(lightPos.xyz - FragPos);
+    float diff = max(dot(norm, lightDir), 0.0);
+    vec3 diffuse = diff * lightColor.rgb;
+
+    // Specular
+    float specularStrength = 0.5;
+    vec3 viewDir = normalize(viewPos.xyz - FragPos);
+    vec3 reflectDir = reflect(-lightDir, norm);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+    vec3 specular = specularStrength * spec * lightColor.rgb;
+
+    FragColor = vec4((ambient + diffuse + specular) * surface.rgb, 1.0);
+#else
+    FragColor = surface;
+#endif
+}
+#endif
+)";
+
+// Drops bits that make no difference, so equivalent requests share one program. Only lit
+// variants transform normals, and placeholders and depth-only variants only care about their
+// vertex input.
+uint32_t canonicalShaderFeatures(uint32_t features)
+{
+    if (features & SHADER_PLACEHOLDER)
+        features &= SHADER_PLACEHOLDER | SHADER_INSTANCED;
+    else if (features & SHADER_DEPTH_ONLY)
+        features &= SHADER_DEPTH_ONLY | SHADER_INSTANCED;
+    if (!(features & SHADER_LIT))
+        features &= ~SHADER_CPU_NORMAL_MATRIX;
+    return features & ((1u << SHADER_FEATURE_COUNT) - 1);
+}
+
+std::string describeShaderFeatures(uint32_t features)
+{
+    std::string description;
+    for (uint32_t bit = 0; bit < SHADER_FEATURE_COUNT; bit++)
+    {
+        if (!(features & (1u << bit)))
+            continue;
+        if (!description.empty())
+            description += '|';
+        description += SHADER_FEATURE_DEFINES[bit];
+    }
+    return description.empty() ? "NONE" : description;
+}
+
+// The #version line, feature defines and attribute locations put ahead of either stage
+std::string shaderVariantPreamble(const ShaderLibrary &library, uint32_t features)
+{
+    std::string preamble = "#version 330 core\n";
+    for (uint32_t bit = 0; bit < SHADER_FEATURE_COUNT; bit++)
+        if (features & (1u << bit))
+            preamble += std::string("#define ") + SHADER_FEATURE_DEFINES[bit] + " 1\n";
+
+    const ShaderVertexLayout &layout = library.layout;
+    preamble += "#define POSITION_LOCATION " + std::to_string(layout.position) + "\n";
+    preamble += "#define NORMAL_LOCATION " + std::to_string(layout.normal) + "\n";
+    preamble += "#define TEXCOORD_LOCATION " + std::to_string(layout.texCoord) + "\n";
+    preamble += "#define INSTANCE_WORLD_MATRIX_LOCATION " + std::to_string(layout.instanceWorldMatrix) + "\n";
+    preamble += "#define INSTANCE_TINT_LOCATION " + std::to_string(layout.instanceTint) + "\n";
+    preamble += "#define INSTANCE_LAYER_LOCATION " + std::to_string(layout.instanceLayer) + "\n";
+    preamble += "#define INSTANCE_NORMAL_MATRIX_LOCATION " + std::to_string(layout.instanceNormalMatrix) + "\n";
+    return preamble;
+}
+
+// Logs the info log of a shader or program that failed
+void reportShaderVariantError(const char *what, GLuint object, bool isProgram, uint32_t features)
+{
+    GLint length = 0;
+    if (isProgram)
+        glGetProgramiv(object, GL_INFO_LOG_LENGTH, &length);
+    else
+        glGetShaderiv(object, GL_INFO_LOG_LENGTH, &length);
+    std::vector<char> message(length > 1 ? length : 1, '\0');
+    if (isProgram)
+        glGetProgramInfoLog(object, (GLsizei)message.size(), nullptr, message.data());
+    else
+        glGetShaderInfoLog(object, (GLsizei)message.size(), nullptr, message.data());
+    std::cerr << "Failed to " << what << " for " << describeShaderFeatures(features) << ": " << message.data() << std::endl;
+}
+
+// Issues the compile and link without asking for any status, so drivers that compile on their
+// own threads can keep going while the caller decodes textures. Binary cache hits are ready
+// straight away.
+void startShaderVariant(ShaderLibrary &library, uint32_t features)
+{
+    std::string preamble = shaderVariantPreamble(library, features);
+    std::string vertexSource = preamble + UBER_UNIFORM_BLOCKS + UBER_VERTEX_SHADER;
+    std::string fragmentSource = preamble + UBER_UNIFORM_BLOCKS + UBER_FRAGMENT_SHADER;
+
+    PendingShaderVariant variant;
+    variant.features = features;
+    if (library.binaryCache != nullptr)
+    {
+        variant.cacheKey = shaderCacheKey(*library.binaryCache, vertexSource.c_str(), fragmentSource.c_str());
+        GLuint cachedProgram = loadProgramBinary(*library.binaryCache, variant.cacheKey);
+        if (cachedProgram != 0)
+        {
+            library.programs[features].reflect(cachedProgram);
+            return;
+        }
+    }
+
+    const char *text = vertexSource.c_str();
+    variant.vs = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(variant.vs, 1, &text, nullptr);
+    glCompileShader(variant.vs);
+
+    text = fragmentSource.c_str();
+    variant.fs = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(variant.fs, 1, &text, nullptr);
+    glCompileShader(variant.fs);
+
+    variant.program = glCreateProgram();
+    glAttachShader(variant.program, variant.vs);
+    glAttachShader(variant.program, variant.fs);
+    if (library.binaryCache != nullptr)
+        prepareProgramForCache(*library.binaryCache, variant.program);
+    glLinkProgram(variant.program);
+
+    library.pending.push_back(variant);
+    library.compiled++;
+}
+
+// True once the status queries below would no longer block
+bool isShaderVariantComplete(const ShaderLibrary &library, const PendingShaderVariant &variant)
+{
+    if (!library.parallelCompile)
+        return true;
+    GLint complete = GL_FALSE;
+    glGetProgramiv(variant.program, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete != GL_FALSE;
+}
+
+// Checks the results of a finished compile and moves the program into the library, reflecting
+// its uniforms. Failed variants are kept with id 0 so they are only reported once.
+void finishShaderVariant(ShaderLibrary &library, const PendingShaderVariant &variant)
+{
+    GLuint program = variant.program;
+    GLint success = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (success == GL_FALSE)
+    {
+        // The shader logs say more than "link failed" when a stage didn't compile
+        GLint vertexCompiled = GL_FALSE, fragmentCompiled = GL_FALSE;
+        glGetShaderiv(variant.vs, GL_COMPILE_STATUS, &vertexCompiled);
+        glGetShaderiv(variant.fs, GL_COMPILE_STATUS, &fragmentCompiled);
+        if (vertexCompiled == GL_FALSE)
+            reportShaderVariantError("compile vertex shader", variant.vs, false, variant.features);
+        if (fragmentCompiled == GL_FALSE)
+            reportShaderVariantError("compile fragment shader", variant.fs, false, variant.features);
+        if (vertexCompiled != GL_FALSE && fragmentCompiled != GL_FALSE)
+            reportShaderVariantError("link shader program", program, true, variant.features);
+        glDeleteProgram(program);
+        program = 0;
+    }
+    else if (library.binaryCache != nullptr)
+    {
+        storeProgramBinary(*library.binaryCache, variant.cacheKey, program);
+    }
+
+    glDeleteShader(variant.vs);
+    glDeleteShader(variant.fs);
+    library.programs[variant.features].reflect(program);
+}
+
+// Queues a variant for compilation if it isn't already built or on its way
+void requestShaderVariant(ShaderLibrary &library, uint32_t features)
+{
+    features = canonicalShaderFeatures(features);
+    if (library.programs.count(features) != 0)
+        return;
+    for (const PendingShaderVariant &variant : library.pending)
+        if (variant.features == features)
+            return;
+    startShaderVariant(library, features);
+}
+
+// Call once per frame. Picks up the variants the driver has finished, without the parallel
+// compile extension there is no way to ask without blocking, so everything queued is finished.
+void pollShaderVariants(ShaderLibrary &library)
+{
+    for (size_t i = 0; i < library.pending.size();)
+    {
+        if (!isShaderVariantComplete(library, library.pending[i]))
+        {
+            i++;
+            continue;
+        }
+        finishShaderVariant(library, library.pending[i]);
+        library.pending.erase(library.pending.begin() + i);
+    }
+}
+
+// Blocks until this variant is built, the returned program has id 0 if it failed
+ShaderProgram &waitForShaderVariant(ShaderLibrary &library, uint32_t features)
+{
+    features = canonicalShaderFeatures(features);
+    requestShaderVariant(library, features);
+    for (size_t i = 0; i < library.pending.size(); i++)
+    {
+        if (library.pending[i].features == features)
+        {
+            finishShaderVariant(library, library.pending[i]);
+            library.pending.erase(library.pending.begin() + i);
+            break;
+        }
+    }
+    return library.programs[features];
+}
+
+// Returns the program for these features, queueing it on first use. Until it is ready (or if
+// it failed) the placeholder with the same vertex input is returned instead. The
+// reference stays valid for the lifetime of the library.
+ShaderProgram &getShaderVariant(ShaderLibrary &library, uint32_t features)
+{
+    features = canonicalShaderFeatures(features);
+    std::map<uint32_t, ShaderProgram>::iterator found = library.programs.find(features);
+    if (found != library.programs.end() && found->second.id() != 0)
+        return found->second;
+    if (found == library.programs.end())
+        requestShaderVariant(library, features);
+    return *library.placeholders[(features & SHADER_INSTANCED) ? 1 : 0];
+}
+
+// Call once the GL context is current and the layout is set. Only the two placeholders are
+// compiled here, everything else is requested by the caller.
+void initShaderLibrary(ShaderLibrary &library, ShaderCache *binaryCache)
+{
+    library.binaryCache = binaryCache;
+    library.parallelCompile = GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    else if (GLEW_ARB_parallel_shader_compile)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+
+    const uint32_t placeholderFeatures[2] = {SHADER_PLACEHOLDER, SHADER_PLACEHOLDER | SHADER_INSTANCED};
+    for (int i = 0; i < 2; i++)
+        library.placeholders[i] = &waitForShaderVariant(library, placeholderFeatures[i]);
+}
+
+void releaseShaderLibrary(ShaderLibrary &library)
+{
+    // Wait out anything still compiling so its shaders can be deleted
+    for (const PendingShaderVariant &variant : library.pending)
+        finishShaderVariant(library, variant);
+    library.pending.clear();
+
+    for (std::map<uint32_t, ShaderProgram>::iterator it = library.programs.begin(); it != library.programs.end(); ++it)
+        if (it->second.id() != 0)
+            glDeleteProgram(it->second.id());
+    library.programs.clear();
+    library.placeholders[0] = library.placeholders[1] = nullptr;
+}
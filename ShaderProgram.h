@@ -0,0 +1,203 @@
+//
+// Linked program with its uniforms reflected once
+//
+// After linking, every active uniform is read with glGetActiveUniform into a table of slots,
+// and the uniforms of the uber shader are resolved to fixed ShaderUniform ids, so draws never
+// look a location up by name. Uniform blocks the program declares are attached to their fixed
+// ShaderUniformBlock binding points at the same time. Each slot remembers the last value
+// uploaded, and the typed setters skip the glUniform call when the value hasn't changed. GL
+// keeps uniform values per program, so the cache stays valid across glUseProgram switches.
+//
+// Like glUniform*, the setters write to the program in use, call use() first.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "GLStateCache.h"
+
+// Uniforms of the uber shader in ShaderPermutations.h that live outside the uniform blocks,
+// in SHADER_UNIFORM_NAMES order
+enum ShaderUniform
+{
+    UNIFORM_DIFFUSE_TEXTURE,
+    UNIFORM_DIFFUSE_TEXTURE_ARRAY,
+    UNIFORM_COUNT
+};
+
+const char *const SHADER_UNIFORM_NAMES[UNIFORM_COUNT] = {"diffuseTexture", "diffuseTextureArray"};
+
+// Uniform blocks of the uber shader, the value is the binding point (see UniformBuffers.h)
+enum ShaderUniformBlock
+{
+    UNIFORM_BLOCK_FRAME,
+    UNIFORM_BLOCK_OBJECT,
+    UNIFORM_BLOCK_COUNT
+};
+
+const char *const SHADER_UNIFORM_BLOCK_NAMES[UNIFORM_BLOCK_COUNT] = {"FrameUniforms", "ObjectUniforms"};
+
+struct ShaderUniformSlot
+{
+    std::string name;
+    GLint location = -1;
+    GLenum type = 0;
+    GLint size = 0;
+    bool uploaded = false;
+    unsigned char value[16 * sizeof(float)]; // last value sent, large enough for a mat4
+};
+
+class ShaderProgram
+{
+public:
+    ShaderProgram()
+    {
+        reflect(0);
+    }
+
+    explicit ShaderProgram(GLuint program)
+    {
+        reflect(program);
+    }
+
+    // Builds the slot table for a linked program, 0 leaves an empty program that ignores setters
+    void reflect(GLuint program)
+    {
+        programId = program;
+        slots.clear();
+        slotsByName.clear();
+        uploads = 0;
+        skippedUploads = 0;
+
+        GLint activeUniforms = 0, maxNameLength = 0;
+        if (program != 0)
+        {
+            glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &activeUniforms);
+            glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+        }
+
+        std::vector<char> name(maxNameLength > 1 ? maxNameLength : 1);
+        for (GLint i = 0; i < activeUniforms; i++)
+        {
+            ShaderUniformSlot slot;
+            GLsizei length = 0;
+            glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), &length, &slot.size, &slot.type, name.data());
+            slot.name.assign(name.data(), length);
+            slot.location = glGetUniformLocation(program, slot.name.c_str());
+            if (slot.location < 0)
+                continue; // members of uniform blocks have no location
+
+            // Arrays are reported as "name[0]", they're looked up by their plain name
+            size_t bracket = slot.name.find('[');
+            if (bracket != std::string::npos)
+                slot.name.erase(bracket);
+
+            slotsByName[slot.name] = (int)slots.size();
+            slots.push_back(slot);
+        }
+
+        for (int uniform = 0; uniform < UNIFORM_COUNT; uniform++)
+            uniformSlots[uniform] = find(SHADER_UNIFORM_NAMES[uniform]);
+
+        // GLSL 3.30 has no layout(binding = ...), so blocks are bound here
+        for (int block = 0; block < UNIFORM_BLOCK_COUNT && program != 0; block++)
+        {
+            GLuint blockIndex = glGetUniformBlockIndex(program, SHADER_UNIFORM_BLOCK_NAMES[block]);
+            if (blockIndex != GL_INVALID_INDEX)
+                glUniformBlockBinding(program, blockIndex, (GLuint)block);
+        }
+    }
+
+    GLuint id() const
+    {
+        return programId;
+    }
+
+    void use() const
+    {
+        cachedUseProgram(glState, programId);
+    }
+
+    // Slot for any active uniform by name, -1 if the program doesn't use it. Resolve once,
+    // not per draw.
+    int find(const char *name) const
+    {
+        std::unordered_map<std::string, int>::const_iterator found = slotsByName.find(name);
+        return found != slotsByName.end() ? found->second : -1;
+    }
+
+    int slot(ShaderUniform uniform) const
+    {
+        return uniformSlots[uniform];
+    }
+
+    void setInt(int slot, GLint value)
+    {
+        if (changed(slot, &value, sizeof(value)))
+            glUniform1i(slots[slot].location, value);
+    }
+
+    void setFloat(int slot, float value)
+    {
+        if (changed(slot, &value, sizeof(value)))
+            glUniform1f(slots[slot].location, value);
+    }
+
+    void setVec3(int slot, const glm::vec3 &value)
+    {
+        if (changed(slot, &value[0], sizeof(float) * 3))
+            glUniform3fv(slots[slot].location, 1, &value[0]);
+    }
+
+    void setMat3(int slot, const glm::mat3 &value)
+    {
+        if (changed(slot, &value[0][0], sizeof(float) * 9))
+            glUniformMatrix3fv(slots[slot].location, 1, GL_FALSE, &value[0][0]);
+    }
+
+    void setMat4(int slot, const glm::mat4 &value)
+    {
+        if (changed(slot, &value[0][0], sizeof(float) * 16))
+            glUniformMatrix4fv(slots[slot].location, 1, GL_FALSE, &value[0][0]);
+    }
+
+    void setInt(ShaderUniform uniform, GLint value) { setInt(uniformSlots[uniform], value); }
+    void setFloat(ShaderUniform uniform, float value) { setFloat(uniformSlots[uniform], value); }
+    void setVec3(ShaderUniform uniform, const glm::vec3 &value) { setVec3(uniformSlots[uniform], value); }
+    void setMat3(ShaderUniform uniform, const glm::mat3 &value) { setMat3(uniformSlots[uniform], value); }
+    void setMat4(ShaderUniform uniform, const glm::mat4 &value) { setMat4(uniformSlots[uniform], value); }
+
+    // Uniform calls made and skipped since reflect()
+    int uploads;
+    int skippedUploads;
+
+private:
+    // Records the new value and returns true if it needs to be sent
+    bool changed(int slot, const void *value, size_t bytes)
+    {
+        if (slot < 0)
+            return false;
+        ShaderUniformSlot &uniform = slots[slot];
+        if (uniform.uploaded && memcmp(uniform.value, value, bytes) == 0)
+        {
+            skippedUploads++;
+            return false;
+        }
+        memcpy(uniform.value, value, bytes);
+        uniform.uploaded = true;
+        uploads++;
+        return true;
+    }
+
+    GLuint programId;
+    std::vector<ShaderUniformSlot> slots;
+    std::unordered_map<std::string, int> slotsByName;
+    int uniformSlots[UNIFORM_COUNT];
+};
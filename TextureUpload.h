@@ -0,0 +1,363 @@
+//
+// Texture upload ring - streams pixel data to the GPU through pixel buffer objects
+//
+// Instead of handing glTexImage2D a pointer to client memory (which makes the driver copy
+// the whole image before the call returns), pixels are written into a staging buffer that
+// stays mapped, and the texture is filled with glTexSubImage2D from an offset into that
+// buffer. The copy then happens asynchronously on the GPU side. Each upload is followed by a
+// fence, and a region of the ring is only handed out again once its fence has signalled.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include "ImageDecoder.h"
+
+// Part of the ring that is still being read by the GL
+struct TextureUploadRegion
+{
+    GLsizeiptr begin;
+    GLsizeiptr end;
+    GLsync fence;
+};
+
+struct TextureUploadRing
+{
+    GLuint buffer = 0;
+    GLsizeiptr capacity = 0;
+    GLsizeiptr head = 0;
+    unsigned char *persistentData = nullptr; // Only set when GL_ARB_buffer_storage is available
+    std::deque<TextureUploadRegion> inFlight;
+};
+
+// Staging memory handed out by beginTextureUpload, the caller writes the pixels into data
+struct TextureUploadSlot
+{
+    unsigned char *data = nullptr;
+    GLsizeiptr offset = 0;
+    GLsizeiptr size = 0;
+};
+
+const GLsizeiptr TEXTURE_UPLOAD_ALIGNMENT = 256;
+
+inline bool textureUploadRingSupported()
+{
+    // All three are core in 3.2, where drivers need not list the extensions
+    return GLEW_VERSION_3_2 || (GLEW_ARB_pixel_buffer_object && GLEW_ARB_map_buffer_range && GLEW_ARB_sync);
+}
+
+bool createTextureUploadRing(TextureUploadRing &ring, GLsizeiptr capacity)
+{
+    if (!textureUploadRingSupported())
+    {
+        std::cerr << "PBO texture uploads not supported, falling back to glTexImage2D" << std::endl;
+        return false;
+    }
+
+    ring.capacity = capacity;
+    ring.head = 0;
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+    {
+        // Map once for the lifetime of the ring, the fences take care of synchronisation
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, capacity, nullptr, flags);
+        ring.persistentData = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, capacity, flags);
+    }
+    else
+    {
+        // GL 3.x: map each slot unsynchronized on demand
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return true;
+}
+
+void destroyTextureUploadRing(TextureUploadRing &ring)
+{
+    if (ring.buffer == 0)
+        return;
+
+    for (const TextureUploadRegion &region : ring.inFlight)
+    {
+        glClientWaitSync(region.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(region.fence);
+    }
+    ring.inFlight.clear();
+
+    if (ring.persistentData != nullptr)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        ring.persistentData = nullptr;
+    }
+
+    glDeleteBuffers(1, &ring.buffer);
+    ring.buffer = 0;
+}
+
+// Wait until [begin, end) is no longer read by any pending upload.
+// Fences signal in submission order, so waiting on the newest overlapping region retires
+// every region submitted before it as well.
+void retireTextureUploadRegions(TextureUploadRing &ring, GLsizeiptr begin, GLsizeiptr end)
+{
+    int newestOverlap = -1;
+    for (int i = 0; i < (int)ring.inFlight.size(); i++)
+    {
+        const TextureUploadRegion &region = ring.inFlight[i];
+        if (region.begin < end && begin < region.end)
+            newestOverlap = i;
+    }
+
+    if (newestOverlap >= 0)
+        glClientWaitSync(ring.inFlight[newestOverlap].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+
+    // Drop everything that is known to be finished
+    while (!ring.inFlight.empty())
+    {
+        TextureUploadRegion &front = ring.inFlight.front();
+        bool done = newestOverlap >= 0 || glClientWaitSync(front.fence, 0, 0) != GL_TIMEOUT_EXPIRED;
+        if (!done)
+            break;
+        glDeleteSync(front.fence);
+        ring.inFlight.pop_front();
+        newestOverlap--;
+    }
+}
+
+// Reserve size bytes of staging memory. Returns false if the ring is unavailable or the
+// request is larger than the ring, in which case the caller uploads from client memory.
+bool beginTextureUpload(TextureUploadRing &ring, GLsizeiptr size, TextureUploadSlot &slot)
+{
+    if (ring.buffer == 0 || size > ring.capacity)
+        return false;
+
+    GLsizeiptr begin = ring.head;
+    if (begin + size > ring.capacity)
+        begin = 0; // Wrap around, uploads are never split
+
+    retireTextureUploadRegions(ring, begin, begin + size);
+
+    slot.offset = begin;
+    slot.size = size;
+    if (ring.persistentData != nullptr)
+    {
+        slot.data = ring.persistentData + begin;
+    }
+    else
+    {
+        // The fences guarantee nobody is reading this range, so skip the driver's implicit sync
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+        slot.data = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, begin, size,
+                                                      GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (slot.data == nullptr)
+            return false;
+    }
+
+    ring.head = (begin + size + TEXTURE_UPLOAD_ALIGNMENT - 1) / TEXTURE_UPLOAD_ALIGNMENT * TEXTURE_UPLOAD_ALIGNMENT;
+    return true;
+}
+
+// Copy the slot into level 0 of the texture currently bound to GL_TEXTURE_2D, or into one layer
+// of the texture bound to GL_TEXTURE_2D_ARRAY when layer isn't negative.
+// The call returns as soon as the copy is queued, a fence marks when the slot can be reused.
+void endTextureUpload(TextureUploadRing &ring, const TextureUploadSlot &slot, int width, int height, GLenum format, int layer = -1)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+    if (ring.persistentData == nullptr)
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (layer < 0)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, (const void *)(size_t)slot.offset);
+    else
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, format, GL_UNSIGNED_BYTE, (const void *)(size_t)slot.offset);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    TextureUploadRegion region;
+    region.begin = slot.offset;
+    region.end = slot.offset + slot.size;
+    region.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring.inFlight.push_back(region);
+}
+
+// Gives a slot back unused, when writing it failed. Nothing is uploaded from it.
+void cancelTextureUpload(TextureUploadRing &ring, const TextureUploadSlot &slot)
+{
+    if (ring.persistentData == nullptr)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    // It was the last slot handed out, the next one can start where it did
+    ring.head = slot.offset;
+}
+
+inline GLenum formatForChannels(int channels)
+{
+    if (channels == 1)
+        return GL_RED;
+    if (channels == 4)
+        return GL_RGBA;
+    return GL_RGB;
+}
+
+inline int channelsForFormat(GLenum format)
+{
+    if (format == GL_RED)
+        return 1;
+    if (format == GL_RGBA)
+        return 4;
+    return 3;
+}
+
+// Allocate storage for the texture bound to GL_TEXTURE_2D and fill it with pixels, going
+// through the ring when possible and falling back to a plain glTexImage2D otherwise.
+void uploadTexture2D(TextureUploadRing &ring, int width, int height, GLenum format, const unsigned char *pixels)
+{
+    GLsizeiptr size = (GLsizeiptr)width * height * channelsForFormat(format);
+
+    TextureUploadSlot slot;
+    if (!beginTextureUpload(ring, size, slot))
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+        return;
+    }
+
+    // Allocate only, no client memory is read here
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, nullptr);
+    memcpy(slot.data, pixels, size);
+    endTextureUpload(ring, slot, width, height, format);
+}
+
+// Fill one layer of the texture bound to GL_TEXTURE_2D_ARRAY, whose storage must already be
+// allocated with glTexImage3D
+void uploadTextureLayer(TextureUploadRing &ring, int width, int height, GLenum format, int layer, const unsigned char *pixels)
+{
+    GLsizeiptr size = (GLsizeiptr)width * height * channelsForFormat(format);
+
+    TextureUploadSlot slot;
+    if (!beginTextureUpload(ring, size, slot))
+    {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, format, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        return;
+    }
+
+    memcpy(slot.data, pixels, size);
+    endTextureUpload(ring, slot, width, height, format, layer);
+}
+
+// Picks the decoder for an encoded image and reads its output size, or returns null
+ImageDecoder *probeImage(const unsigned char *data, size_t size, const ImageDecodeRequest &request, ImageInfo &info)
+{
+    ImageDecoder *decoder = findImageDecoder(data, size);
+    if (decoder->getInfo(data, size, request, info))
+        return decoder;
+
+    // The fast path may reject files it does not support, stb_image handles everything
+    static StbImageDecoder fallbackDecoder;
+    if (fallbackDecoder.getInfo(data, size, request, info))
+        return &fallbackDecoder;
+    return nullptr;
+}
+
+// Decode an encoded image (JPEG, PNG, ...) into the texture bound to GL_TEXTURE_2D.
+// The decoder writes straight into a ring slot, so the pixels are never staged in client memory.
+bool decodeTexture2D(TextureUploadRing &ring, const unsigned char *data, size_t size, const ImageDecodeRequest &request, ImageInfo &info)
+{
+    ImageDecoder *decoder = probeImage(data, size, request, info);
+    if (decoder == nullptr)
+        return false;
+
+    GLenum format = formatForChannels(info.channels);
+    GLsizeiptr byteCount = (GLsizeiptr)info.width * info.height * info.channels;
+
+    TextureUploadSlot slot;
+    if (beginTextureUpload(ring, byteCount, slot))
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, format, info.width, info.height, 0, format, GL_UNSIGNED_BYTE, nullptr);
+        if (!decoder->decode(data, size, request, info, slot.data))
+        {
+            cancelTextureUpload(ring, slot);
+            return false;
+        }
+        endTextureUpload(ring, slot, info.width, info.height, format);
+        return true;
+    }
+
+    std::vector<unsigned char> pixels(byteCount);
+    if (!decoder->decode(data, size, request, info, pixels.data()))
+        return false;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, info.width, info.height, 0, format, GL_UNSIGNED_BYTE, pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return true;
+}
+
+// Decode count images into the layers of the texture bound to GL_TEXTURE_2D_ARRAY, allocating
+// it at the size of the first image. All layers share one format, so request.desiredChannels
+// defaults to 3 here. Images of a different size, or that fail to decode, are reported and
+// their layer left empty.
+bool decodeTextureArray(TextureUploadRing &ring, const unsigned char *const *data, const size_t *sizes, int count,
+                        ImageDecodeRequest request, ImageInfo &info)
+{
+    if (request.desiredChannels == 0)
+        request.desiredChannels = 3;
+    if (count <= 0 || probeImage(data[0], sizes[0], request, info) == nullptr)
+        return false;
+
+    GLenum format = formatForChannels(info.channels);
+    GLsizeiptr byteCount = (GLsizeiptr)info.width * info.height * info.channels;
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, info.width, info.height, count, 0, format, GL_UNSIGNED_BYTE, nullptr);
+
+    std::vector<unsigned char> pixels;
+    for (int layer = 0; layer < count; layer++)
+    {
+        ImageInfo layerInfo;
+        ImageDecoder *decoder = probeImage(data[layer], sizes[layer], request, layerInfo);
+        if (decoder == nullptr || layerInfo.width != info.width || layerInfo.height != info.height)
+        {
+            std::cerr << "Texture array layer " << layer << " is missing or not " << info.width << "x" << info.height << std::endl;
+            continue;
+        }
+
+        TextureUploadSlot slot;
+        if (beginTextureUpload(ring, byteCount, slot))
+        {
+            if (decoder->decode(data[layer], sizes[layer], request, layerInfo, slot.data))
+                endTextureUpload(ring, slot, info.width, info.height, format, layer);
+            else
+            {
+                std::cerr << "Texture array layer " << layer << " could not be decoded" << std::endl;
+                cancelTextureUpload(ring, slot);
+            }
+            continue;
+        }
+
+        pixels.resize(byteCount);
+        if (!decoder->decode(data[layer], sizes[layer], request, layerInfo, pixels.data()))
+        {
+            std::cerr << "Texture array layer " << layer << " could not be decoded" << std::endl;
+            continue;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, info.width, info.height, 1, format, GL_UNSIGNED_BYTE, pixels.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+    return true;
+}
@@ -0,0 +1,163 @@
+//
+// Uniform buffers for per-frame and per-object shader data
+//
+// FrameUniforms (view, projection, light, camera) is written once per frame into a std140
+// buffer that stays bound to UNIFORM_BLOCK_FRAME, so every program sees it without any
+// glUniform calls or program switches. ObjectUniforms for all of the frame's draws are
+// collected on the CPU and uploaded in one go, each draw then only binds its own range of the
+// buffer to UNIFORM_BLOCK_OBJECT. The structs mirror the blocks in ShaderPermutations.h.
+//
+// Both are streamed through the dynamic buffer ring when there is one, with a memcpy into the
+// frame's region. The buffers below are only written when the ring is missing or full.
+//
+
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <cstring>
+#include <vector>
+
+#include "DynamicBufferRing.h"
+#include "Profiler.h"
+#include "ShaderProgram.h"
+
+// std140: mat4 is four vec4 columns, vec3 is padded to a vec4
+struct FrameUniforms
+{
+    glm::mat4 viewMatrix;
+    glm::mat4 projectionMatrix;
+    glm::vec4 lightPos;
+    glm::vec4 lightColor;
+    glm::vec4 viewPos;
+};
+
+// std140: a mat3 takes three vec4 columns
+struct ObjectUniforms
+{
+    glm::mat4 worldMatrix;
+    glm::vec4 normalMatrix[3];
+    glm::vec4 objectColor;
+};
+
+static_assert(sizeof(FrameUniforms) == 176, "FrameUniforms must match the std140 block layout");
+static_assert(sizeof(ObjectUniforms) == 128, "ObjectUniforms must match the std140 block layout");
+
+struct UniformBuffers
+{
+    GLuint frameBuffer = 0;
+    GLuint objectBuffer = 0;
+    GLsizeiptr objectStride = 0;   // sizeof(ObjectUniforms) rounded up to the offset alignment
+    int objectCapacity = 0;        // objects the GL buffer currently has room for
+    int objectCount = 0;           // objects added this frame
+    std::vector<unsigned char> objectStaging;
+
+    // Where this frame's objects were uploaded, the ring or objectBuffer
+    GLuint objectSource = 0;
+    GLintptr objectOffset = 0;
+};
+
+inline ObjectUniforms makeObjectUniforms(const glm::mat4 &worldMatrix, const glm::mat3 &normalMatrix, const glm::vec3 &color)
+{
+    ObjectUniforms object;
+    object.worldMatrix = worldMatrix;
+    for (int column = 0; column < 3; column++)
+        object.normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+    object.objectColor = glm::vec4(color, 1.0f);
+    return object;
+}
+
+// Needs a GL 3.1 context (or ARB_uniform_buffer_object), which both programs already require
+void createUniformBuffers(UniformBuffers &buffers, int initialObjectCapacity)
+{
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    buffers.objectStride = ((GLsizeiptr)sizeof(ObjectUniforms) + alignment - 1) / alignment * alignment;
+
+    glGenBuffers(1, &buffers.frameBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffers.frameBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BLOCK_FRAME, buffers.frameBuffer);
+
+    buffers.objectCapacity = initialObjectCapacity > 0 ? initialObjectCapacity : 1;
+    glGenBuffers(1, &buffers.objectBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffers.objectBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, buffers.objectStride * buffers.objectCapacity, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void destroyUniformBuffers(UniformBuffers &buffers)
+{
+    glDeleteBuffers(1, &buffers.frameBuffer);
+    glDeleteBuffers(1, &buffers.objectBuffer);
+    buffers.frameBuffer = 0;
+    buffers.objectBuffer = 0;
+}
+
+// Once per frame, before any draw
+void updateFrameUniforms(UniformBuffers &buffers, const FrameUniforms &frame)
+{
+    PROFILE_SCOPE("Upload frame uniforms");
+    DynamicAllocation allocation;
+    if (allocateDynamicBuffer(dynamicBufferRing, sizeof(FrameUniforms), allocation))
+    {
+        memcpy(allocation.data, &frame, sizeof(FrameUniforms));
+        commitDynamicBuffer(dynamicBufferRing, allocation);
+        cachedBindBufferRange(glState, UNIFORM_BLOCK_FRAME, dynamicBufferRing.buffer, allocation.offset, sizeof(FrameUniforms));
+        return;
+    }
+    cachedBindBufferRange(glState, UNIFORM_BLOCK_FRAME, buffers.frameBuffer, 0, 0);
+    cachedBindBuffer(glState, GL_UNIFORM_BUFFER, buffers.frameBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+}
+
+void beginObjectUniforms(UniformBuffers &buffers)
+{
+    buffers.objectCount = 0;
+}
+
+// Returns the index to pass to bindObjectUniforms once uploadObjectUniforms has been called
+int addObjectUniforms(UniformBuffers &buffers, const ObjectUniforms &object)
+{
+    size_t offset = (size_t)buffers.objectCount * buffers.objectStride;
+    if (buffers.objectStaging.size() < offset + buffers.objectStride)
+        buffers.objectStaging.resize(offset + buffers.objectStride);
+    memcpy(buffers.objectStaging.data() + offset, &object, sizeof(object));
+    return buffers.objectCount++;
+}
+
+// Sends every object added this frame in one copy. Without room in the ring the old contents
+// of objectBuffer are orphaned, so the driver doesn't wait for last frame's draws to finish
+// reading them.
+void uploadObjectUniforms(UniformBuffers &buffers)
+{
+    if (buffers.objectCount == 0)
+        return;
+    PROFILE_SCOPE("Upload object uniforms");
+
+    GLsizeiptr size = buffers.objectStride * buffers.objectCount;
+    DynamicAllocation allocation;
+    if (allocateDynamicBuffer(dynamicBufferRing, size, allocation))
+    {
+        memcpy(allocation.data, buffers.objectStaging.data(), size);
+        commitDynamicBuffer(dynamicBufferRing, allocation);
+        buffers.objectSource = dynamicBufferRing.buffer;
+        buffers.objectOffset = allocation.offset;
+        return;
+    }
+
+    buffers.objectSource = buffers.objectBuffer;
+    buffers.objectOffset = 0;
+    cachedBindBuffer(glState, GL_UNIFORM_BUFFER, buffers.objectBuffer);
+    while (buffers.objectCapacity < buffers.objectCount)
+        buffers.objectCapacity *= 2;
+    glBufferData(GL_UNIFORM_BUFFER, buffers.objectStride * buffers.objectCapacity, nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, buffers.objectStride * buffers.objectCount, buffers.objectStaging.data());
+}
+
+void bindObjectUniforms(const UniformBuffers &buffers, int index)
+{
+    cachedBindBufferRange(glState, UNIFORM_BLOCK_OBJECT, buffers.objectSource,
+                          buffers.objectOffset + buffers.objectStride * index, sizeof(ObjectUniforms));
+}
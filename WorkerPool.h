@@ -0,0 +1,144 @@
+//
+// Worker pool - threads kept for the whole run and woken for each parallel job
+//
+// runParallelJobs(pool, count, work) runs work(index, count) for every index, on the calling
+// thread and the pool's workers together, and returns once all of them are done, so every
+// call is a barrier. Starting and joining a std::thread costs tens of microseconds, which in
+// the middle of a frame is often more than the job itself. The workers here sleep on a
+// condition variable between jobs instead, waking one is a fraction of that.
+//
+// Jobs are handed out one index at a time, whoever is free first takes the next. The calling
+// thread takes part, so a pool that was never started (or a count of 1) simply runs
+// everything in order on the caller. Only one thread may call runParallelJobs at a time, the
+// render loop's.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Profiler.h"
+
+const int WORKER_POOL_MAX_THREADS = 16;
+
+struct WorkerPool
+{
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake; // a job was posted, or the pool is stopping
+    std::condition_variable done; // the last index of the job finished
+
+    // The job in progress, guarded by mutex
+    void (*invoke)(const void *work, int index, int count) = nullptr;
+    const void *work = nullptr;
+    int jobCount = 0;
+    int nextJob = 0;
+    int finishedJobs = 0;
+    bool stopping = false;
+
+    ~WorkerPool();
+};
+
+WorkerPool workerPool;
+
+// Threads that run jobs, the caller included
+inline int workerPoolThreads(const WorkerPool &pool)
+{
+    return (int)pool.workers.size() + 1;
+}
+
+// Takes indices of the current job until there are none left. Called with the lock held, and
+// returns with it held.
+inline void runWorkerPoolJobs(WorkerPool &pool, std::unique_lock<std::mutex> &lock)
+{
+    while (pool.nextJob < pool.jobCount)
+    {
+        int index = pool.nextJob++;
+        int count = pool.jobCount;
+        void (*invoke)(const void *, int, int) = pool.invoke;
+        const void *work = pool.work;
+        lock.unlock();
+        invoke(work, index, count);
+        lock.lock();
+        if (++pool.finishedJobs == count)
+            pool.done.notify_one();
+    }
+}
+
+void workerPoolThread(WorkerPool *pool, int index)
+{
+    std::string name = "Worker " + std::to_string(index);
+    setProfilerThreadName(name.c_str());
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while (true)
+    {
+        pool->wake.wait(lock, [pool] { return pool->stopping || pool->nextJob < pool->jobCount; });
+        if (pool->stopping)
+            return;
+        runWorkerPoolJobs(*pool, lock);
+    }
+}
+
+// threadCount 0 uses every core. The caller counts as one of the threads.
+void startWorkerPool(WorkerPool &pool, int threadCount = 0)
+{
+    if (threadCount <= 0)
+        threadCount = (int)std::thread::hardware_concurrency();
+    threadCount = std::min(std::max(threadCount, 1), WORKER_POOL_MAX_THREADS);
+    for (int i = 1; i < threadCount; i++)
+        pool.workers.push_back(std::thread(workerPoolThread, &pool, i));
+}
+
+void stopWorkerPool(WorkerPool &pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (std::thread &worker : pool.workers)
+        worker.join();
+    pool.workers.clear();
+    pool.stopping = false;
+}
+
+// Joins the workers of a program that returned without stopping the pool
+WorkerPool::~WorkerPool()
+{
+    stopWorkerPool(*this);
+}
+
+template <typename Work>
+void invokeParallelJob(const void *work, int index, int count)
+{
+    (*(const Work *)work)(index, count);
+}
+
+// Runs work(index, count) for index 0..count-1 and returns when all of them have finished
+template <typename Work>
+void runParallelJobs(WorkerPool &pool, int count, const Work &work)
+{
+    if (count <= 1 || pool.workers.empty())
+    {
+        for (int i = 0; i < count; i++)
+            work(i, count);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.invoke = invokeParallelJob<Work>;
+    pool.work = &work;
+    pool.jobCount = count;
+    pool.nextJob = 0;
+    pool.finishedJobs = 0;
+    pool.wake.notify_all();
+    runWorkerPoolJobs(pool, lock);
+    pool.done.wait(lock, [&pool, count] { return pool.finishedJobs == count; });
+    pool.jobCount = 0;
+    pool.nextJob = 0;
+}
@@ -0,0 +1,140 @@
+//
+// Image decode benchmark - compares the decoder backends from ImageDecoder.h per file
+//
+// Build:  g++ -O2 -std=c++11 decodeBenchmark.cpp -o decodeBenchmark -DUSE_LIBJPEG_TURBO -ljpeg
+// Usage:  ./decodeBenchmark [-n iterations] [-s maxSize] [files...]
+//
+// Without files it decodes the planet textures. With -s the images are also decoded at the
+// reduced size, which shows what DCT scaling saves over decoding at full size.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb/stb_image.h>
+
+#include "ContentHash.h"
+#include "ImageDecoder.h"
+
+using namespace std;
+
+// Best time in milliseconds over a number of runs, or a negative value if decoding failed
+double timeDecode(ImageDecoder &decoder, const vector<unsigned char> &contents, const ImageDecodeRequest &request, int iterations, ImageInfo &info)
+{
+    if (!decoder.canDecode(contents.data(), contents.size()) || !decoder.getInfo(contents.data(), contents.size(), request, info))
+        return -1.0;
+
+    vector<unsigned char> pixels((size_t)info.width * info.height * info.channels);
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++)
+    {
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        if (!decoder.decode(contents.data(), contents.size(), request, info, pixels.data()))
+            return -1.0;
+        chrono::duration<double, milli> elapsed = chrono::high_resolution_clock::now() - start;
+        if (elapsed.count() < best)
+            best = elapsed.count();
+    }
+    return best;
+}
+
+void printTime(double ms)
+{
+    if (ms < 0.0)
+        printf("  %12s", "n/a");
+    else
+        printf("  %9.2f ms", ms);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 5;
+    int maxSize = 0;
+    vector<string> files;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            maxSize = atoi(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.empty())
+    {
+        const char *planets[] = {"sun", "mercury", "venus", "earth", "mars", "jupiter", "saturn", "uranus", "neptune"};
+        for (const char *planet : planets)
+            files.push_back(string("Textures/") + planet + ".jpg");
+    }
+
+    vector<ImageDecoder *> decoders;
+    decoders.push_back(new StbImageDecoder());
+#ifdef USE_LIBJPEG_TURBO
+    decoders.push_back(new LibjpegTurboDecoder());
+#else
+    printf("built without USE_LIBJPEG_TURBO, only stb_image is measured\n");
+#endif
+
+    printf("%-28s %11s", "file", "size");
+    for (ImageDecoder *decoder : decoders)
+        printf("  %12s", decoder->name());
+    if (maxSize > 0)
+        for (ImageDecoder *decoder : decoders)
+            printf("  %8s@%-4d", decoder->name(), maxSize);
+    printf("\n");
+
+    vector<double> totals(decoders.size() * 2, 0.0);
+    for (const string &file : files)
+    {
+        vector<unsigned char> contents;
+        if (!readFileContents(file.c_str(), contents))
+        {
+            printf("%-28s could not be read\n", file.c_str());
+            continue;
+        }
+
+        ImageDecodeRequest fullRequest;
+        ImageInfo info;
+        timeDecode(*decoders[0], contents, fullRequest, 1, info);
+        printf("%-28s %5dx%-5d", file.c_str(), info.width, info.height);
+
+        for (size_t d = 0; d < decoders.size(); d++)
+        {
+            double ms = timeDecode(*decoders[d], contents, fullRequest, iterations, info);
+            totals[d] += ms > 0.0 ? ms : 0.0;
+            printTime(ms);
+        }
+
+        if (maxSize > 0)
+        {
+            ImageDecodeRequest scaledRequest;
+            scaledRequest.maxWidth = maxSize;
+            scaledRequest.maxHeight = maxSize;
+            for (size_t d = 0; d < decoders.size(); d++)
+            {
+                double ms = timeDecode(*decoders[d], contents, scaledRequest, iterations, info);
+                totals[decoders.size() + d] += ms > 0.0 ? ms : 0.0;
+                printTime(ms);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("%-28s %11s", "total", "");
+    for (size_t d = 0; d < decoders.size(); d++)
+        printTime(totals[d]);
+    if (maxSize > 0)
+        for (size_t d = 0; d < decoders.size(); d++)
+            printTime(totals[decoders.size() + d]);
+    printf("\n");
+
+    for (ImageDecoder *decoder : decoders)
+        delete decoder;
+    return 0;
+}
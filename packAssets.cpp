@@ -0,0 +1,173 @@
+//
+// Asset pack tool - builds the archive read by AssetPack.h
+//
+// Build:  g++ -O2 -std=c++17 packAssets.cpp -o packAssets
+// Usage:  ./packAssets [-o assets.pack] [--store] [directories...]
+//
+// Without directories it packs Models/ and Textures/ from the working directory. Paths are
+// recorded relative to the working directory, so "Textures/sun.jpg" is looked up exactly
+// as the programs name it. Entries that shrink by at least an eighth are LZ4 compressed,
+// the rest (JPEGs, mostly) are stored so they can be used straight from the mapping.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "AssetPack.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+struct PendingEntry
+{
+    string path;
+    vector<unsigned char> contents;
+};
+
+bool shouldPack(const fs::path &path)
+{
+    string name = path.filename().string();
+    // Skip Finder metadata and the alternate data stream leftovers copied from Windows
+    return name != ".DS_Store" && name.find("Zone.Identifier") == string::npos;
+}
+
+void writePadding(FILE *out, uint64_t &offset, uint64_t alignment)
+{
+    static const unsigned char zeros[ASSET_PACK_ALIGNMENT] = {};
+    uint64_t padding = (alignment - offset % alignment) % alignment;
+    fwrite(zeros, 1, (size_t)padding, out);
+    offset += padding;
+}
+
+int main(int argc, char *argv[])
+{
+    string outputPath = "assets.pack";
+    bool compress = true;
+    vector<string> directories;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (strcmp(argv[i], "--store") == 0)
+            compress = false;
+        else
+            directories.push_back(argv[i]);
+    }
+    if (directories.empty())
+    {
+        directories.push_back("Models");
+        directories.push_back("Textures");
+    }
+
+    vector<PendingEntry> pending;
+    for (const string &directory : directories)
+    {
+        if (!fs::is_directory(directory))
+        {
+            fprintf(stderr, "Not a directory: %s\n", directory.c_str());
+            return 1;
+        }
+        for (const fs::directory_entry &file : fs::recursive_directory_iterator(directory))
+        {
+            if (!file.is_regular_file() || !shouldPack(file.path()))
+                continue;
+            PendingEntry entry;
+            entry.path = normalizeAssetPath(file.path().generic_string().c_str());
+            if (!readFileContents(file.path().string().c_str(), entry.contents))
+            {
+                fprintf(stderr, "Could not read %s\n", entry.path.c_str());
+                return 1;
+            }
+            pending.push_back(entry);
+        }
+    }
+
+    // Sorted so the pack is reproducible and related files end up next to each other
+    sort(pending.begin(), pending.end(), [](const PendingEntry &a, const PendingEntry &b) { return a.path < b.path; });
+
+    FILE *out = fopen(outputPath.c_str(), "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Could not create %s\n", outputPath.c_str());
+        return 1;
+    }
+
+    AssetPackHeader header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+    uint64_t offset = sizeof(header);
+
+    vector<AssetPackEntry> entries;
+    string names;
+    uint64_t totalSize = 0;
+    vector<unsigned char> compressed;
+    for (const PendingEntry &pendingEntry : pending)
+    {
+        writePadding(out, offset, ASSET_PACK_ALIGNMENT);
+
+        AssetPackEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.pathHash = hashAssetPath(pendingEntry.path);
+        entry.offset = offset;
+        entry.size = pendingEntry.contents.size();
+        entry.nameOffset = (uint32_t)names.size();
+        entry.nameLength = (uint32_t)pendingEntry.path.size();
+        names += pendingEntry.path;
+
+        for (const AssetPackEntry &existing : entries)
+        {
+            if (existing.pathHash == entry.pathHash)
+            {
+                fprintf(stderr, "Path hash collision on %s\n", pendingEntry.path.c_str());
+                fclose(out);
+                return 1;
+            }
+        }
+
+        const unsigned char *data = pendingEntry.contents.data();
+        entry.storedSize = entry.size;
+        if (compress && entry.size > 0)
+        {
+            lz4Compress(data, (size_t)entry.size, compressed);
+            if (compressed.size() <= entry.size - entry.size / 8)
+            {
+                entry.flags |= ASSET_PACK_COMPRESSED;
+                entry.storedSize = compressed.size();
+                data = compressed.data();
+            }
+        }
+
+        fwrite(data, 1, (size_t)entry.storedSize, out);
+        offset += entry.storedSize;
+        totalSize += entry.size;
+        entries.push_back(entry);
+
+        printf("%-36s %10llu -> %10llu %s\n", pendingEntry.path.c_str(), (unsigned long long)entry.size,
+               (unsigned long long)entry.storedSize, (entry.flags & ASSET_PACK_COMPRESSED) ? "lz4" : "stored");
+    }
+
+    writePadding(out, offset, ASSET_PACK_ALIGNMENT);
+    header.indexOffset = offset;
+    fwrite(entries.data(), sizeof(AssetPackEntry), entries.size(), out);
+    offset += entries.size() * sizeof(AssetPackEntry);
+
+    header.namesOffset = offset;
+    header.namesSize = names.size();
+    fwrite(names.data(), 1, names.size(), out);
+    offset += names.size();
+
+    memcpy(header.magic, ASSET_PACK_MAGIC, sizeof(header.magic));
+    header.version = ASSET_PACK_VERSION;
+    header.entryCount = (uint32_t)entries.size();
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    fclose(out);
+
+    printf("%s: %zu entries, %llu bytes of assets in %llu bytes\n", outputPath.c_str(), entries.size(),
+           (unsigned long long)totalSize, (unsigned long long)offset);
+    return 0;
+}
@@ -3,21 +3,86 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
+#include <cassert>
 #include <iostream>
 #include <vector>
 
-GLuint loadTexture(const char *filename)
+#include "TextureUpload.h"
+#include "AssetCache.h"
+#include "AssetPack.h"
+#include "ShaderCache.h"
+#include "ShaderPermutations.h"
+#include "UniformBuffers.h"
+#include "MultiDrawRenderer.h"
+#include "FrustumCulling.h"
+#include "OcclusionCulling.h"
+#include "RenderContext.h"
+#include "FrameBenchmark.h"
+#include "Profiler.h"
+#include "WorkerPool.h"
+#include "DepthPrepass.h"
+#include "FramePacing.h"
+#include "CommandList.h"
+#include "FixedTimestep.h"
+
+// The window, or the offscreen framebuffer with -headless
+RenderContext renderContext;
+
+// Frame times over a replayed input path, with -benchmark
+FrameBenchmark frameBenchmark;
+
+// Depth pre-pass and front-to-back ordering settings, with -prepass and -unsorted
+DepthPrepass depthPrepass;
+
+// Frames in flight and the target frame time, with -framesinflight and -fps
+FramePacer framePacer;
+
+// Threads that record the frame's draws, with -recordthreads
+CommandRecorder commandRecorder;
+
+// Steps the arm at a fixed rate, with -simrate
+FixedTimestep simulation;
+
+// Staging ring for texture uploads, created once the GL context exists
+TextureUploadRing textureUploadRing;
+
+// Textures keyed by content, so identical images are only uploaded once
+AssetCache assetCache;
+
+// Packed Models/ and Textures/, loose files are used when it is missing
+AssetPack assetPack;
+
+// Linked program binaries from previous runs
+ShaderCache shaderCache;
+
+// Variants of the shared uber shader, compiled as they are first requested
+ShaderLibrary shaderLibrary;
+
+// Per-frame and per-object uniform blocks shared by every program
+UniformBuffers uniformBuffers;
+
+// All static geometry in shared buffers, drawn with one indirect call per frame
+MultiDrawRenderer multiDrawRenderer;
+
+// maxSize limits the larger side of the texture, 0 keeps the size stored in the file
+GLuint loadTexture(const char *filename, int maxSize = 0)
 {
-    //Load textures with dimension data
-    int width, height, nrChannels;
-    unsigned char *data = stbi_load(filename, &width, &height, &nrChannels, 0);
-    if (!data)
+    //Step1, skip decoding if an image with the same contents is already loaded
+    AssetBytes contents;
+    if (!loadAssetBytes(assetPack, filename, contents))
     {
         std::cerr << "error: texture could not be found in: " << filename << std::endl;
         return 0;
     }
+    uint64_t contentKey = hashContents(contents.data, contents.size, ASSET_SEED_TEXTURE + maxSize);
+    GLuint cachedTextureId = findCachedTexture(assetCache, contentKey);
+    if (cachedTextureId != 0)
+    {
+        return cachedTextureId;
+    }
 
     //Step2, create and bind textures.
     GLuint textureId = 0;
@@ -30,89 +95,26 @@ GLuint loadTexture(const char *filename)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    //Step4, upload the texture to the GPU.
-    GLenum format = 0;
-    if (nrChannels == 1)
-    {
-        format = GL_RED;
-    }
-    else if (nrChannels == 3)
+    //Step4, decode straight into upload memory and upload the texture to the GPU.
+    ImageDecodeRequest request;
+    request.maxWidth = maxSize;
+    request.maxHeight = maxSize;
+    ImageInfo info;
+    if (!decodeTexture2D(textureUploadRing, contents.data, contents.size, request, info))
     {
-        format = GL_RGB;
-    }
-    else if (nrChannels == 4)
-    {
-        format = GL_RGBA;
+        std::cerr << "error: texture could not be decoded: " << filename << std::endl;
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDeleteTextures(1, &textureId);
+        return 0;
     }
 
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-
     //Step 5, Free resources,
-    stbi_image_free(data);
     glBindTexture(GL_TEXTURE_2D, 0);
+    assetCache.textures[contentKey] = textureId;
     return textureId;
     //TODO: replace with texture loading code
 }
 
-const char *vertexShaderSource = R"(
-#version 330 core
-layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec2 aTexCoord;
-layout (location = 2) in vec3 aNormal;
-
-out vec2 TexCoord;
-out vec3 Normal;
-out vec3 FragPos;
-
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-
-void main() {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
-    TexCoord = aTexCoord;
-    Normal = mat3(transpose(inverse(model))) * aNormal;
-    FragPos = vec3(model * vec4(aPos, 1.0));
-}
-)";
-
-const char *fragmentShaderSource = R"(
-#version 330 core
-out vec4 FragColor;
-
-in vec2 TexCoord;
-in vec3 Normal;
-in vec3 FragPos;
-
-uniform sampler2D texture1;
-uniform vec3 lightPos;
-uniform vec3 viewPos;
-uniform vec3 lightColor;
-uniform vec3 objectColor;
-
-void main() {
-    // Ambient
-    float ambientStrength = 0.1;
-    vec3 ambient = ambientStrength * lightColor;
-
-    // Diffuse
-    vec3 norm = normalize(Normal);
-    vec3 lightDir = normalize(lightPos - FragPos);
-    float diff = max(dot(norm, lightDir), 0.0);
-    vec3 diffuse = diff * lightColor;
-
-    // Specular
-    float specularStrength = 0.5;
-    vec3 viewDir = normalize(viewPos - FragPos);
-    vec3 reflectDir = reflect(-lightDir, norm);
-    float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
-    vec3 specular = specularStrength * spec * lightColor;
-
-    vec3 result = (ambient + diffuse + specular) * objectColor * texture(texture1, TexCoord).rgb;
-    FragColor = vec4(result, 1.0);
-}
-)";
-
 struct Vertex
 {
     glm::vec3 position;
@@ -169,78 +171,34 @@ std::vector<unsigned int> getCubeIndices()
     return indices;
 }
 
-unsigned int createProceduralTexture(int width, int height, unsigned char *data)
+// Every draw picks its texture by layer, so one binding covers the whole multi-draw
+unsigned int createProceduralTextureArray(int width, int height, const unsigned char *const *layers, int count)
 {
+    // Generated images are content-addressed too, the size goes into the seed
+    uint64_t contentKey = ASSET_SEED_TEXTURE_ARRAY ^ ((uint64_t)width << 32 | (uint64_t)height);
+    for (int layer = 0; layer < count; layer++)
+        contentKey = hashContents(layers[layer], (size_t)width * height * 3, contentKey);
+    unsigned int cachedTextureID = findCachedTexture(assetCache, contentKey);
+    if (cachedTextureID != 0)
+        return cachedTextureID;
+
     unsigned int textureID;
     glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, width, height, count, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    for (int layer = 0; layer < count; layer++)
+        uploadTextureLayer(textureUploadRing, width, height, GL_RGB, layer, layers[layer]);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    assetCache.textures[contentKey] = textureID;
     return textureID;
 }
 
-unsigned int compileShader(unsigned int type, const char *source)
-{
-    unsigned int id = glCreateShader(type);
-    glShaderSource(id, 1, &source, nullptr);
-    glCompileShader(id);
-
-    int result;
-    glGetShaderiv(id, GL_COMPILE_STATUS, &result);
-    if (result == GL_FALSE)
-    {
-        int length;
-        glGetShaderiv(id, GL_INFO_LOG_LENGTH, &length);
-        char *message = new char[length];
-        glGetShaderInfoLog(id, length, &length, message);
-        std::cout << "Failed to compile " << (type == GL_VERTEX_SHADER ? "vertex" : "fragment") << " shader: " << message << std::endl;
-        delete[] message;
-        glDeleteShader(id);
-        return 0;
-    }
-
-    return id;
-}
-
-unsigned int createShaderProgram()
-{
-    unsigned int program = glCreateProgram();
-    unsigned int vs = compileShader(GL_VERTEX_SHADER, vertexShaderSource);
-    unsigned int fs = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
-
-    glAttachShader(program, vs);
-    glAttachShader(program, fs);
-    glLinkProgram(program);
-
-    // Check link status
-    int linkStatus;
-    glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
-    if (linkStatus == GL_FALSE)
-    {
-        int length;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
-        char *message = new char[length];
-        glGetProgramInfoLog(program, length, &length, message);
-        std::cout << "Failed to link shader program: " << message << std::endl;
-        delete[] message;
-        glDeleteProgram(program);
-        return 0;
-    }
-
-    glValidateProgram(program);
-
-    glDeleteShader(vs);
-    glDeleteShader(fs);
-
-    return program;
-}
-
 // Camera variables
 glm::vec3 cameraPos = glm::vec3(0.0f, 1.0f, 5.0f); // Moved slightly higher for better view
 glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
@@ -253,28 +211,57 @@ float lastY = 300.0f;
 bool firstMouse = true;
 
 float deltaTime = 0.0f;
-float lastFrame = 0.0f;
+double lastFrame = 0.0; // a float clock would lose precision over a long uptime
 
-void processInput(GLFWwindow *window)
+// Robot arm joint angles in degrees, advanced by the fixed-step simulation. Frames draw a blend
+// of the state before and after the last step.
+struct ArmState
 {
-    float currentFrame = glfwGetTime();
-    deltaTime = currentFrame - lastFrame;
+    float lr = 0.0f;
+    float ud = 0.0f;
+};
+ArmState arm, previousArm;
+
+void mouse_callback(GLFWwindow *window, double xpos, double ypos);
+
+// One simulation step, the arrow keys turn the second arm segment
+void stepArm(ArmState &state, const RenderContext &context, float step)
+{
+    const float rotationSpeed = 45.0f; // degrees per second
+    if (isRenderContextKeyDown(context, GLFW_KEY_LEFT))
+        state.lr += rotationSpeed * step;
+    if (isRenderContextKeyDown(context, GLFW_KEY_RIGHT))
+        state.lr -= rotationSpeed * step;
+    if (isRenderContextKeyDown(context, GLFW_KEY_UP))
+        state.ud += rotationSpeed * step;
+    if (isRenderContextKeyDown(context, GLFW_KEY_DOWN))
+        state.ud -= rotationSpeed * step;
+}
+
+void processInput(RenderContext &context)
+{
+    double currentFrame = renderContextTime(context);
+    deltaTime = (float)(currentFrame - lastFrame);
     lastFrame = currentFrame;
 
     float cameraSpeed = 2.5f * deltaTime;
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+    if (isRenderContextKeyDown(context, GLFW_KEY_ESCAPE))
+        closeRenderContext(context);
+    if (isRenderContextKeyDown(context, GLFW_KEY_W))
         cameraPos += cameraSpeed * cameraFront;
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+    if (isRenderContextKeyDown(context, GLFW_KEY_S))
         cameraPos -= cameraSpeed * cameraFront;
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+    if (isRenderContextKeyDown(context, GLFW_KEY_A))
         cameraPos -= glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+    if (isRenderContextKeyDown(context, GLFW_KEY_D))
         cameraPos += glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+
+    // The cursor is latched with the keys, so a replayed path turns the camera too
+    double cursorX, cursorY;
+    getRenderContextCursor(context, cursorX, cursorY);
+    if (firstMouse || (float)cursorX != lastX || (float)cursorY != lastY)
+        mouse_callback(context.window, cursorX, cursorY);
 }
 
 void mouse_callback(GLFWwindow *window, double xpos, double ypos)
@@ -315,78 +302,86 @@ void scroll_callback(GLFWwindow *window, double xoffset, double yoffset)
     // Unused for now
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    if (!glfwInit())
+    // -headless renders offscreen, -frames N and -duration S end the run on their own
+    parseRenderContextArguments(renderContext, argc, argv);
+    parseBenchmarkArguments(frameBenchmark, renderContext, argc, argv);
+    parseProfilerArguments(argc, argv);
+    parseDepthPrepassArguments(depthPrepass, argc, argv);
+    parseFramePacingArguments(framePacer, argc, argv);
+    parseCommandListArguments(commandRecorder, argc, argv);
+    parseFixedTimestepArguments(simulation, argc, argv);
+    if (!createRenderContext(renderContext, "3D Interactive Robot Arm", 3, 3, true))
     {
-        std::cout << "Failed to initialize GLFW" << std::endl;
+        destroyRenderContext(renderContext);
         return -1;
     }
-
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-
-    GLFWwindow *window = glfwCreateWindow(800, 600, "3D Interactive Robot Arm", nullptr, nullptr);
-    if (window == nullptr)
+    startProfiler();
+    startWorkerPool(workerPool);
+    createFramePacer(framePacer, renderContext);
+    if (renderContext.window != nullptr)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+        glfwSetInputMode(renderContext.window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+        glfwSetScrollCallback(renderContext.window, scroll_callback);
     }
 
-    glfwMakeContextCurrent(window);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetScrollCallback(window, scroll_callback);
-
-    if (glewInit() != GLEW_OK)
-    {
-        std::cout << "Failed to initialize GLEW" << std::endl;
-        return -1;
-    }
+    cachedEnable(glState, GL_DEPTH_TEST);
 
-    glViewport(0, 0, 800, 600);
-    glEnable(GL_DEPTH_TEST);
+    createTextureUploadRing(textureUploadRing, 4 * 1024 * 1024);
+    openAssetPackNearExecutable(assetPack, argv[0]);
+    initShaderCache(shaderCache);
 
-    unsigned int shaderProgram = createShaderProgram();
-    if (shaderProgram == 0)
+    // The cube vertex layout is position, texcoord, normal
+    shaderLibrary.layout.texCoord = 1;
+    shaderLibrary.layout.normal = 2;
+    initShaderLibrary(shaderLibrary, &shaderCache);
+    if (shaderLibrary.placeholders[0]->id() == 0)
     {
         std::cout << "Shader program creation failed" << std::endl;
         return -1;
     }
 
+    // Uniforms and draw data for the robot's parts, the ring grows if a frame needs more
+    createDynamicBufferRing(dynamicBufferRing, 256 * 1024);
+    createUniformBuffers(uniformBuffers, 1);
+
+    // Every part is a lit, textured draw of the multi-draw renderer, which feeds each draw's
+    // world and normal matrix to the instanced variant. It compiles while the geometry and
+    // textures below are set up.
+    const uint32_t robotShaderFeatures = SHADER_LIT | SHADER_TEXTURED | SHADER_INSTANCED | SHADER_CPU_NORMAL_MATRIX;
+    requestShaderVariant(shaderLibrary, robotShaderFeatures);
+    const uint32_t depthShaderFeatures = SHADER_DEPTH_ONLY | SHADER_INSTANCED;
+    requestShaderVariant(shaderLibrary, depthShaderFeatures);
+    createDepthPrepass(depthPrepass);
+
+    // Static geometry goes into the renderer's shared buffers, the floor and the arm parts
+    // are all draws of the one cube mesh
     std::vector<Vertex> cubeVertices = getCubeVertices();
     std::vector<unsigned int> cubeIndices = getCubeIndices();
-
-    unsigned int VAO, VBO, EBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
-
-    glBindVertexArray(VAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, cubeVertices.size() * sizeof(Vertex), cubeVertices.data(), GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, cubeIndices.size() * sizeof(unsigned int), cubeIndices.data(), GL_STATIC_DRAW);
-
-    // Position
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, position));
-    glEnableVertexAttribArray(0);
-
-    // TexCoord
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, texCoord));
-    glEnableVertexAttribArray(1);
-
-    // Normal
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, normal));
-    glEnableVertexAttribArray(2);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    std::vector<MeshVertex> cubeMeshVertices(cubeVertices.size());
+    for (size_t i = 0; i < cubeVertices.size(); i++)
+    {
+        cubeMeshVertices[i].position = cubeVertices[i].position;
+        cubeMeshVertices[i].normal = cubeVertices[i].normal;
+        cubeMeshVertices[i].texCoord = cubeVertices[i].texCoord;
+    }
+    int cubeMesh = addMesh(multiDrawRenderer, cubeMeshVertices.data(), cubeMeshVertices.size(), cubeIndices.data(), cubeIndices.size());
+    buildMultiDrawBuffers(multiDrawRenderer, shaderLibrary.layout, 4);
+    const float cubeRadius = 0.8660254f; // the unit cube's corners, sqrt(3) / 2 from its center
+    CullingSpheres partSpheres;
+    std::vector<uint32_t> visibleParts;
+
+    // Every part is an occluder for the others, the cube's own triangles are exact
+    OcclusionBuffer occlusionBuffer;
+    initOcclusionBuffer(occlusionBuffer);
+    OccluderMesh cubeOccluder;
+    for (const Vertex &vertex : cubeVertices)
+        cubeOccluder.positions.push_back(vertex.position);
+    cubeOccluder.indices.assign(cubeIndices.begin(), cubeIndices.end());
+    std::vector<OcclusionBox> partBoxes;
+    std::vector<uint8_t> unoccludedParts;
+    initCommandRecorder(commandRecorder);
 
     // Generate procedural textures
     const int TEX_SIZE = 16;
@@ -411,7 +406,6 @@ int main()
             }
         }
     }
-    unsigned int texture1 = createProceduralTexture(TEX_SIZE, TEX_SIZE, texData1);
 
     // Texture 2: Blue/green stripes
     unsigned char texData2[TEX_SIZE * TEX_SIZE * 3];
@@ -434,7 +428,6 @@ int main()
             }
         }
     }
-    unsigned int texture2 = createProceduralTexture(TEX_SIZE, TEX_SIZE, texData2);
 
     // Texture 3: Yellow/black checker
     unsigned char texData3[TEX_SIZE * TEX_SIZE * 3];
@@ -457,7 +450,6 @@ int main()
             }
         }
     }
-    unsigned int texture3 = createProceduralTexture(TEX_SIZE, TEX_SIZE, texData3);
 
     // Floor texture: Gray stripes
     unsigned char texData4[TEX_SIZE * TEX_SIZE * 3];
@@ -480,108 +472,180 @@ int main()
             }
         }
     }
-    unsigned int texture4 = createProceduralTexture(TEX_SIZE, TEX_SIZE, texData4);
+
+    // Layers 0-3: checkerboard, stripes, yellow checker, floor
+    const unsigned char *textureLayers[4] = {texData1, texData2, texData3, texData4};
+    unsigned int robotTextures = createProceduralTextureArray(TEX_SIZE, TEX_SIZE, textureLayers, 4);
 
     glm::vec3 lightPos(0.0f, 5.0f, 0.0f);
     glm::vec3 lightColor(1.0f, 1.0f, 1.0f);
 
  
 
-    while (!glfwWindowShouldClose(window)) {
-        main
-        processInput(window);
+    // Loading bound objects behind the state cache's back, from here on it is kept up to date
+    invalidateGLState(glState);
+
+    while (renderContextRunning(renderContext)) {
+        PROFILE_SCOPE("Frame");
+        PROFILE_GPU_SCOPE("Frame");
+        beginBenchmarkFrame(frameBenchmark, renderContext);
+        beginGLStateFrame(glState);
+        waitForFrameSlot(framePacer, renderContext);
+        beginDynamicBufferFrame(dynamicBufferRing);
+
+        // Input is latched after the waits, as close as possible to where the camera uses it
+        beginRenderContextFrame(renderContext);
+        processInput(renderContext);
+        updateDepthPrepassKeys(depthPrepass, renderContext);
+
+        // The arm moves in fixed steps, however many this frame's time covers, and is drawn
+        // between the last two
+        for (int steps = advanceFixedTimestep(simulation, renderContextTime(renderContext)); steps > 0; steps--)
+        {
+            previousArm = arm;
+            stepArm(arm, renderContext, (float)simulation.stepSeconds);
+        }
+        float arm2LR = glm::mix(previousArm.lr, arm.lr, (float)simulation.alpha);
+        float arm2UD = glm::mix(previousArm.ud, arm.ud, (float)simulation.alpha);
 
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        glUseProgram(shaderProgram);
+        // The placeholder stands in until the robot shader has finished compiling
+        pollShaderVariants(shaderLibrary);
+        ShaderProgram &shaderProgram = getShaderVariant(shaderLibrary, robotShaderFeatures);
+        shaderProgram.use();
 
+        const float farPlane = 100.0f;
         glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
-
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-
-        glUniform3f(glGetUniformLocation(shaderProgram, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
-        glUniform3f(glGetUniformLocation(shaderProgram, "viewPos"), cameraPos.x, cameraPos.y, cameraPos.z);
-        glUniform3f(glGetUniformLocation(shaderProgram, "lightColor"), lightColor.x, lightColor.y, lightColor.z);
-
-        glBindVertexArray(VAO);
-
-        float time = glfwGetTime();
-
-        const float rotationSpeed = 45.0f; // degrees per second
-
-    
-
-        if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS)
-            arm2LR += rotationSpeed * deltaTime;
-        if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
-            arm2LR -= rotationSpeed * deltaTime;
-
-        if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
-            arm2UD += rotationSpeed * deltaTime;
-        if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
-            arm2UD -= rotationSpeed * deltaTime;
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)renderContext.width / renderContext.height, 0.1f, farPlane);
 
+        // Camera and light are written once per frame, whichever programs end up drawing
+        FrameUniforms frame;
+        frame.viewMatrix = view;
+        frame.projectionMatrix = projection;
+        frame.lightPos = glm::vec4(lightPos, 1.0f);
+        frame.lightColor = glm::vec4(lightColor, 1.0f);
+        frame.viewPos = glm::vec4(cameraPos, 1.0f);
+        updateFrameUniforms(uniformBuffers, frame);
 
         // Floor
         glm::mat4 modelFloor = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.0f)), glm::vec3(10.0f, 0.1f, 10.0f));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelFloor));
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 1.0f, 1.0f, 1.0f);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture4);
-        glUniform1i(glGetUniformLocation(shaderProgram, "texture1"), 0);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
 
         // Hierarchical robot arm
         // Base
         glm::mat4 modelBase = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.3f, 0.0f)), glm::vec3(2.5f, 0.5f, 2.5f));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelBase));
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 1.0f, 1.0f, 1.0f);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture1);
-        glUniform1i(glGetUniformLocation(shaderProgram, "texture1"), 0);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
 
         // Arm1 (child of base, rotating)
         glm::mat4 modelArm1 = modelBase * glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 3.75f, 0.0f)) 
                                         * glm::rotate(glm::mat4(1.0f), 0.0f,  glm::vec3(0.0f, 1.0f, 0.0f)) 
                                         * glm::scale(glm::mat4(1.0f), glm::vec3(0.4f, 7.0f, 0.4f));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelArm1));
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 1.0f, 1.0f, 1.0f);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture2);
-        glUniform1i(glGetUniformLocation(shaderProgram, "texture1"), 0);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
-
-        // Arm2 (child of arm1, rotating faster)                                        
-        glm::mat4 modelArm2 = modelArm1 * glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.0f))                    
-                                        * glm::rotate(glm::mat4(1.0f), glm::radians(arm2LR), glm::vec3(0.0f, 1.0f, 0.0f))  
-                                        * glm::rotate(glm::mat4(1.0f), glm::radians(arm2UD), glm::vec3(1.0f, 0.0f, 0.0f))  
-                                        * glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 1.0f, 0.0f))                    
-                                        * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f, 1.0f, 0.5f));                        
-
-                                        
-                                    
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelArm2));
-        glUniform3f(glGetUniformLocation(shaderProgram, "objectColor"), 1.0f, 1.0f, 1.0f);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture3);
-        glUniform1i(glGetUniformLocation(shaderProgram, "texture1"), 0);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
-
-        glBindVertexArray(0);
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
-    }
 
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteBuffers(1, &EBO);
-    glDeleteProgram(shaderProgram);
+        // Arm2 (child of arm1, rotating faster)
+        glm::mat4 modelArm2 = modelArm1 * glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.0f))
+                                        * glm::rotate(glm::mat4(1.0f), glm::radians(arm2LR), glm::vec3(0.0f, 1.0f, 0.0f))
+                                        * glm::rotate(glm::mat4(1.0f), glm::radians(arm2UD), glm::vec3(1.0f, 0.0f, 0.0f))
+                                        * glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 1.0f, 0.0f))
+                                        * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f, 1.0f, 0.5f));
+
+        // The object block only places the scene as a whole, each part's own matrices are
+        // per-draw data
+        beginObjectUniforms(uniformBuffers);
+        int sceneObject = addObjectUniforms(uniformBuffers, makeObjectUniforms(glm::mat4(1.0f), glm::mat3(1.0f), glm::vec3(1.0f, 1.0f, 1.0f)));
+        uploadObjectUniforms(uniformBuffers);
+
+        // Parts whose bounding sphere is outside the view are never recorded
+        glm::mat4 models[4] = {modelFloor, modelBase, modelArm1, modelArm2};
+        int partLayers[4] = {3, 0, 1, 2};
+        clearCullingSpheres(partSpheres);
+        for (int i = 0; i < 4; i++)
+        {
+            glm::vec3 center;
+            float radius;
+            transformBoundingSphere(models[i], glm::vec3(0.0f), cubeRadius, center, radius);
+            addCullingSphere(partSpheres, center, radius);
+        }
+        cullSpheres(extractFrustumPlanes(projection * view), partSpheres, visibleParts);
+
+        // Nor are parts hidden behind the others, the floor hides the whole robot from below
+        beginOcclusionFrame(occlusionBuffer, projection * view);
+        partBoxes.clear();
+        for (uint32_t i : visibleParts)
+        {
+            addOccluder(occlusionBuffer, cubeOccluder, models[i]);
+            partBoxes.push_back(makeOcclusionBox(models[i], glm::vec3(-0.5f), glm::vec3(0.5f)));
+        }
+        rasterizeOccluders(occlusionBuffer);
+        testOcclusion(occlusionBuffer, partBoxes, unoccludedParts);
+
+        // Keyed by program, texture and mesh first, then front to back by the distance of
+        // each part's center unless the ordering is switched off. The parts are recorded as
+        // commands, on worker threads once there are enough of them, and replayed here. The
+        // commands point into partInstances, which stays put until the replay.
+        GLuint robotProgram = shaderProgram.id();
+        bool frontToBack = depthPrepass.frontToBack;
+        InstanceData partInstances[4];
+        recordCommandLists(commandRecorder, visibleParts.size(), [&](CommandList &list, size_t begin, size_t end) {
+            for (size_t part = begin; part < end; part++)
+            {
+                if (!unoccludedParts[part])
+                    continue;
+                uint32_t i = visibleParts[part];
+                float depth = frontToBack ? -(view * models[i][3]).z / farPlane : 0.0f;
+                uint64_t sortKey = makeSortKey(RENDER_PASS_OPAQUE, robotProgram, robotTextures, (uint32_t)cubeMesh, depth);
+                partInstances[i] = makeInstanceData(models[i], partLayers[i], glm::vec4(1.0f));
+                recordDraw(list, (uint32_t)cubeMesh, sortKey, partInstances[i]);
+            }
+        });
+        beginMultiDraw(multiDrawRenderer);
+        replayCommandLists(commandRecorder, multiDrawRenderer);
+
+        // One upload for the whole robot, drawn into the depth buffer first with the pre-pass
+        uploadMultiDraw(multiDrawRenderer);
+        bindObjectUniforms(uniformBuffers, sceneObject);
+        if (beginDepthPrepass(depthPrepass))
+        {
+            getShaderVariant(shaderLibrary, depthShaderFeatures).use();
+            drawMultiDraw(multiDrawRenderer);
+        }
+
+        // Then one texture binding and one submission that runs the Phong shader
+        beginShadingPass(depthPrepass);
+        shaderProgram.use();
+        cachedActiveTexture(glState, 0);
+        cachedBindTexture(glState, GL_TEXTURE_2D_ARRAY, robotTextures);
+        shaderProgram.setInt(UNIFORM_DIFFUSE_TEXTURE_ARRAY, 0);
+        drawMultiDraw(multiDrawRenderer);
+        endShadingPass(depthPrepass);
+
+        endBenchmarkFrame(frameBenchmark, glState);
+        endDynamicBufferFrame(dynamicBufferRing);
+        endRenderContextFrame(renderContext);
+        endPacedFrame(framePacer, renderContext);
+        endProfilerFrame(isRenderContextKeyDown(renderContext, GLFW_KEY_F12));
+    }
 
-    glfwTerminate();
+    finishFrameBenchmark(frameBenchmark, renderContext, "project1");
+
+    printGLStateStats(glState);
+    printDynamicBufferStats(dynamicBufferRing);
+    printDepthPrepassStats(depthPrepass);
+    printFramePacingStats(framePacer);
+    printOcclusionStats(occlusionBuffer);
+    printCommandListStats(commandRecorder);
+    printFixedTimestepStats(simulation);
+    destroyMultiDrawRenderer(multiDrawRenderer);
+    destroyDepthPrepass(depthPrepass);
+    destroyFramePacer(framePacer);
+    releaseShaderLibrary(shaderLibrary);
+    destroyUniformBuffers(uniformBuffers);
+    destroyDynamicBufferRing(dynamicBufferRing);
+    releaseAssetCache(assetCache);
+    destroyTextureUploadRing(textureUploadRing);
+    closeAssetPack(assetPack);
+
+    stopWorkerPool(workerPool);
+    stopProfiler();
+    destroyRenderContext(renderContext);
     return 0;
 }
\ No newline at end of file